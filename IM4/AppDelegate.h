@@ -33,6 +33,7 @@
 #import "ConversationWindowController.h"
 
 #import "xmpp.h"
+#import "pipeline.h"
 
 @interface AppDelegate : NSObject <NSApplicationDelegate>
 
@@ -90,7 +91,7 @@
 
 - (void) addUnread:(int)num;
 
-- (void) handleXmppMessage:(const char*)msg_body from:(const char*)from session:(XmppSession*)session secure:(BOOL)secure xmpp:(Xmpp*)xmpp;
+- (void) handleXmppMessage:(InboundMessage*)msg session:(XmppSession*)session xmpp:(Xmpp*)xmpp;
 
 - (void) sendUserNotification:(NSString*)msg from:(NSString*)from secure:(BOOL)secure;
 
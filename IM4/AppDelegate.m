@@ -126,6 +126,14 @@ static const char * presencenum2str(int num) {
     
     [_settingsController storeSettings];
     
+    // write pending otr fingerprint changes
+    if(_xmpp) {
+        XmppFlushOtr(_xmpp, 2000);
+    }
+    
+    // commit queued history messages
+    [_settingsController closeHistory];
+    
     NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
     NSRect frame = _window.frame;
     NSArray *array = @[
@@ -278,21 +286,18 @@ static const char * presencenum2str(int num) {
     return alias != nil ? alias : xid;
 }
 
-- (void) handleXmppMessage:(const char*)msg_body from:(const char*)from session:(XmppSession*)session secure:(BOOL)secure xmpp:(Xmpp*)xmpp {
-    NSString *xid = [[NSString alloc] initWithUTF8String:session->conversation->xid];
+- (void) handleXmppMessage:(InboundMessage*)msg session:(XmppSession*)session xmpp:(Xmpp*)xmpp {
     NSString *resource = [[NSString alloc] initWithUTF8String:session->resource];
-    NSString *alias = [_settingsController getAlias:xid];
-    NSString *message_text = [[NSString alloc]initWithUTF8String:msg_body];
-    
-    if(!alias) {
-        alias = xid;
-    }
+    NSString *alias = [[NSString alloc] initWithUTF8String:msg->alias];
+    NSString *entry = [[NSString alloc] initWithUTF8String:msg->html];
     
+    // the log entry was already created by the pipeline in the xmpp thread
     ConversationWindowController *conversation = [self conversationController:session];
-    [conversation addReceivedMessage:message_text resource:resource secure:secure];
+    [conversation addReceivedEntry:entry resource:resource secure:msg->secure historyTimestamp:msg->history_timestamp];
     
     if(!_doNotDisturb && _notificationsItem.state == NSControlStateValueOn) {
-        [self sendUserNotification:message_text from:alias secure:secure];
+        NSString *message_text = [[NSString alloc]initWithUTF8String:msg->message];
+        [self sendUserNotification:message_text from:alias secure:msg->secure];
     }
 }
 
@@ -568,6 +573,9 @@ static const char * presencenum2str(int num) {
 
 - (IBAction) menuDebugLog:(id)sender {
     [_logWindowController showWindow:nil];
+    if(_xmpp) {
+        XmppLogLoopStats(_xmpp);
+    }
 }
 
 - (IBAction) menuContactList:(id)sender {
@@ -68,11 +68,13 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (void)addLog:(NSString*)message incoming:(Boolean)incoming secure:(Boolean)secure;
 
+- (void)addLogEntry:(NSString*)entry;
+
 - (void)sendMessage:(Boolean)force;
 
 - (void)sendState:(enum XmppChatstate) state;
 
-- (void)addReceivedMessage:(NSString*)msg resource:(NSString*)res secure:(BOOL)secure;
+- (void)addReceivedEntry:(NSString*)entry resource:(NSString*)res secure:(BOOL)secure historyTimestamp:(int64_t)timestamp;
 
 - (void)clearChatStateMsg;
 
@@ -32,67 +32,23 @@
 
 #include "xmpp.h"
 #include "regexreplace.h"
+#include "htmlescape.h"
+#include "historyreader.h"
 
-static NSString* escape_input(NSString *input) {
-    NSMutableString *inputEscaped = [[NSMutableString alloc] init];
-    [input enumerateSubstringsInRange:NSMakeRange(0, [input length])  options:NSStringEnumerationByComposedCharacterSequences usingBlock:^(NSString *substring, NSRange substringRange, NSRange enclosingRange, BOOL *outStop) {
+// number of history messages loaded at once
+#define HISTORY_PAGE_SIZE 50
 
-        const char *s = [substring UTF8String];
-        switch(*s) {
-            default: {
-                
-                [inputEscaped appendString:substring];
-                break;
-            }
-            case '<': {
-                [inputEscaped appendString:@"&lt;"];
-                break;
-            }
-            case '>': {
-                [inputEscaped appendString:@"&gt;"];
-                break;
-            }
-            case '&' : {
-                [inputEscaped appendString:@"&amp;"];
-                break;
-            }
-            case '"': {
-                [inputEscaped appendString:@"&quot;"];
-                break;
-            }
-            case '\'': {
-                [inputEscaped appendString:@"&#39;"];
-                break;
-            }
-        }
-    }];
-    
-    return inputEscaped;
-}
+// older history messages are loaded, when the view is scrolled
+// closer than this to the top
+#define HISTORY_LOAD_DISTANCE 200
 
 static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
-    NSMutableString *inputEscaped = [[NSMutableString alloc] init];
-    
-    NSString *regex = @"https?:\\/\\/{1}[a-zA-Z0-9u00a1-\\uffff0-]{2,}\\.[a-zA-Z0-9u00a1-\\uffff0-]{2,}(\\S*)";
-    
-    NSRange url = [input rangeOfString:regex options:NSRegularExpressionSearch];
-    while(url.location != NSNotFound) {
-        NSString *urlStr = [input substringWithRange:url];
-        
-        NSString *pre = [input substringToIndex:url.location];
-        [inputEscaped appendString:escape?escape_input(pre):pre];
-        [inputEscaped appendString:@"<a href=\""];
-        [inputEscaped appendString:urlStr];
-        [inputEscaped appendString:@"\">"];
-        [inputEscaped appendString:escape?escape_input(urlStr):urlStr];
-        [inputEscaped appendString:@"</a>"];
-        
-        input = [input substringFromIndex:url.location + url.length];
-        url = [input rangeOfString:regex options:NSRegularExpressionSearch];
-    }
-    [inputEscaped appendString:escape?escape_input(input):input];
-    
-    return inputEscaped;
+    const char *str = [input UTF8String];
+    size_t len;
+    char *html = html_linkify(str, strlen(str), escape, &len);
+    NSString *ret = [[NSString alloc] initWithBytes:html length:len encoding:NSUTF8StringEncoding];
+    free(html);
+    return ret;
 }
 
 @interface ConversationWindowController ()
@@ -105,6 +61,13 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
 
 @property BOOL fontInitialized;
 
+@property TextReplacementScope rulesScope;
+
+@property HistoryReader *history;
+@property size_t historyPos; // position of the oldest loaded history message
+@property int64_t historyEnd; // timestamp of the newest history message
+@property BOOL historyLoading;
+
 @end
 
 @implementation ConversationWindowController
@@ -145,12 +108,106 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
     _conversationTextView.font = app.settingsController.ChatFont;
     
     [self updateStatus];
+    [self openHistory];
     
     if(_conversation->nsessions > 1) {
         [self addStringToLog:@"xmpp: multiple sessions available\n"];
     }
 }
 
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    if(_history) {
+        history_reader_close(_history);
+    }
+}
+
+- (void)openHistory {
+    AppDelegate *app = (AppDelegate *)[NSApplication sharedApplication].delegate;
+    NSString *historyDir = app.settingsController.historyDir;
+    if(!historyDir) {
+        return;
+    }
+    
+    // the reader contains only committed messages
+    // received messages, that are already in the reader, are not added
+    // again (see addReceivedEntry)
+    _history = history_reader_open([historyDir UTF8String], [_xid UTF8String]);
+    if(!_history) {
+        return;
+    }
+    _historyPos = history_reader_count(_history);
+    if(_historyPos > 0) {
+        _historyEnd = history_reader_timestamp(_history, _historyPos - 1);
+    }
+    [self loadHistoryPage];
+    [_conversationTextView scrollToEndOfDocument:nil];
+    
+    NSClipView *clipView = _conversationTextView.enclosingScrollView.contentView;
+    clipView.postsBoundsChangedNotifications = YES;
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(conversationScrolled:)
+                                                 name:NSViewBoundsDidChangeNotification
+                                               object:clipView];
+}
+
+- (void)conversationScrolled:(NSNotification*)notification {
+    NSClipView *clipView = notification.object;
+    if(_historyPos > 0 && !_historyLoading && clipView.bounds.origin.y < HISTORY_LOAD_DISTANCE) {
+        _historyLoading = YES;
+        [self loadHistoryPage];
+        _historyLoading = NO;
+    }
+}
+
+/*
+ * inserts the history page before _historyPos at the top of the log
+ */
+- (void)loadHistoryPage {
+    size_t pos = _historyPos > HISTORY_PAGE_SIZE ? _historyPos - HISTORY_PAGE_SIZE : 0;
+    HistoryMessage messages[HISTORY_PAGE_SIZE];
+    size_t n = history_reader_page(_history, pos, _historyPos - pos, messages);
+    _historyPos = pos;
+    if(n == 0) {
+        return;
+    }
+    
+    NSMutableString *html = [[NSMutableString alloc]init];
+    for(size_t i=0;i<n;i++) {
+        char *message = strndup(messages[i].body, messages[i].length);
+        [html appendString:[self renderLog:message
+                                  incoming:!(messages[i].flags & HISTORY_OUT)
+                                    secure:(messages[i].flags & HISTORY_SECURE) != 0
+                                      time:messages[i].timestamp / 1000]];
+        free(message);
+    }
+    
+    NSData* data = [html dataUsingEncoding:NSUTF8StringEncoding];
+    NSDictionary *options = @{NSDocumentTypeDocumentAttribute: NSHTMLTextDocumentType,
+                              NSCharacterEncodingDocumentAttribute: @(NSUTF8StringEncoding)};
+    NSAttributedString *attributedText = [[NSAttributedString alloc] initWithHTML:data
+                                                                          options:options
+                                                               documentAttributes:nil];
+    
+    // keep the visible part of the log at the same position
+    NSScrollView *scrollview = [_conversationTextView enclosingScrollView];
+    NSClipView *clipView = scrollview.contentView;
+    CGFloat height = _conversationTextView.frame.size.height;
+    
+    [_conversationTextView.textStorage insertAttributedString:attributedText atIndex:0];
+    if(!_fontInitialized) {
+        AppDelegate *app = (AppDelegate *)[NSApplication sharedApplication].delegate;
+        _conversationTextView.font = app.settingsController.ChatFont;
+        _fontInitialized = YES;
+    }
+    [_conversationTextView.layoutManager ensureLayoutForTextContainer:_conversationTextView.textContainer];
+    
+    NSPoint origin = clipView.bounds.origin;
+    origin.y += _conversationTextView.frame.size.height - height;
+    [clipView scrollToPoint:origin];
+    [scrollview reflectScrolledClipView:clipView];
+}
+
 - (void)updateStatus {
     AppDelegate *app = (AppDelegate *)[NSApplication sharedApplication].delegate;
     Presence *status = [app xidStatus:_xid];
@@ -492,12 +549,10 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
 
 
 - (void)addLog:(NSString*)message incoming:(Boolean)incoming secure:(Boolean)secure {
-    NSScrollView *scrollview = [_conversationTextView enclosingScrollView];
-    CGFloat scrollProp = scrollview.verticalScroller.knobProportion;
-    double scrollPos = scrollview.verticalScroller.doubleValue;
-    bool scrollToEnd = scrollProp == 0 || scrollPos + 0.0001 > 1 ? true : false;
-    
-    
+    [self addLogEntry:[self renderLog:[message UTF8String] incoming:incoming secure:secure time:time(NULL)]];
+}
+
+- (NSString*)renderLog:(const char*)message incoming:(Boolean)incoming secure:(Boolean)secure time:(time_t)t {
     NSString *name;
     if(incoming) {
         name = _alias;
@@ -506,23 +561,22 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
         name = [[NSString alloc]initWithUTF8String: my_alias];
     }
     
-    NSString *color = incoming ? @"red" : @"blue";
-    
-    NSString *htmlFormat = nil;
-    if(incoming) {
-        htmlFormat = _tpl.htmlMsgInFormat;
-    } else {
-        htmlFormat = _tpl.htmlMsgOutFormat;
-    }
-    
-    NSString *entry;
-    if(htmlFormat == nil) {
-        // no html format defined, use plain text msg prefix settings
-        NSString *msgPrefix = [_tpl msgPrefixFormatWithFormat:incoming ? _tpl.msgInPrefixFormat : _tpl.msgOutPrefixFormat xid:_xid alias:name secure:secure message:@""];
-        entry = [NSString stringWithFormat:@"<pre style=\"font-family: -apple-system\"><span style=\"color: %@\">%@</span>%@</pre>", color, msgPrefix, message];
-    } else {
-        entry = [_tpl msgPrefixFormatWithFormat:htmlFormat xid:_xid alias:name secure:secure message:message];
-    }
+    AppDelegate *app = (AppDelegate *)[NSApplication sharedApplication].delegate;
+    MsgTemplate *tpl = incoming ? app.settingsController.msgInTemplate : app.settingsController.msgOutTemplate;
+    
+    char time_str[16];
+    msg_template_format_time(time_str, t);
+    MsgTemplateValues values = { time_str, [_xid UTF8String], [name UTF8String], secure, message };
+    size_t len;
+    char *entry = msg_template_render(tpl, &values, &len);
+    return [[NSString alloc] initWithBytesNoCopy:entry length:len encoding:NSUTF8StringEncoding freeWhenDone:YES];
+}
+
+- (void)addLogEntry:(NSString*)entry {
+    NSScrollView *scrollview = [_conversationTextView enclosingScrollView];
+    CGFloat scrollProp = scrollview.verticalScroller.knobProportion;
+    double scrollPos = scrollview.verticalScroller.doubleValue;
+    bool scrollToEnd = scrollProp == 0 || scrollPos + 0.0001 > 1 ? true : false;
     
     NSTextStorage *textStorage = _conversationTextView.textStorage;
     
@@ -598,7 +652,7 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
     
     // apply outgoing message filters
     char *msg = strdup([_messageInput.string UTF8String]);
-    apply_all_rules(&msg);
+    apply_scoped_rules(&_rulesScope, [_xid UTF8String], TEXT_REPLACEMENT_OUT, &msg);
     NSString *input = [[NSString alloc]initWithUTF8String:msg];
     free(msg);
     
@@ -625,6 +679,7 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
         msgSent = TRUE;
     }
     
+    XmppHistoryAdd(_xmpp, [_xid UTF8String], true, _secure, [inputEscaped UTF8String]);
     [self addLog:inputEscaped incoming:FALSE secure:_secure];
     _composing = FALSE;
     [_messageInput setString:@""];
@@ -640,8 +695,11 @@ static NSString* convert_urls_to_links(NSString *input, BOOL escape) {
     }
 }
 
-- (void)addReceivedMessage:(NSString*)msg resource:(NSString*)res secure:(BOOL)secure {
-    [self addLog:msg incoming:TRUE secure:secure];
+- (void)addReceivedEntry:(NSString*)entry resource:(NSString*)res secure:(BOOL)secure historyTimestamp:(int64_t)timestamp {
+    if(timestamp != 0 && timestamp <= _historyEnd) {
+        return; // already loaded from the history
+    }
+    [self addLogEntry:entry];
     
     if(![self.window isKeyWindow]) {
         _unread++;
@@ -28,6 +28,7 @@
 
 #import <Cocoa/Cocoa.h>
 #import "xmpp.h"
+#import "msgtemplate.h"
 
 #import "IM4-Bridging-Header.h"
 #import "IM4-Swift.h"
@@ -56,6 +57,17 @@ NS_ASSUME_NONNULL_BEGIN
 
 @property (readonly) TemplateSettingsController *tplController;
 
+/*
+ * compiled conversation log templates
+ */
+@property (readonly) MsgTemplate *msgInTemplate;
+@property (readonly) MsgTemplate *msgOutTemplate;
+
+/*
+ * history directory of the current account or nil, if disabled
+ */
+@property (readonly) NSString *historyDir;
+
 @property int UnencryptedMessages;
 @property int MakeWindowVisible;
 
@@ -91,6 +103,10 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (BOOL) storeSettings;
 
+- (void) updateMessageTemplates;
+
+- (void) closeHistory;
+
 - (void) createFingerprintFromPubkey;
 
 - (void) changeFont:(nullable NSFontManager*)fontManager;
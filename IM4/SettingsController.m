@@ -35,6 +35,7 @@
 
 #import "app.h"
 #import "regexreplace.h"
+#import "pipeline.h"
 
 #import <sys/stat.h>
 #import <unistd.h>
@@ -74,6 +75,11 @@ static bool nsstreq(NSString *s1, NSString *s2) {
 
 @property int editFont; // 1: ChatFont, 2: InputFont
 
+// history directory -> HistoryStore (NSValue)
+// the stores stay open until the app terminates, because the xmpp thread
+// of a replaced xmpp object can still add messages
+@property (strong) NSMutableDictionary *historyStores;
+
 @end
 
 @implementation SettingsController
@@ -117,12 +123,27 @@ static bool nsstreq(NSString *s1, NSString *s2) {
         printf("cannot load %s\n", REGEX_TEXT_REPLACEMENT_RULES_FILE);
     }
     
+    // time budget (ms) for the text replacement rules per message
+    NSNumber *rulesBudget = [_config valueForKey:@"rulesbudget"];
+    double rulesBudgetMs = rulesBudget ? rulesBudget.doubleValue : 200;
+    if(rulesBudgetMs > 0) {
+        NSString *rulesBudgetPolicy = [_config valueForKey:@"rulesbudgetpolicy"];
+        set_rules_budget(
+                rulesBudgetMs * 1000000,
+                [rulesBudgetPolicy isEqualToString:@"original"] ? TEXT_REPLACEMENT_BUDGET_ORIGINAL : TEXT_REPLACEMENT_BUDGET_SKIP);
+    }
+    
     NSString *templateFilePath = [self configFilePath:@"uitemplates.plist"];
     _templateSettingsDict = [NSMutableDictionary dictionaryWithContentsOfFile:templateFilePath];
     if (!_templateSettingsDict) {
         _templateSettingsDict = [[NSMutableDictionary alloc] init];
     }
     _templateSettings = [[UITemplate alloc]initWithConfigDict:_templateSettingsDict];
+    [self updateMessageTemplates];
+    for(NSString *xid in _aliases) {
+        NSString *alias = [_aliases valueForKey:xid];
+        pipeline_set_alias([xid UTF8String], [alias UTF8String]);
+    }
     
     NSNumber *logLevelNum = [_config valueForKey:@"loglevel"];
     if(logLevelNum) {
@@ -313,6 +334,7 @@ static bool nsstreq(NSString *s1, NSString *s2) {
     [_logLevel selectItemAtIndex:logLevel];
     [_presenceStatus selectItemAtIndex:_StartupPresence];
     
+    [self createFingerprintFromPubkey];
     if(_fingerprint) {
         _otrFingerprint.stringValue = [NSString stringWithFormat:@"Fingerprint: %@", _fingerprint];
     }
@@ -332,10 +354,44 @@ static bool nsstreq(NSString *s1, NSString *s2) {
     [_aliases writeToFile:aliasFilePath atomically:YES];
     [_templateSettingsDict writeToFile:templateFilePath atomically:YES];
     
+    [self updateMessageTemplates];
+    
     return true;
 }
 
+- (void) updateMessageTemplates {
+    NSString *htmlIn = _templateSettings.htmlMsgInFormat;
+    NSString *htmlOut = _templateSettings.htmlMsgOutFormat;
+    const char *secure = [_templateSettings.otrSecure UTF8String];
+    const char *insecure = [_templateSettings.otrInsecure UTF8String];
+    
+    msg_template_free(_msgInTemplate);
+    msg_template_free(_msgOutTemplate);
+    _msgInTemplate = msg_template_compile(
+            htmlIn ? [htmlIn UTF8String] : NULL,
+            [_templateSettings.msgInPrefixFormat UTF8String],
+            "red",
+            secure,
+            insecure);
+    _msgOutTemplate = msg_template_compile(
+            htmlOut ? [htmlOut UTF8String] : NULL,
+            [_templateSettings.msgOutPrefixFormat UTF8String],
+            "blue",
+            secure,
+            insecure);
+    
+    // received messages are formatted in the xmpp thread (pipeline.c)
+    pipeline_set_template(
+            htmlIn ? [htmlIn UTF8String] : NULL,
+            [_templateSettings.msgInPrefixFormat UTF8String],
+            secure,
+            insecure);
+}
+
 - (void) createFingerprintFromPubkey {
+    if(_xmpp) {
+        XmppWaitOtr(_xmpp);
+    }
     if(_xmpp && _xmpp->userstate && _xmpp->userstate->privkey_root) {
         OtrlPrivKey *privkey_root = _xmpp->userstate->privkey_root;
         
@@ -351,6 +407,16 @@ static bool nsstreq(NSString *s1, NSString *s2) {
     }
 }
 
+- (void) closeHistory {
+    if(_xmpp) {
+        XmppSetHistory(_xmpp, NULL, false);
+    }
+    for(NSValue *store in _historyStores.allValues) {
+        history_close(store.pointerValue);
+    }
+    [_historyStores removeAllObjects];
+}
+
 - (NSString*) configFilePath: (NSString*)fileName {
     NSArray *path = NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES);
     if([path count] == 0) {
@@ -387,7 +453,63 @@ static bool nsstreq(NSString *s1, NSString *s2) {
         
         _xmpp = XmppCreate(settings);
         
-        [self createFingerprintFromPubkey];
+        // max duration of a single callback in the xmpp thread (ms)
+        NSNumber *stallBudget = [_config valueForKey:@"stallbudget"];
+        if(stallBudget) {
+            XmppSetStallBudget(_xmpp, stallBudget.intValue);
+        }
+        
+        // number of otr worker threads, 0: otr runs in the xmpp thread
+        NSNumber *otrWorkers = [_config valueForKey:@"otrworkers"];
+        if(otrWorkers) {
+            XmppSetOtrWorkers(_xmpp, otrWorkers.intValue);
+        }
+        
+        // max otr message size, larger messages are fragmented
+        NSNumber *otrFragmentSize = [_config valueForKey:@"otrfragmentsize"];
+        if(otrFragmentSize && otrFragmentSize.intValue > 0) {
+            XmppSetOtrFragmentSize(_xmpp, otrFragmentSize.intValue);
+        }
+        
+        // number of pre-generated otr DH keypairs
+        NSNumber *otrDHPool = [_config valueForKey:@"otrdhpool"];
+        if(otrDHPool && otrDHPool.intValue > 0) {
+            XmppSetOtrDHPool(otrDHPool.intValue);
+        }
+        
+        // conversation history (opt-in)
+        // otr messages are only stored, if historysecure is enabled
+        NSNumber *history = [_config valueForKey:@"history"];
+        NSNumber *historySecure = [_config valueForKey:@"historysecure"];
+        if(history.boolValue) {
+            _historyDir = [self configFilePath:[NSString stringWithFormat:@"history/%@", jid]];
+            if(!_historyStores) {
+                _historyStores = [[NSMutableDictionary alloc]init];
+            }
+            NSValue *store = [_historyStores objectForKey:_historyDir];
+            if(!store) {
+                // returns immediately, the directory is created and
+                // recovered by the writer thread
+                HistoryStore *h = history_open([_historyDir UTF8String]);
+                if(h) {
+                    store = [NSValue valueWithPointer:h];
+                    [_historyStores setObject:store forKey:_historyDir];
+                }
+            }
+            XmppSetHistory(_xmpp, store ? store.pointerValue : NULL, historySecure.boolValue);
+        } else {
+            _historyDir = nil;
+        }
+        
+        // raw inbound stream capture for bench/xmppreplay
+        NSString *captureFile = [_config valueForKey:@"capturefile"];
+        if(captureFile && captureFile.length > 0) {
+            XmppSetCaptureFile([captureFile.stringByExpandingTildeInPath UTF8String]);
+        }
+        
+        // the otr state is loaded in the background, the fingerprint
+        // is created when the settings window is loaded
+        _fingerprint = nil;
     }
 }
 
@@ -403,6 +525,7 @@ static bool nsstreq(NSString *s1, NSString *s2) {
 
 - (void) setAlias: (NSString*)alias forXid:(NSString*)xid {
     [_aliases setValue:alias forKey:xid];
+    pipeline_set_alias([xid UTF8String], alias ? [alias UTF8String] : NULL);
 }
 
 - (NSString*) getAlias: (NSString*)xid {
@@ -528,6 +651,7 @@ static bool nsstreq(NSString *s1, NSString *s2) {
     if(_xmpp->settings.jid == NULL) {
         return;
     }
+    XmppWaitOtr(_xmpp);
     char *filename = app_configfile("otr.private_key");
     otrl_privkey_generate(_xmpp->userstate, filename, _xmpp->settings.jid, "xmpp");
     otrl_privkey_read(_xmpp->userstate, filename);
@@ -549,10 +673,15 @@ static bool nsstreq(NSString *s1, NSString *s2) {
 - (IBAction)openTemplateSettings:(id)sender {
     if(_tplController == nil) {
         _tplController = [[TemplateSettingsController alloc] initWithTemplate:_templateSettings];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(templateSettingsClosed:) name:NSWindowWillCloseNotification object:_tplController.window];
     }
     [_tplController showWindow:nil];
 }
 
+- (void)templateSettingsClosed:(NSNotification*)notification {
+    [self updateMessageTemplates];
+}
+
 - (void)changeFont:(nullable NSFontManager*)fontManager {
     if(_editFont == 1) {
         _TmpChatFont = [fontManager convertFont:_ChatFont];
@@ -228,42 +228,4 @@ import Cocoa
     @objc func setHtmlMsgOutFormat(_ value: String?) {
         dict["msg.htmlout.format"] = value
     }
-    
-    @objc func msgPrefixFormat(format: String, xid: String, alias: String, secure: Bool, message: String) -> String {
-        var fstr = ""
-        let currentDate = Date()
-        let dateFormatter = DateFormatter()
-        dateFormatter.dateFormat = "HH:mm:ss"
-        let time = dateFormatter.string(from: currentDate)
-
-        var placeholder = false
-
-        for char in format {
-            if placeholder {
-                switch char {
-                    case "t":
-                        fstr.append(time)
-                    case "x":
-                        fstr.append(xid)
-                    case "a":
-                        fstr.append(alias)
-                    case "s":
-                        fstr.append(secure ? otrSecure() : otrInsecure())
-                    case "m":
-                    fstr.append(message)
-                    default:
-                        fstr.append(char)
-                    }
-                placeholder = false
-            } else {
-                if char == "%" {
-                    placeholder = true
-                } else {
-                    fstr.append(char)
-                }
-            }
-        }
-
-        return fstr
-    }
 }
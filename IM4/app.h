@@ -33,6 +33,7 @@
 #include <stdbool.h>
 
 #include "xmpp.h"
+#include "pipeline.h"
 
 typedef void(*app_func)(void*);
 
@@ -52,7 +53,11 @@ void app_handle_new_fingerprint(Xmpp *xmpp, const char *from, const unsigned cha
 
 void app_otr_error(Xmpp *xmpp, const char *from, uint64_t error);
 
-void app_message(Xmpp *xmpp, const char *from, const char *msg_body, bool secure);
+/*
+ * passes a received message (see pipeline.h) to the app
+ * the app takes ownership of msg
+ */
+void app_inbound_message(Xmpp *xmpp, InboundMessage *msg);
 
 void app_chatstate(Xmpp *xmpp, const char *from, enum XmppChatstate state);
 
@@ -0,0 +1,765 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "history.h"
+#include "monotime.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+ * the index files are synced and the checkpoint is updated after this
+ * number of log bytes
+ */
+#define HISTORY_CHECKPOINT_INTERVAL (4 * 1024 * 1024)
+
+typedef struct HistoryJid {
+    char *jid;
+    
+    /*
+     * index file or -1
+     */
+    int index_fd;
+    
+    /*
+     * offset of the last indexed record (if has_last)
+     */
+    uint64_t last_offset;
+    bool has_last;
+    
+    /*
+     * the index was written since the last checkpoint
+     */
+    bool dirty;
+    
+    /*
+     * index entries of the current commit
+     */
+    HistoryIndexEntry *pending;
+    size_t npending;
+    size_t pending_alloc;
+} HistoryJid;
+
+typedef struct HistoryQueued HistoryQueued;
+struct HistoryQueued {
+    HistoryQueued *next;
+    
+    /*
+     * stored after the body
+     */
+    char *jid;
+    
+    int64_t timestamp;
+    uint32_t flags;
+    uint32_t length;
+    char body[];
+};
+
+struct HistoryStore {
+    char *dir;
+    
+    /*
+     * the following fields are only used by the writer thread
+     */
+    int log_fd;
+    int jids_fd;
+    uint64_t log_end;
+    uint64_t checkpoint;
+    
+    HistoryJid *jids;
+    size_t njids;
+    size_t jids_alloc;
+    
+    /*
+     * jid hash table, values are jid id + 1
+     */
+    uint32_t *jid_map;
+    size_t jid_map_size;
+    
+    /*
+     * the queue, committed and stats are protected by lock
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_cond_t  committed_cond;
+    pthread_t       thread;
+    
+    HistoryQueued *queue_begin;
+    HistoryQueued *queue_end;
+    bool stop;
+    
+    /*
+     * number of queued and committed messages
+     */
+    uint64_t queued;
+    uint64_t committed;
+    
+    /*
+     * timestamp of the last queued message
+     */
+    int64_t last_timestamp;
+    
+    HistoryStats stats;
+};
+
+int64_t history_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *s = data;
+    for(size_t i=0;i<len;i++) {
+        hash ^= s[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+uint32_t history_checksum(const HistoryRecord *record, const char *body) {
+    uint32_t hash = 2166136261u;
+    hash = fnv1a(hash, &record->length, sizeof(HistoryRecord) - sizeof(uint32_t));
+    return fnv1a(hash, body, record->length);
+}
+
+static char* history_path(HistoryStore *h, const char *name) {
+    char *path = NULL;
+    asprintf(&path, "%s/%s", h->dir, name);
+    return path;
+}
+
+static int mkdirs(const char *dir) {
+    char *path = strdup(dir);
+    for(char *s=path+1;*s;s++) {
+        if(*s == '/') {
+            *s = 0;
+            if(mkdir(path, 0700) && errno != EEXIST) {
+                free(path);
+                return 1;
+            }
+            *s = '/';
+        }
+    }
+    int ret = mkdir(path, 0700) && errno != EEXIST;
+    free(path);
+    return ret;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *s = buf;
+    while(len > 0) {
+        ssize_t w = write(fd, s, len);
+        if(w < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        s += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, uint64_t offset) {
+    char *s = buf;
+    while(len > 0) {
+        ssize_t r = pread(fd, s, len, offset);
+        if(r <= 0) {
+            if(r < 0 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        s += r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int datasync(int fd) {
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+// ------------------------- jid table -------------------------
+
+static size_t jid_hash(const char *jid) {
+    return fnv1a(2166136261u, jid, strlen(jid));
+}
+
+static void jid_map_insert(HistoryStore *h, uint32_t id) {
+    size_t mask = h->jid_map_size - 1;
+    size_t i = jid_hash(h->jids[id].jid) & mask;
+    while(h->jid_map[i]) {
+        i = (i + 1) & mask;
+    }
+    h->jid_map[i] = id + 1;
+}
+
+static int64_t jid_find(HistoryStore *h, const char *jid) {
+    if(h->jid_map_size == 0) {
+        return -1;
+    }
+    size_t mask = h->jid_map_size - 1;
+    size_t i = jid_hash(jid) & mask;
+    while(h->jid_map[i]) {
+        uint32_t id = h->jid_map[i] - 1;
+        if(!strcmp(h->jids[id].jid, jid)) {
+            return id;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static uint32_t jid_add(HistoryStore *h, const char *jid, size_t len) {
+    if(h->njids == h->jids_alloc) {
+        h->jids_alloc = h->jids_alloc ? h->jids_alloc * 2 : 64;
+        h->jids = realloc(h->jids, h->jids_alloc * sizeof(HistoryJid));
+    }
+    uint32_t id = h->njids++;
+    HistoryJid *j = &h->jids[id];
+    memset(j, 0, sizeof(HistoryJid));
+    j->jid = strndup(jid, len);
+    j->index_fd = -1;
+    
+    // keep the load factor below 0.5
+    if(h->njids * 2 > h->jid_map_size) {
+        free(h->jid_map);
+        h->jid_map_size = h->jid_map_size ? h->jid_map_size * 2 : 128;
+        h->jid_map = calloc(h->jid_map_size, sizeof(uint32_t));
+        for(uint32_t i=0;i<h->njids;i++) {
+            jid_map_insert(h, i);
+        }
+    } else {
+        jid_map_insert(h, id);
+    }
+    return id;
+}
+
+static int index_open(HistoryStore *h, uint32_t id) {
+    HistoryJid *j = &h->jids[id];
+    if(j->index_fd < 0) {
+        char name[32];
+        snprintf(name, sizeof(name), "%u" HISTORY_INDEX_SUFFIX, id);
+        char *path = history_path(h, name);
+        j->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+        if(j->index_fd < 0) {
+            fprintf(stderr, "history: cannot open %s: %s\n", path, strerror(errno));
+        }
+        free(path);
+    }
+    return j->index_fd;
+}
+
+static void index_add(HistoryJid *j, uint64_t offset, int64_t timestamp) {
+    if(j->npending == j->pending_alloc) {
+        j->pending_alloc = j->pending_alloc ? j->pending_alloc * 2 : 16;
+        j->pending = realloc(j->pending, j->pending_alloc * sizeof(HistoryIndexEntry));
+    }
+    j->pending[j->npending].offset = offset;
+    j->pending[j->npending].timestamp = timestamp;
+    j->npending++;
+    j->last_offset = offset;
+    j->has_last = true;
+}
+
+static void index_write(HistoryStore *h, uint32_t id) {
+    HistoryJid *j = &h->jids[id];
+    if(j->npending == 0) {
+        return;
+    }
+    int fd = index_open(h, id);
+    if(fd >= 0 && write_all(fd, j->pending, j->npending * sizeof(HistoryIndexEntry))) {
+        fprintf(stderr, "history: cannot write index %u: %s\n", id, strerror(errno));
+    }
+    j->npending = 0;
+    j->dirty = true;
+}
+
+/*
+ * syncs all modified index files and stores the current log end
+ */
+static void write_checkpoint(HistoryStore *h) {
+    if(h->log_fd < 0 || h->checkpoint == h->log_end) {
+        return;
+    }
+    for(size_t i=0;i<h->njids;i++) {
+        HistoryJid *j = &h->jids[i];
+        if(j->dirty && j->index_fd >= 0) {
+            datasync(j->index_fd);
+        }
+        j->dirty = false;
+    }
+    
+    char *path = history_path(h, HISTORY_CHECKPOINT_FILE);
+    int fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if(fd >= 0) {
+        uint64_t end = h->log_end;
+        if(pwrite(fd, &end, sizeof(end), 0) == sizeof(end)) {
+            h->checkpoint = end;
+        }
+        close(fd);
+    } else {
+        fprintf(stderr, "history: cannot open %s: %s\n", path, strerror(errno));
+    }
+    free(path);
+}
+
+// ------------------------- recovery -------------------------
+
+static int load_jids(HistoryStore *h) {
+    char *path = history_path(h, HISTORY_JIDS_FILE);
+    h->jids_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if(h->jids_fd < 0) {
+        fprintf(stderr, "history: cannot open %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    free(path);
+    
+    struct stat s;
+    if(fstat(h->jids_fd, &s) || s.st_size < 0) {
+        return 1;
+    }
+    size_t size = (size_t)s.st_size;
+    char *buf = malloc(size + 1);
+    if(read_all(h->jids_fd, buf, size, 0)) {
+        free(buf);
+        return 1;
+    }
+    
+    size_t begin = 0;
+    for(size_t i=0;i<size;i++) {
+        if(buf[i] == '\n') {
+            jid_add(h, buf + begin, i - begin);
+            begin = i + 1;
+        }
+    }
+    // remove an incomplete line
+    if(begin < size) {
+        ftruncate(h->jids_fd, begin);
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * reads and validates the record at offset
+ * returns the record size or 0
+ */
+static uint64_t check_record(HistoryStore *h, uint64_t offset, HistoryRecord *r, char **buf, size_t *bufsize) {
+    if(offset + sizeof(HistoryRecord) > h->log_end) {
+        return 0;
+    }
+    if(read_all(h->log_fd, r, sizeof(HistoryRecord), offset)) {
+        return 0;
+    }
+    uint64_t size = history_record_size(r->length);
+    if(size > h->log_end - offset || r->jid >= h->njids) {
+        return 0;
+    }
+    if(r->length > *bufsize) {
+        *bufsize = r->length;
+        *buf = realloc(*buf, *bufsize);
+    }
+    if(read_all(h->log_fd, *buf, r->length, offset + sizeof(HistoryRecord))) {
+        return 0;
+    }
+    return history_checksum(r, *buf) == r->checksum ? size : 0;
+}
+
+/*
+ * removes index entries, that don't reference a valid record
+ */
+static void recover_index(HistoryStore *h, uint32_t id, char **buf, size_t *bufsize) {
+    HistoryJid *j = &h->jids[id];
+    char name[32];
+    snprintf(name, sizeof(name), "%u" HISTORY_INDEX_SUFFIX, id);
+    char *path = history_path(h, name);
+    struct stat s;
+    int err = stat(path, &s);
+    free(path);
+    if(err || s.st_size < 0) {
+        return;
+    }
+    uint64_t size = (uint64_t)s.st_size;
+    
+    int fd = index_open(h, id);
+    if(fd < 0) {
+        return;
+    }
+    
+    size_t n = size / sizeof(HistoryIndexEntry);
+    while(n > 0) {
+        HistoryIndexEntry e;
+        HistoryRecord r;
+        if(!read_all(fd, &e, sizeof(e), (n - 1) * sizeof(e))
+           && check_record(h, e.offset, &r, buf, bufsize)
+           && r.jid == id
+           && r.timestamp == e.timestamp)
+        {
+            j->last_offset = e.offset;
+            j->has_last = true;
+            break;
+        }
+        n--;
+    }
+    if(n * sizeof(HistoryIndexEntry) != size) {
+        fprintf(stderr, "history: index %u truncated to %zu entries\n", id, n);
+        ftruncate(fd, n * sizeof(HistoryIndexEntry));
+    }
+}
+
+static int history_recover(HistoryStore *h) {
+    if(mkdirs(h->dir)) {
+        fprintf(stderr, "history: cannot create directory %s: %s\n", h->dir, strerror(errno));
+        return 1;
+    }
+    if(load_jids(h)) {
+        return 1;
+    }
+    
+    char *path = history_path(h, HISTORY_LOG_FILE);
+    h->log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if(h->log_fd < 0) {
+        fprintf(stderr, "history: cannot open %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    free(path);
+    
+    struct stat s;
+    if(fstat(h->log_fd, &s) || s.st_size < 0) {
+        return 1;
+    }
+    h->log_end = (uint64_t)s.st_size;
+    
+    uint64_t checkpoint = 0;
+    path = history_path(h, HISTORY_CHECKPOINT_FILE);
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        if(read_all(fd, &checkpoint, sizeof(checkpoint), 0) || checkpoint > h->log_end) {
+            checkpoint = 0;
+        }
+        close(fd);
+    }
+    free(path);
+    
+    char *buf = NULL;
+    size_t bufsize = 0;
+    for(uint32_t i=0;i<h->njids;i++) {
+        recover_index(h, i, &buf, &bufsize);
+    }
+    
+    // index all records after the checkpoint
+    uint64_t offset = checkpoint;
+    uint64_t indexed = 0;
+    while(offset < h->log_end) {
+        HistoryRecord r;
+        uint64_t size = check_record(h, offset, &r, &buf, &bufsize);
+        if(size == 0) {
+            if(offset == checkpoint && checkpoint > 0) {
+                // invalid checkpoint: check the whole log
+                checkpoint = 0;
+                offset = 0;
+                continue;
+            }
+            fprintf(stderr, "history: invalid record at offset %llu: log truncated\n", (unsigned long long)offset);
+            ftruncate(h->log_fd, offset);
+            h->log_end = offset;
+            break;
+        }
+        
+        HistoryJid *j = &h->jids[r.jid];
+        if(!j->has_last || offset > j->last_offset) {
+            index_add(j, offset, r.timestamp);
+            indexed++;
+        }
+        offset += size;
+    }
+    free(buf);
+    
+    for(uint32_t i=0;i<h->njids;i++) {
+        index_write(h, i);
+    }
+    if(indexed > 0) {
+        fprintf(stderr, "history: %llu records indexed\n", (unsigned long long)indexed);
+    }
+    
+    h->checkpoint = checkpoint;
+    write_checkpoint(h);
+    return 0;
+}
+
+// ------------------------- writer -------------------------
+
+static void history_discard(HistoryQueued *batch) {
+    while(batch) {
+        HistoryQueued *next = batch->next;
+        free(batch);
+        batch = next;
+    }
+}
+
+/*
+ * writes a batch of queued messages
+ * returns the number of messages
+ */
+static size_t history_commit(HistoryStore *h, HistoryQueued *batch) {
+    size_t n = 0;
+    size_t size = 0;
+    
+    // new jids
+    char *jids = NULL;
+    size_t jids_len = 0;
+    for(HistoryQueued *q=batch;q;q=q->next) {
+        if(jid_find(h, q->jid) < 0) {
+            size_t len = strlen(q->jid);
+            jid_add(h, q->jid, len);
+            jids = realloc(jids, jids_len + len + 1);
+            memcpy(jids + jids_len, q->jid, len);
+            jids[jids_len + len] = '\n';
+            jids_len += len + 1;
+        }
+        size += history_record_size(q->length);
+        n++;
+    }
+    if(jids) {
+        if(write_all(h->jids_fd, jids, jids_len) || datasync(h->jids_fd)) {
+            fprintf(stderr, "history: cannot write jids: %s\n", strerror(errno));
+        }
+        free(jids);
+    }
+    
+    // log records
+    char *buf = calloc(1, size);
+    char *pos = buf;
+    for(HistoryQueued *q=batch;q;q=q->next) {
+        HistoryRecord r;
+        r.length = q->length;
+        r.timestamp = q->timestamp;
+        r.jid = (uint32_t)jid_find(h, q->jid);
+        r.flags = q->flags;
+        r.checksum = history_checksum(&r, q->body);
+        memcpy(pos, &r, sizeof(r));
+        memcpy(pos + sizeof(r), q->body, q->length);
+        
+        index_add(&h->jids[r.jid], h->log_end + (pos - buf), r.timestamp);
+        pos += history_record_size(q->length);
+    }
+    
+    if(write_all(h->log_fd, buf, size) || datasync(h->log_fd)) {
+        fprintf(stderr, "history: cannot write log: %s\n", strerror(errno));
+        ftruncate(h->log_fd, h->log_end);
+        for(size_t i=0;i<h->njids;i++) {
+            h->jids[i].npending = 0;
+        }
+    } else {
+        // the records are on disk, the index can be updated
+        for(HistoryQueued *q=batch;q;q=q->next) {
+            index_write(h, jid_find(h, q->jid));
+        }
+        h->log_end += size;
+        if(h->log_end - h->checkpoint >= HISTORY_CHECKPOINT_INTERVAL) {
+            write_checkpoint(h);
+        }
+    }
+    free(buf);
+    
+    history_discard(batch);
+    return n;
+}
+
+static void* history_thread(void *data) {
+    HistoryStore *h = data;
+    bool ok = history_recover(h) == 0;
+    
+    pthread_mutex_lock(&h->lock);
+    for(;;) {
+        HistoryQueued *batch = h->queue_begin;
+        if(!batch) {
+            if(h->stop) {
+                break;
+            }
+            pthread_cond_wait(&h->cond, &h->lock);
+            continue;
+        }
+        h->queue_begin = NULL;
+        h->queue_end = NULL;
+        pthread_mutex_unlock(&h->lock);
+        
+        uint64_t start = monotime_ns();
+        size_t n = 0;
+        if(ok) {
+            n = history_commit(h, batch);
+        } else {
+            for(HistoryQueued *q=batch;q;q=q->next) {
+                n++;
+            }
+            history_discard(batch);
+        }
+        uint64_t t = monotime_ns() - start;
+        
+        pthread_mutex_lock(&h->lock);
+        h->committed += n;
+        if(ok) {
+            h->stats.records += n;
+            h->stats.batches++;
+            if(n > h->stats.max_batch) {
+                h->stats.max_batch = n;
+            }
+            h->stats.commit_ns += t;
+            if(t > h->stats.max_commit_ns) {
+                h->stats.max_commit_ns = t;
+            }
+            h->stats.bytes = h->log_end;
+        }
+        pthread_cond_broadcast(&h->committed_cond);
+    }
+    pthread_mutex_unlock(&h->lock);
+    
+    if(ok) {
+        write_checkpoint(h);
+    }
+    return NULL;
+}
+
+// ------------------------- public functions -------------------------
+
+HistoryStore* history_open(const char *dir) {
+    HistoryStore *h = calloc(1, sizeof(HistoryStore));
+    h->dir = strdup(dir);
+    h->log_fd = -1;
+    h->jids_fd = -1;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+    pthread_cond_init(&h->committed_cond, NULL);
+    
+    if(pthread_create(&h->thread, NULL, history_thread, h)) {
+        perror("pthread_create");
+        pthread_mutex_destroy(&h->lock);
+        pthread_cond_destroy(&h->cond);
+        pthread_cond_destroy(&h->committed_cond);
+        free(h->dir);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+int64_t history_append(
+        HistoryStore *h,
+        const char *jid,
+        int64_t timestamp,
+        unsigned int flags,
+        const char *body,
+        size_t len)
+{
+    size_t jidlen = strlen(jid);
+    HistoryQueued *q = malloc(sizeof(HistoryQueued) + len + jidlen + 1);
+    q->next = NULL;
+    q->flags = flags;
+    q->length = (uint32_t)len;
+    memcpy(q->body, body, len);
+    q->jid = q->body + len;
+    memcpy(q->jid, jid, jidlen + 1);
+    
+    pthread_mutex_lock(&h->lock);
+    if(timestamp <= h->last_timestamp) {
+        timestamp = h->last_timestamp + 1;
+    }
+    h->last_timestamp = timestamp;
+    q->timestamp = timestamp;
+    if(h->queue_end) {
+        h->queue_end->next = q;
+    } else {
+        h->queue_begin = q;
+    }
+    h->queue_end = q;
+    h->queued++;
+    pthread_cond_signal(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return timestamp;
+}
+
+void history_flush(HistoryStore *h) {
+    pthread_mutex_lock(&h->lock);
+    uint64_t target = h->queued;
+    while(h->committed < target) {
+        pthread_cond_wait(&h->committed_cond, &h->lock);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+void history_close(HistoryStore *h) {
+    pthread_mutex_lock(&h->lock);
+    h->stop = true;
+    pthread_cond_signal(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    pthread_join(h->thread, NULL);
+    
+    if(h->log_fd >= 0) {
+        close(h->log_fd);
+    }
+    if(h->jids_fd >= 0) {
+        close(h->jids_fd);
+    }
+    for(size_t i=0;i<h->njids;i++) {
+        if(h->jids[i].index_fd >= 0) {
+            close(h->jids[i].index_fd);
+        }
+        free(h->jids[i].jid);
+        free(h->jids[i].pending);
+    }
+    free(h->jids);
+    free(h->jid_map);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->cond);
+    pthread_cond_destroy(&h->committed_cond);
+    free(h->dir);
+    free(h);
+}
+
+void history_stats(HistoryStore *h, HistoryStats *stats) {
+    pthread_mutex_lock(&h->lock);
+    *stats = h->stats;
+    pthread_mutex_unlock(&h->lock);
+}
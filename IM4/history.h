@@ -0,0 +1,163 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef history_h
+#define history_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Append-only conversation history store
+ *
+ * One store per account, in its own directory:
+ *
+ * messages.log  records: HistoryRecord, body, padding to 8 bytes
+ * jids          jid table, one jid per line, the line number is the jid id
+ * <id>.idx      per conversation offset index: HistoryIndexEntry array
+ * checkpoint    end of the log (uint64_t), up to which all index files
+ *               are complete
+ *
+ * history_append only queues the message. A writer thread commits all
+ * queued messages together: the jid table and the log are synced before
+ * the index entries are written, so an index never references a record,
+ * that is not on disk. When the store is opened, the log after the
+ * checkpoint is validated (checksum), indexed and a torn record at the
+ * end is removed.
+ *
+ * All integers are stored in host byte order.
+ */
+
+#define HISTORY_LOG_FILE        "messages.log"
+#define HISTORY_JIDS_FILE       "jids"
+#define HISTORY_CHECKPOINT_FILE "checkpoint"
+#define HISTORY_INDEX_SUFFIX    ".idx"
+
+/*
+ * record flags
+ */
+#define HISTORY_OUT    0x1
+#define HISTORY_SECURE 0x2
+
+typedef struct HistoryRecord {
+    /*
+     * FNV-1a checksum of the following header fields and the body
+     */
+    uint32_t checksum;
+    
+    /*
+     * body length (without padding)
+     */
+    uint32_t length;
+    
+    /*
+     * unix time in ms
+     */
+    int64_t timestamp;
+    
+    uint32_t jid;
+    uint32_t flags;
+} HistoryRecord;
+
+typedef struct HistoryIndexEntry {
+    uint64_t offset;
+    int64_t timestamp;
+} HistoryIndexEntry;
+
+typedef struct HistoryStats {
+    uint64_t records;
+    uint64_t batches;
+    uint64_t bytes;
+    
+    /*
+     * largest batch (records)
+     */
+    uint64_t max_batch;
+    
+    /*
+     * total and max duration of a commit
+     */
+    uint64_t commit_ns;
+    uint64_t max_commit_ns;
+} HistoryStats;
+
+typedef struct HistoryStore HistoryStore;
+
+/*
+ * opens or creates the store in dir (and missing parent directories)
+ * the files are opened and recovered by the writer thread
+ */
+HistoryStore* history_open(const char *dir);
+
+/*
+ * queues a message, never blocks on disk io
+ * jid: bare jid of the conversation
+ * timestamp: unix time in ms, raised if necessary, so that the timestamps
+ *            of a session are unique and ascending
+ * body: html message
+ * returns the stored timestamp
+ */
+int64_t history_append(
+        HistoryStore *h,
+        const char *jid,
+        int64_t timestamp,
+        unsigned int flags,
+        const char *body,
+        size_t len);
+
+/*
+ * waits until all messages queued before the call are committed
+ */
+void history_flush(HistoryStore *h);
+
+/*
+ * commits all queued messages and closes the store
+ */
+void history_close(HistoryStore *h);
+
+void history_stats(HistoryStore *h, HistoryStats *stats);
+
+/*
+ * current unix time in ms
+ */
+int64_t history_now(void);
+
+/*
+ * checksum of a record
+ */
+uint32_t history_checksum(const HistoryRecord *record, const char *body);
+
+/*
+ * size of a record in the log (header, body and padding)
+ */
+static inline uint64_t history_record_size(uint32_t length) {
+    return (sizeof(HistoryRecord) + length + 7) & ~(uint64_t)7;
+}
+
+#endif /* history_h */
@@ -0,0 +1,204 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "historyreader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+struct HistoryReader {
+    const char *log;
+    size_t log_size;
+    
+    const HistoryIndexEntry *index;
+    size_t index_size;
+    size_t count;
+    
+    uint32_t jid;
+};
+
+/*
+ * returns the line number of jid in the jid table or -1
+ */
+static int64_t find_jid(const char *dir, const char *jid) {
+    char *path = NULL;
+    asprintf(&path, "%s/%s", dir, HISTORY_JIDS_FILE);
+    FILE *in = fopen(path, "r");
+    free(path);
+    if(!in) {
+        return -1;
+    }
+    
+    int64_t id = -1;
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    for(int64_t i=0;(len = getline(&line, &alloc, in)) > 0;i++) {
+        if(line[len-1] != '\n') {
+            break; // incomplete line
+        }
+        line[len-1] = 0;
+        if(!strcmp(line, jid)) {
+            id = i;
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    return id;
+}
+
+/*
+ * maps a file read-only
+ * an empty file is mapped as NULL
+ */
+static int map_file(const char *path, const void **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 1;
+    }
+    struct stat s;
+    if(fstat(fd, &s)) {
+        close(fd);
+        return 1;
+    }
+    if(s.st_size > 0) {
+        void *map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED) {
+            fprintf(stderr, "history: cannot map %s: %s\n", path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        *data = map;
+        *size = (size_t)s.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+HistoryReader* history_reader_open(const char *dir, const char *jid) {
+    int64_t id = find_jid(dir, jid);
+    if(id < 0) {
+        return NULL;
+    }
+    
+    HistoryReader *r = calloc(1, sizeof(HistoryReader));
+    r->jid = (uint32_t)id;
+    
+    // the index is mapped before the log: the writer adds index entries
+    // after the records are written, therefore all mapped entries
+    // reference records in the mapped log
+    char *path = NULL;
+    asprintf(&path, "%s/%u" HISTORY_INDEX_SUFFIX, dir, r->jid);
+    int err = map_file(path, (const void**)&r->index, &r->index_size);
+    free(path);
+    if(!err) {
+        asprintf(&path, "%s/%s", dir, HISTORY_LOG_FILE);
+        err = map_file(path, (const void**)&r->log, &r->log_size);
+        free(path);
+    }
+    if(err) {
+        history_reader_close(r);
+        return NULL;
+    }
+    
+    r->count = r->index_size / sizeof(HistoryIndexEntry);
+    return r;
+}
+
+void history_reader_close(HistoryReader *r) {
+    if(r->index) {
+        munmap((void*)r->index, r->index_size);
+    }
+    if(r->log) {
+        munmap((void*)r->log, r->log_size);
+    }
+    free(r);
+}
+
+size_t history_reader_count(HistoryReader *r) {
+    return r->count;
+}
+
+int64_t history_reader_timestamp(HistoryReader *r, size_t pos) {
+    return r->index[pos].timestamp;
+}
+
+size_t history_reader_find(HistoryReader *r, int64_t timestamp) {
+    // timestamps are ascending, unless the clock was changed
+    size_t begin = 0;
+    size_t end = r->count;
+    while(begin < end) {
+        size_t mid = begin + (end - begin) / 2;
+        if(r->index[mid].timestamp < timestamp) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin;
+}
+
+size_t history_reader_page(HistoryReader *r, size_t pos, size_t n, HistoryMessage *messages) {
+    if(pos >= r->count) {
+        return 0;
+    }
+    if(n > r->count - pos) {
+        n = r->count - pos;
+    }
+    
+    size_t k = 0;
+    for(size_t i=pos;i<pos+n;i++) {
+        uint64_t offset = r->index[i].offset;
+        if(offset % 8 != 0 || offset > r->log_size || r->log_size - offset < sizeof(HistoryRecord)) {
+            continue;
+        }
+        const HistoryRecord *record = (const HistoryRecord*)(r->log + offset);
+        const char *body = r->log + offset + sizeof(HistoryRecord);
+        if(record->length > r->log_size - offset - sizeof(HistoryRecord)
+           || record->jid != r->jid
+           || history_checksum(record, body) != record->checksum)
+        {
+            continue;
+        }
+        
+        messages[k].timestamp = record->timestamp;
+        messages[k].flags = record->flags;
+        messages[k].body = body;
+        messages[k].length = record->length;
+        k++;
+    }
+    return k;
+}
@@ -0,0 +1,91 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef historyreader_h
+#define historyreader_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "history.h"
+
+/*
+ * Read-only view of one conversation of a history store (history.h)
+ *
+ * The index and the log are memory-mapped when the reader is opened,
+ * messages committed later are not visible. Pages are read with the
+ * index, without scanning the log.
+ */
+
+typedef struct HistoryReader HistoryReader;
+
+typedef struct HistoryMessage {
+    int64_t timestamp;
+    unsigned int flags;
+    
+    /*
+     * html message, points into the mapped log (not null-terminated)
+     * valid until history_reader_close
+     */
+    const char *body;
+    size_t length;
+} HistoryMessage;
+
+/*
+ * opens the history of the conversation with jid (bare jid)
+ * returns NULL, if there is no history for jid
+ */
+HistoryReader* history_reader_open(const char *dir, const char *jid);
+
+void history_reader_close(HistoryReader *r);
+
+/*
+ * number of messages
+ */
+size_t history_reader_count(HistoryReader *r);
+
+/*
+ * timestamp of the message at pos (pos < history_reader_count)
+ */
+int64_t history_reader_timestamp(HistoryReader *r, size_t pos);
+
+/*
+ * position of the first message with a timestamp >= timestamp (ms)
+ * or history_reader_count, if there is none
+ */
+size_t history_reader_find(HistoryReader *r, int64_t timestamp);
+
+/*
+ * reads the messages at the positions [pos, pos + n), clipped to the
+ * number of messages
+ * invalid records are skipped
+ * returns the number of messages stored in messages
+ */
+size_t history_reader_page(HistoryReader *r, size_t pos, size_t n, HistoryMessage *messages);
+
+#endif /* historyreader_h */
@@ -0,0 +1,392 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "htmlescape.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HTML_ESCAPE_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HTML_ESCAPE_NEON
+#endif
+
+#if defined(HTML_ESCAPE_SSE2) || defined(HTML_ESCAPE_NEON)
+#define HTML_ESCAPE_SIMD
+static bool use_simd = true;
+#else
+static bool use_simd = false;
+#endif
+
+/*
+ * additional length of the entity of a character, 0: no escaping required
+ */
+static const unsigned char escape_extra[256] = {
+    ['<'] = 3,
+    ['>'] = 3,
+    ['&'] = 4,
+    ['"'] = 5,
+    ['\''] = 4
+};
+
+static const char *entities[256] = {
+    ['<'] = "&lt;",
+    ['>'] = "&gt;",
+    ['&'] = "&amp;",
+    ['"'] = "&quot;",
+    ['\''] = "&#39;"
+};
+
+typedef struct UrlSpan {
+    size_t start;
+    size_t length;
+} UrlSpan;
+
+bool html_escape_use_simd(bool enable) {
+#ifdef HTML_ESCAPE_SIMD
+    use_simd = enable;
+#endif
+    return use_simd;
+}
+
+// ------------------------- scalar -------------------------
+
+static size_t scan_scalar(const char *str, size_t pos, size_t len) {
+    while(pos < len && !escape_extra[(unsigned char)str[pos]]) {
+        pos++;
+    }
+    return pos;
+}
+
+static size_t extra_scalar(const char *str, size_t pos, size_t len) {
+    size_t extra = 0;
+    for(;pos<len;pos++) {
+        extra += escape_extra[(unsigned char)str[pos]];
+    }
+    return extra;
+}
+
+// ------------------------- simd -------------------------
+
+/*
+ * Both implementations map every byte of a 16 byte block to its
+ * escape_extra value. Blocks without special characters are all zero.
+ */
+
+#ifdef HTML_ESCAPE_SSE2
+
+static inline __m128i block_extra(__m128i v) {
+    __m128i w = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_set1_epi8(3));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')), _mm_set1_epi8(3)));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')), _mm_set1_epi8(4)));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_set1_epi8(5)));
+    w = _mm_or_si128(w, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')), _mm_set1_epi8(4)));
+    return w;
+}
+
+static size_t scan_simd(const char *str, size_t pos, size_t len) {
+    __m128i zero = _mm_setzero_si128();
+    while(pos + 16 <= len) {
+        __m128i w = block_extra(_mm_loadu_si128((const __m128i*)(str + pos)));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(w, zero)) ^ 0xffff;
+        if(mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return scan_scalar(str, pos, len);
+}
+
+static size_t extra_simd(const char *str, size_t pos, size_t len) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    while(pos + 16 <= len) {
+        __m128i w = block_extra(_mm_loadu_si128((const __m128i*)(str + pos)));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(w, zero));
+        pos += 16;
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    return lanes[0] + lanes[1] + extra_scalar(str, pos, len);
+}
+
+#endif
+
+#ifdef HTML_ESCAPE_NEON
+
+static inline uint8x16_t block_extra(uint8x16_t v) {
+    uint8x16_t w = vandq_u8(vceqq_u8(v, vdupq_n_u8('<')), vdupq_n_u8(3));
+    w = vorrq_u8(w, vandq_u8(vceqq_u8(v, vdupq_n_u8('>')), vdupq_n_u8(3)));
+    w = vorrq_u8(w, vandq_u8(vceqq_u8(v, vdupq_n_u8('&')), vdupq_n_u8(4)));
+    w = vorrq_u8(w, vandq_u8(vceqq_u8(v, vdupq_n_u8('"')), vdupq_n_u8(5)));
+    w = vorrq_u8(w, vandq_u8(vceqq_u8(v, vdupq_n_u8('\'')), vdupq_n_u8(4)));
+    return w;
+}
+
+static size_t scan_simd(const char *str, size_t pos, size_t len) {
+    while(pos + 16 <= len) {
+        uint8x16_t w = block_extra(vld1q_u8((const uint8_t*)(str + pos)));
+        // 4 bits per byte
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(vtstq_u8(w, w)), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if(mask) {
+            return pos + (__builtin_ctzll(mask) >> 2);
+        }
+        pos += 16;
+    }
+    return scan_scalar(str, pos, len);
+}
+
+static size_t extra_simd(const char *str, size_t pos, size_t len) {
+    size_t extra = 0;
+    while(pos + 16 <= len) {
+        extra += vaddvq_u8(block_extra(vld1q_u8((const uint8_t*)(str + pos))));
+        pos += 16;
+    }
+    return extra + extra_scalar(str, pos, len);
+}
+
+#endif
+
+// ------------------------- escaping -------------------------
+
+static inline size_t scan(const char *str, size_t pos, size_t len) {
+#ifdef HTML_ESCAPE_SIMD
+    if(use_simd) {
+        return scan_simd(str, pos, len);
+    }
+#endif
+    return scan_scalar(str, pos, len);
+}
+
+size_t html_escape_size(const char *str, size_t len) {
+#ifdef HTML_ESCAPE_SIMD
+    if(use_simd) {
+        return len + extra_simd(str, 0, len);
+    }
+#endif
+    return len + extra_scalar(str, 0, len);
+}
+
+size_t html_escape(char *out, const char *str, size_t len) {
+    char *o = out;
+    size_t pos = 0;
+    while(pos < len) {
+        size_t next = scan(str, pos, len);
+        memcpy(o, str + pos, next - pos);
+        o += next - pos;
+        if(next == len) {
+            break;
+        }
+        
+        unsigned char c = str[next];
+        size_t elen = escape_extra[c] + 1;
+        memcpy(o, entities[c], elen);
+        o += elen;
+        pos = next + 1;
+    }
+    return o - out;
+}
+
+// ------------------------- urls -------------------------
+
+/*
+ * The url pattern is the regex, that was used by the conversation window:
+ * https?:\/\/{1}[a-zA-Z0-9u00a1-\uffff0-]{2,}\.[a-zA-Z0-9u00a1-\uffff0-]{2,}(\S*)
+ *
+ * The character class is '0', '-' and everything from '1' to U+FFFF.
+ *
+ * Unlike the previous implementation, the href attribute is escaped as
+ * well (if escape is enabled).
+ */
+
+static size_t host_length(const unsigned char *s, size_t len, size_t *units) {
+    size_t i = 0;
+    size_t n = 0;
+    // characters outside of the BMP (lead bytes 0xf0-0xf4) end the host
+    while(i < len && ((s[i] >= 0x31 && s[i] < 0xf0) || s[i] == '0' || s[i] == '-')) {
+        if((s[i] & 0xc0) != 0x80) {
+            n++;
+        }
+        i++;
+    }
+    *units = n;
+    return i;
+}
+
+/*
+ * returns the length of the white space character (\s: [\t\n\f\r\p{Z}])
+ * at s or 0
+ */
+static size_t space_length(const unsigned char *s, size_t len) {
+    unsigned char c = s[0];
+    if(c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ') {
+        return 1;
+    }
+    if(c < 0xc2) {
+        return 0;
+    }
+    if(c == 0xc2) {
+        return len >= 2 && s[1] == 0xa0 ? 2 : 0; // U+00A0
+    }
+    if(len < 3) {
+        return 0;
+    }
+    if(c == 0xe1) {
+        return s[1] == 0x9a && s[2] == 0x80 ? 3 : 0; // U+1680
+    }
+    if(c == 0xe2) {
+        if(s[1] == 0x80) {
+            // U+2000-U+200A, U+2028, U+2029, U+202F
+            return s[2] <= 0x8a || s[2] == 0xa8 || s[2] == 0xa9 || s[2] == 0xaf ? 3 : 0;
+        }
+        return s[1] == 0x81 && s[2] == 0x9f ? 3 : 0; // U+205F
+    }
+    if(c == 0xe3) {
+        return s[1] == 0x80 && s[2] == 0x80 ? 3 : 0; // U+3000
+    }
+    return 0;
+}
+
+/*
+ * returns the length of the url at s or 0
+ */
+static size_t url_length(const unsigned char *s, size_t len) {
+    if(len < 4 || memcmp(s, "http", 4)) {
+        return 0;
+    }
+    size_t i = 4;
+    if(i < len && s[i] == 's') {
+        i++;
+    }
+    if(len - i < 3 || memcmp(s + i, "://", 3)) {
+        return 0;
+    }
+    i += 3;
+    
+    size_t units;
+    i += host_length(s + i, len - i, &units);
+    if(units < 2 || i == len || s[i] != '.') {
+        return 0;
+    }
+    i++;
+    
+    i += host_length(s + i, len - i, &units);
+    if(units < 2) {
+        return 0;
+    }
+    
+    while(i < len && !space_length(s + i, len - i)) {
+        i++;
+    }
+    return i;
+}
+
+static size_t text_size(const char *str, size_t len, bool escape) {
+    return escape ? html_escape_size(str, len) : len;
+}
+
+static char* text_write(char *out, const char *str, size_t len, bool escape) {
+    if(escape) {
+        return out + html_escape(out, str, len);
+    }
+    memcpy(out, str, len);
+    return out + len;
+}
+
+char* html_linkify(const char *str, size_t len, bool escape, size_t *outlen) {
+    // find all urls and compute the output size
+    UrlSpan local_spans[32];
+    UrlSpan *spans = local_spans;
+    size_t nspans = 0;
+    size_t spans_alloc = 32;
+    
+    size_t size = 0;
+    size_t begin = 0;
+    const char *h = str;
+    const char *end = str + len;
+    while((h = memchr(h, 'h', end - h)) != NULL) {
+        size_t pos = h - str;
+        size_t ulen = url_length((const unsigned char*)h, len - pos);
+        if(ulen == 0) {
+            h++;
+            continue;
+        }
+        
+        if(nspans == spans_alloc) {
+            spans_alloc *= 2;
+            if(spans == local_spans) {
+                spans = malloc(spans_alloc * sizeof(UrlSpan));
+                memcpy(spans, local_spans, nspans * sizeof(UrlSpan));
+            } else {
+                spans = realloc(spans, spans_alloc * sizeof(UrlSpan));
+            }
+        }
+        spans[nspans].start = pos;
+        spans[nspans].length = ulen;
+        nspans++;
+        
+        // <a href="url">url</a>
+        size += text_size(str + begin, pos - begin, escape);
+        size += 15 + 2 * text_size(h, ulen, escape);
+        
+        begin = pos + ulen;
+        h = str + begin;
+    }
+    size += text_size(str + begin, len - begin, escape);
+    
+    // create output
+    char *out = malloc(size + 1);
+    char *o = out;
+    begin = 0;
+    for(size_t i=0;i<nspans;i++) {
+        const char *url = str + spans[i].start;
+        size_t ulen = spans[i].length;
+        o = text_write(o, str + begin, spans[i].start - begin, escape);
+        memcpy(o, "<a href=\"", 9);
+        o = text_write(o + 9, url, ulen, escape);
+        memcpy(o, "\">", 2);
+        o = text_write(o + 2, url, ulen, escape);
+        memcpy(o, "</a>", 4);
+        o += 4;
+        begin = spans[i].start + ulen;
+    }
+    o = text_write(o, str + begin, len - begin, escape);
+    *o = 0;
+    
+    if(spans != local_spans) {
+        free(spans);
+    }
+    if(outlen) {
+        *outlen = size;
+    }
+    return out;
+}
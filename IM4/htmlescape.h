@@ -0,0 +1,69 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef htmlescape_h
+#define htmlescape_h
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+ * HTML escaping and url linkification of UTF-8 text
+ *
+ * The escaped characters are <>&"' (&lt; &gt; &amp; &quot; &#39;).
+ * Urls (https?://<host>.<host>\S*) are converted to <a> elements, the url
+ * is escaped in the href attribute and in the link text.
+ *
+ * The input is scanned with SSE2 or NEON, if available, otherwise with a
+ * scalar loop. The output buffer is allocated with the exact size.
+ */
+
+/*
+ * returns the length of str after escaping
+ */
+size_t html_escape_size(const char *str, size_t len);
+
+/*
+ * escapes str into out, which must have html_escape_size(str, len) bytes
+ * returns the number of bytes written (no terminating 0)
+ */
+size_t html_escape(char *out, const char *str, size_t len);
+
+/*
+ * converts urls in str to links and optionally escapes the text
+ * returns a 0-terminated string, the length is stored in outlen, if not NULL
+ */
+char* html_linkify(const char *str, size_t len, bool escape, size_t *outlen);
+
+/*
+ * enables or disables the vectorized implementation (benchmarks)
+ * returns true, if the vectorized implementation is used
+ */
+bool html_escape_use_simd(bool enable);
+
+#endif /* htmlescape_h */
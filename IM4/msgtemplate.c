@@ -0,0 +1,218 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "msgtemplate.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct TemplateCompiler {
+    MsgTemplateSegment *segments;
+    size_t nsegments;
+    size_t alloc;
+    
+    char *text;
+    size_t textlen;
+    size_t textalloc;
+} TemplateCompiler;
+
+static MsgTemplateSegment* add_segment(TemplateCompiler *c, enum MsgTemplateSegmentType type) {
+    if(c->nsegments == c->alloc) {
+        c->alloc = c->alloc ? c->alloc * 2 : 16;
+        c->segments = realloc(c->segments, c->alloc * sizeof(MsgTemplateSegment));
+    }
+    MsgTemplateSegment *seg = &c->segments[c->nsegments++];
+    seg->type = type;
+    seg->str = NULL;
+    seg->len = 0;
+    return seg;
+}
+
+/*
+ * adds text to the last text segment or creates a new one
+ * text segments store the offset in str until the compilation is done,
+ * because c->text is reallocated
+ */
+static void add_text(TemplateCompiler *c, const char *str, size_t len) {
+    if(len == 0) {
+        return;
+    }
+    if(c->textlen + len >= c->textalloc) {
+        c->textalloc = c->textalloc ? c->textalloc * 2 : 256;
+        while(c->textlen + len >= c->textalloc) {
+            c->textalloc *= 2;
+        }
+        c->text = realloc(c->text, c->textalloc);
+    }
+    
+    MsgTemplateSegment *last = c->nsegments > 0 ? &c->segments[c->nsegments-1] : NULL;
+    if(!last || last->type != MSG_TEMPLATE_TEXT) {
+        last = add_segment(c, MSG_TEMPLATE_TEXT);
+        last->str = (const char*)(uintptr_t)c->textlen;
+    }
+    memcpy(c->text + c->textlen, str, len);
+    c->textlen += len;
+    last->len += len;
+}
+
+static void add_str(TemplateCompiler *c, const char *str) {
+    add_text(c, str, strlen(str));
+}
+
+/*
+ * compiles a format string
+ * message: false if %m is replaced with an empty string (prefix format)
+ */
+static void compile_format(TemplateCompiler *c, const char *format, bool message) {
+    const char *begin = format;
+    const char *s = format;
+    while((s = strchr(s, '%')) != NULL) {
+        add_text(c, begin, s - begin);
+        if(s[1] == 0) {
+            // % at the end is dropped
+            begin = s + 1;
+            break;
+        }
+        
+        char p = s[1];
+        switch(p) {
+            case 't': add_segment(c, MSG_TEMPLATE_TIME); break;
+            case 'x': add_segment(c, MSG_TEMPLATE_XID); break;
+            case 'a': add_segment(c, MSG_TEMPLATE_ALIAS); break;
+            case 's': add_segment(c, MSG_TEMPLATE_SECURE); break;
+            case 'm': {
+                if(message) {
+                    add_segment(c, MSG_TEMPLATE_MESSAGE);
+                }
+                break;
+            }
+            default: add_text(c, &s[1], 1); break;
+        }
+        s += 2;
+        begin = s;
+    }
+    add_str(c, begin);
+}
+
+MsgTemplate* msg_template_compile(
+        const char *html_format,
+        const char *prefix_format,
+        const char *color,
+        const char *secure,
+        const char *insecure)
+{
+    TemplateCompiler c = { NULL, 0, 0, NULL, 0, 0 };
+    if(html_format) {
+        compile_format(&c, html_format, true);
+    } else {
+        // default entry format of the conversation window
+        add_str(&c, "<pre style=\"font-family: -apple-system\"><span style=\"color: ");
+        add_str(&c, color);
+        add_str(&c, "\">");
+        compile_format(&c, prefix_format ? prefix_format : "", false);
+        add_str(&c, "</span>");
+        add_segment(&c, MSG_TEMPLATE_MESSAGE);
+        add_str(&c, "</pre>");
+    }
+    
+    for(size_t i=0;i<c.nsegments;i++) {
+        if(c.segments[i].type == MSG_TEMPLATE_TEXT) {
+            c.segments[i].str = c.text + (uintptr_t)c.segments[i].str;
+        }
+    }
+    
+    MsgTemplate *tpl = malloc(sizeof(MsgTemplate));
+    tpl->segments = c.segments;
+    tpl->nsegments = c.nsegments;
+    tpl->text = c.text;
+    tpl->secure = strdup(secure ? secure : "");
+    tpl->insecure = strdup(insecure ? insecure : "");
+    return tpl;
+}
+
+void msg_template_free(MsgTemplate *tpl) {
+    if(!tpl) {
+        return;
+    }
+    free(tpl->segments);
+    free(tpl->text);
+    free(tpl->secure);
+    free(tpl->insecure);
+    free(tpl);
+}
+
+char* msg_template_render(const MsgTemplate *tpl, const MsgTemplateValues *values, size_t *outlen) {
+    const char *str[6] = {
+        NULL,
+        values->time ? values->time : "",
+        values->xid ? values->xid : "",
+        values->alias ? values->alias : "",
+        values->secure ? tpl->secure : tpl->insecure,
+        values->message ? values->message : ""
+    };
+    size_t len[6] = { 0 };
+    for(int i=1;i<6;i++) {
+        len[i] = strlen(str[i]);
+    }
+    
+    size_t size = 0;
+    for(size_t i=0;i<tpl->nsegments;i++) {
+        MsgTemplateSegment *seg = &tpl->segments[i];
+        size += seg->type == MSG_TEMPLATE_TEXT ? seg->len : len[seg->type];
+    }
+    
+    char *out = malloc(size + 1);
+    char *o = out;
+    for(size_t i=0;i<tpl->nsegments;i++) {
+        MsgTemplateSegment *seg = &tpl->segments[i];
+        if(seg->type == MSG_TEMPLATE_TEXT) {
+            memcpy(o, seg->str, seg->len);
+            o += seg->len;
+        } else {
+            memcpy(o, str[seg->type], len[seg->type]);
+            o += len[seg->type];
+        }
+    }
+    *o = 0;
+    
+    if(outlen) {
+        *outlen = size;
+    }
+    return out;
+}
+
+void msg_template_time(char buf[16]) {
+    msg_template_format_time(buf, time(NULL));
+}
+
+void msg_template_format_time(char buf[16], time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, 16, "%H:%M:%S", &tm);
+}
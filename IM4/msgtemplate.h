@@ -0,0 +1,122 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef msgtemplate_h
+#define msgtemplate_h
+
+#include <stdlib.h>
+#include <time.h>
+#include <stdbool.h>
+
+/*
+ * Compiled conversation log templates
+ *
+ * A template is compiled once into a list of text and placeholder
+ * segments. Rendering computes the output size and writes all segments
+ * in one pass.
+ *
+ * Placeholders of the msg.in/out format settings (UITemplate):
+ * %t time, %x xid, %a alias, %s secure/insecure symbol, %m message
+ * any other character after % is copied
+ */
+
+enum MsgTemplateSegmentType {
+    MSG_TEMPLATE_TEXT = 0,
+    MSG_TEMPLATE_TIME,
+    MSG_TEMPLATE_XID,
+    MSG_TEMPLATE_ALIAS,
+    MSG_TEMPLATE_SECURE,
+    MSG_TEMPLATE_MESSAGE
+};
+
+typedef struct MsgTemplateSegment {
+    enum MsgTemplateSegmentType type;
+    
+    /*
+     * MSG_TEMPLATE_TEXT: text
+     */
+    const char *str;
+    size_t len;
+} MsgTemplateSegment;
+
+typedef struct MsgTemplate {
+    MsgTemplateSegment *segments;
+    size_t nsegments;
+    
+    /*
+     * storage of the text segments
+     */
+    char *text;
+    
+    char *secure;
+    char *insecure;
+} MsgTemplate;
+
+typedef struct MsgTemplateValues {
+    const char *time;
+    const char *xid;
+    const char *alias;
+    bool secure;
+    const char *message;
+} MsgTemplateValues;
+
+/*
+ * compiles a log entry template
+ *
+ * html_format: html format of the entry or NULL
+ * prefix_format: plain text prefix, used if html_format is NULL, the
+ *                message is appended after the prefix
+ * color: color of the prefix
+ * secure, insecure: values of %s
+ */
+MsgTemplate* msg_template_compile(
+        const char *html_format,
+        const char *prefix_format,
+        const char *color,
+        const char *secure,
+        const char *insecure);
+
+void msg_template_free(MsgTemplate *tpl);
+
+/*
+ * renders a log entry
+ * the result is 0-terminated, the length is stored in outlen, if not NULL
+ */
+char* msg_template_render(const MsgTemplate *tpl, const MsgTemplateValues *values, size_t *outlen);
+
+/*
+ * writes the current local time (HH:MM:SS) to buf
+ */
+void msg_template_time(char buf[16]);
+
+/*
+ * writes the local time t (HH:MM:SS) to buf
+ */
+void msg_template_format_time(char buf[16], time_t t);
+
+#endif /* msgtemplate_h */
@@ -29,10 +29,31 @@
 
 #include "otr.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <libotr/context.h>
+#include <libotr/instag.h>
+
 #include "app.h"
+#include "otrpool.h"
+#include "trace.h"
+#include "pipeline.h"
+#include "monotime.h"
 
 #define IM_PROTOCOL "xmpp"
 
+/*
+ * minimum time between two writes of the fingerprints file (ms)
+ */
+#define OTR_FINGERPRINTS_WRITE_INTERVAL 5000
+
+static void contexts_forget(Xmpp *xmpp, OtrlUserState us);
+
 static OtrlMessageAppOps otr_ops = {
     otr_policy,
     otr_create_privkey,
@@ -62,12 +83,964 @@ static OtrlMessageAppOps otr_ops = {
 
 
 
-void start_otr(Xmpp *xmpp, const char *recipient) {
-    char *msg_crypt;
+/*
+ * reads the private key, fingerprints and instance tags into us
+ * privkey_only: skip the fingerprints and instance tags
+ * times: optional array for the read time of each file (ns)
+ */
+static void otr_read_files(OtrlUserState us, bool privkey_only, uint64_t *times) {
+    uint64_t start = monotime_ns();
+    
+    char *privkey_file = app_configfile("otr.private_key");
+    otrl_privkey_read(us, privkey_file);
+    free(privkey_file);
+    uint64_t t_privkey = monotime_ns();
+    
+    if(privkey_only) {
+        if(times) {
+            times[0] = t_privkey - start;
+            times[1] = 0;
+            times[2] = 0;
+        }
+        return;
+    }
+    
+    char *fingerprints_file = app_configfile("otr.fingerprints");
+    otrl_privkey_read_fingerprints(us, fingerprints_file, NULL, NULL);
+    free(fingerprints_file);
+    uint64_t t_fingerprints = monotime_ns();
+    
+    char *instancetags_file = app_configfile("otr.instance_tags");
+    otrl_instag_read(us, instancetags_file);
+    free(instancetags_file);
+    
+    if(times) {
+        times[0] = t_privkey - start;
+        times[1] = t_fingerprints - t_privkey;
+        times[2] = monotime_ns() - t_fingerprints;
+    }
+}
+
+static void* otr_load_thread(void *data) {
+    Xmpp *xmpp = data;
+    uint64_t times[3];
+    
+    // with a worker pool, the fingerprints and instance tags are only used
+    // in the worker shards, xmpp->userstate just needs the private key
+    pthread_mutex_lock(&xmpp->otr_lock);
+    bool sharded = xmpp->otr_sharded;
+    pthread_mutex_unlock(&xmpp->otr_lock);
+    
+    otr_read_files(xmpp->userstate, sharded, times);
+    uint64_t end = monotime_ns();
+    
+    pthread_mutex_lock(&xmpp->otr_lock);
+    if(xmpp->otr_sharded && !sharded) {
+        // the pool was created while the files were read
+        contexts_forget(xmpp, xmpp->userstate);
+        otrl_context_forget_all(xmpp->userstate);
+        otrl_instag_forget_all(xmpp->userstate);
+    }
+    xmpp->otr_loaded = true;
+    pthread_cond_broadcast(&xmpp->otr_cond);
+    pthread_mutex_unlock(&xmpp->otr_lock);
+    
+    char *log = NULL;
+    if(sharded) {
+        asprintf(&log, "otr: state loaded %.1f ms after startup (private key: %.1f ms, fingerprints and instance tags: otr workers)\n",
+                (double)(end - xmpp->created) / 1000000,
+                (double)times[0] / 1000000);
+    } else {
+        asprintf(&log, "otr: state loaded %.1f ms after startup (private key: %.1f ms, fingerprints: %.1f ms, instance tags: %.1f ms)\n",
+                (double)(end - xmpp->created) / 1000000,
+                (double)times[0] / 1000000,
+                (double)times[1] / 1000000,
+                (double)times[2] / 1000000);
+    }
+    XmppLog(log);
+    free(log);
+    
+    return NULL;
+}
+
+void otr_load_state(Xmpp *xmpp) {
+    pthread_t t;
+    if(pthread_create(&t, NULL, otr_load_thread, xmpp)) {
+        perror("pthread_create");
+        otr_load_thread(xmpp);
+        return;
+    }
+    pthread_detach(t);
+}
+
+void otr_wait_state(Xmpp *xmpp, const char *op) {
+    if(!xmpp->userstate) {
+        return;
+    }
+    
+    pthread_mutex_lock(&xmpp->otr_lock);
+    if(!xmpp->otr_loaded) {
+        uint64_t start = monotime_ns();
+        while(!xmpp->otr_loaded) {
+            pthread_cond_wait(&xmpp->otr_cond, &xmpp->otr_lock);
+        }
+        pthread_mutex_unlock(&xmpp->otr_lock);
+        
+        char *log = NULL;
+        asprintf(&log, "otr: %s waited %.1f ms for the otr state\n", op, (double)(monotime_ns() - start) / 1000000);
+        XmppLog(log);
+        free(log);
+        return;
+    }
+    pthread_mutex_unlock(&xmpp->otr_lock);
+}
+
+// ------------------------- fingerprints write-behind -------------------------
+
+/*
+ * serializes the fingerprints of the userstate or merges the snapshots of
+ * the worker shards
+ * returns NULL, if not all workers have loaded their shard
+ * must be called in the xmpp thread
+ */
+static char* fingerprints_snapshot(Xmpp *xmpp, size_t *len) {
+    char *buf = NULL;
+    size_t buflen = 0;
+    FILE *out = open_memstream(&buf, &buflen);
+    if(!out) {
+        return NULL;
+    }
+    if(xmpp->otr_pool) {
+        if(otrpool_write_fingerprints(xmpp->otr_pool, out)) {
+            fclose(out);
+            free(buf);
+            return NULL;
+        }
+    } else {
+        otrl_privkey_write_fingerprints_FILEp(xmpp->userstate, out);
+    }
+    fclose(out);
+    *len = buflen;
+    return buf;
+}
+
+/*
+ * writes the data to a temp file and renames it to the fingerprints file
+ */
+static int fingerprints_write(const char *data, size_t len) {
+    char *filename = app_configfile("otr.fingerprints");
+    char *tmpfile = NULL;
+    asprintf(&tmpfile, "%s.tmp", filename);
+    
+    int ret = 1;
+    FILE *out = fopen(tmpfile, "w");
+    if(out) {
+        size_t w = fwrite(data, 1, len, out);
+        int err = fflush(out) || fsync(fileno(out));
+        fclose(out);
+        if(w == len && !err && !rename(tmpfile, filename)) {
+            ret = 0;
+        } else {
+            unlink(tmpfile);
+        }
+    }
+    
+    if(ret) {
+        char *log = NULL;
+        asprintf(&log, "otr: cannot write %s: %s\n", filename, strerror(errno));
+        XmppLog(log);
+        free(log);
+    }
+    
+    free(tmpfile);
+    free(filename);
+    return ret;
+}
+
+/*
+ * xmpp thread: creates the snapshot for the persister thread
+ */
+static void fingerprints_snapshot_cb(Xmpp *xmpp, void *unused) {
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    pthread_mutex_lock(&p->lock);
+    if(p->dirty && !p->snapshot) {
+        p->snapshot = fingerprints_snapshot(xmpp, &p->snapshot_len);
+        p->dirty = p->snapshot == NULL;
+    }
+    p->requested = false;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void persist_timedwait(XmppOtrPersist *p, uint64_t ns) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t t = (uint64_t)now.tv_usec * 1000 + ns;
+    struct timespec abstime;
+    abstime.tv_sec = now.tv_sec + t / 1000000000;
+    abstime.tv_nsec = t % 1000000000;
+    pthread_cond_timedwait(&p->cond, &p->lock, &abstime);
+}
+
+static void* persist_thread(void *data) {
+    Xmpp *xmpp = data;
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    uint64_t interval = (uint64_t)OTR_FINGERPRINTS_WRITE_INTERVAL * 1000000;
+    
+    pthread_mutex_lock(&p->lock);
+    while(!p->stop) {
+        if(!p->dirty) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        
+        // write at most once per interval
+        uint64_t now = monotime_ns();
+        if(p->last_write > 0 && now < p->last_write + interval) {
+            persist_timedwait(p, p->last_write + interval - now);
+            continue;
+        }
+        
+        // the userstate is only accessed in the xmpp thread
+        p->requested = true;
+        pthread_mutex_unlock(&p->lock);
+        XmppCall(xmpp, fingerprints_snapshot_cb, NULL);
+        pthread_mutex_lock(&p->lock);
+        while(p->requested && !p->stop) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        
+        char *snapshot = p->snapshot;
+        size_t len = p->snapshot_len;
+        p->snapshot = NULL;
+        if(snapshot) {
+            pthread_mutex_unlock(&p->lock);
+            fingerprints_write(snapshot, len);
+            free(snapshot);
+            pthread_mutex_lock(&p->lock);
+            p->last_write = monotime_ns();
+        } else if(p->dirty) {
+            // otr workers still loading, retry after the interval
+            p->last_write = monotime_ns();
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    
+    return NULL;
+}
+
+/*
+ * marks the fingerprints as dirty and starts the persister thread
+ */
+static void fingerprints_changed(Xmpp *xmpp) {
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    
+    // mark the fingerprints as dirty, the persister thread writes the file
+    pthread_mutex_lock(&p->lock);
+    p->dirty = true;
+    if(!p->running) {
+        if(pthread_create(&p->thread, NULL, persist_thread, xmpp)) {
+            perror("pthread_create");
+        } else {
+            p->running = true;
+        }
+    }
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void otr_flush_fingerprints(Xmpp *xmpp) {
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    
+    pthread_mutex_lock(&p->lock);
+    bool running = p->running;
+    p->stop = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    
+    if(running) {
+        pthread_join(p->thread, NULL);
+    }
+    
+    pthread_mutex_lock(&p->lock);
+    p->running = false;
+    p->stop = false;
+    p->requested = false;
+    char *snapshot = p->snapshot;
+    size_t len = p->snapshot_len;
+    p->snapshot = NULL;
+    if(p->dirty) {
+        free(snapshot);
+        snapshot = fingerprints_snapshot(xmpp, &len);
+        p->dirty = false;
+        if(!snapshot) {
+            XmppLog("otr: fingerprints not written, the otr workers have not loaded all fingerprints\n");
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    
+    if(snapshot) {
+        fingerprints_write(snapshot, len);
+        free(snapshot);
+        p->last_write = monotime_ns();
+    }
+}
+
+// ------------------------- context cache -------------------------
+
+struct XmppOtrContextEntry {
+    char *jid;
+    
+    /*
+     * context of the last gone_secure/still_secure/gone_insecure callback
+     * and the userstate (shard), that owns it
+     * the context must only be used with the same userstate
+     */
+    OtrlUserState userstate;
+    ConnContext *context;
+    
+    OtrlMessageState msgstate;
+    
+    /*
+     * reassembly buffer of incoming fragments
+     * only accessed in the xmpp thread, with c->lock held
+     */
+    char *fragment;
+    size_t fragment_len;
+    size_t fragment_alloc;
+    unsigned short fragment_k;
+    unsigned short fragment_n;
+    unsigned int fragment_instance;
+    
+    XmppOtrContextEntry *next;
+};
+
+#define OTR_CONTEXTS_INITIAL_SIZE 64
+
+static uint32_t jid_hash(const char *jid) {
+    uint32_t h = 2166136261u;
+    for(const char *p=jid;*p;p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void contexts_grow(XmppOtrContexts *c) {
+    size_t newsize = c->size ? c->size * 2 : OTR_CONTEXTS_INITIAL_SIZE;
+    XmppOtrContextEntry **newtable = calloc(newsize, sizeof(XmppOtrContextEntry*));
+    for(size_t i=0;i<c->size;i++) {
+        XmppOtrContextEntry *e = c->table[i];
+        while(e) {
+            XmppOtrContextEntry *next = e->next;
+            size_t slot = jid_hash(e->jid) & (newsize - 1);
+            e->next = newtable[slot];
+            newtable[slot] = e;
+            e = next;
+        }
+    }
+    free(c->table);
+    c->table = newtable;
+    c->size = newsize;
+}
+
+/*
+ * returns the entry for jid, creates a new entry if create is true
+ * c->lock must be held
+ */
+static XmppOtrContextEntry* contexts_get(XmppOtrContexts *c, const char *jid, bool create) {
+    if(c->size > 0) {
+        XmppOtrContextEntry *e = c->table[jid_hash(jid) & (c->size - 1)];
+        while(e) {
+            if(!strcmp(e->jid, jid)) {
+                return e;
+            }
+            e = e->next;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+    
+    if(c->count >= c->size * 3 / 4) {
+        contexts_grow(c);
+    }
+    XmppOtrContextEntry *e = calloc(1, sizeof(XmppOtrContextEntry));
+    e->jid = strdup(jid);
+    e->msgstate = OTRL_MSGSTATE_PLAINTEXT;
+    size_t slot = jid_hash(jid) & (c->size - 1);
+    e->next = c->table[slot];
+    c->table[slot] = e;
+    c->count++;
+    return e;
+}
+
+/*
+ * removes the entry, if it has neither a context nor an incomplete message
+ * c->lock must be held, e must not be used after this call
+ */
+static void contexts_evict(XmppOtrContexts *c, XmppOtrContextEntry *e) {
+    if(e->context || e->fragment || e->msgstate != OTRL_MSGSTATE_PLAINTEXT) {
+        return;
+    }
+    XmppOtrContextEntry **p = &c->table[jid_hash(e->jid) & (c->size - 1)];
+    while(*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    c->count--;
+    free(e->jid);
+    free(e);
+}
+
+/*
+ * updates the msgstate of jid and the context, if context is not NULL
+ * us: userstate, that owns context
+ */
+static void contexts_update(Xmpp *xmpp, OtrlUserState us, const char *jid, ConnContext *context, OtrlMessageState msgstate) {
+    XmppOtrContexts *c = &xmpp->otr_contexts;
+    pthread_mutex_lock(&c->lock);
+    XmppOtrContextEntry *e = contexts_get(c, jid, true);
+    if(context) {
+        e->userstate = us;
+        e->context = context;
+    }
+    e->msgstate = msgstate;
+    contexts_evict(c, e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * removes all cached contexts owned by us
+ * must be called before the contexts of us are forgotten
+ */
+static void contexts_forget(Xmpp *xmpp, OtrlUserState us) {
+    XmppOtrContexts *c = &xmpp->otr_contexts;
+    pthread_mutex_lock(&c->lock);
+    for(size_t i=0;i<c->size;i++) {
+        XmppOtrContextEntry *e = c->table[i];
+        while(e) {
+            XmppOtrContextEntry *next = e->next;
+            if(e->userstate == us) {
+                e->userstate = NULL;
+                e->context = NULL;
+                contexts_evict(c, e);
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+OtrlMessageState otr_context_msgstate(Xmpp *xmpp, const char *jid) {
+    XmppOtrContexts *c = &xmpp->otr_contexts;
+    pthread_mutex_lock(&c->lock);
+    XmppOtrContextEntry *e = contexts_get(c, jid, false);
+    OtrlMessageState msgstate = e ? e->msgstate : OTRL_MSGSTATE_PLAINTEXT;
+    pthread_mutex_unlock(&c->lock);
+    return msgstate;
+}
+
+// ------------------------- fragments -------------------------
+
+/*
+ * min otr message size, libotr needs space for the fragment header
+ */
+#define OTR_FRAGMENT_SIZE_MIN 256
+
+/*
+ * max size of a reassembled message, longer messages are dropped
+ */
+#define OTR_FRAGMENT_MAX_MESSAGE (256 * 1024)
+
+/*
+ * max number of peers (full jids) with an incomplete fragmented message,
+ * new fragment sequences are dropped, when the limit is reached
+ */
+#define OTR_FRAGMENT_MAX_PENDING 32
+
+/*
+ * max number of bytes sent in one output round, before the event loop
+ * can process other events
+ */
+#define OTR_OUTPUT_ROUND_BYTES 65536
+
+typedef struct XmppOtrOutMsg XmppOtrOutMsg;
+struct XmppOtrOutMsg {
+    char *message;
+    XmppOtrOutMsg *next;
+};
+
+struct XmppOtrPeerQueue {
+    char *to;
+    XmppOtrOutMsg *begin;
+    XmppOtrOutMsg *end;
+    XmppOtrPeerQueue *next;
+};
+
+enum OtrFragmentStatus {
+    OTR_FRAGMENT_NONE = 0,
+    OTR_FRAGMENT_INCOMPLETE,
+    OTR_FRAGMENT_COMPLETE
+};
+
+static bool is_fragment(const char *msg) {
+    return !strncmp(msg, "?OTR|", 5) || !strncmp(msg, "?OTR,", 5);
+}
+
+/*
+ * sends one message of every peer queue per round, until the queues are
+ * empty or OTR_OUTPUT_ROUND_BYTES are sent
+ */
+static void output_round(Xmpp *xmpp, void *unused) {
+    XmppOtrOutput *out = &xmpp->otr_output;
+    out->scheduled = false;
+    
+    size_t sent = 0;
+    while(out->queues && sent < OTR_OUTPUT_ROUND_BYTES) {
+        XmppOtrPeerQueue *prev = NULL;
+        XmppOtrPeerQueue *q = out->queues;
+        while(q) {
+            XmppOtrOutMsg *msg = q->begin;
+            q->begin = msg->next;
+            if(!q->begin) {
+                q->end = NULL;
+            }
+            
+            Xmpp_Send(xmpp, q->to, msg->message);
+            sent += strlen(msg->message);
+            free(msg->message);
+            free(msg);
+            
+            XmppOtrPeerQueue *next = q->next;
+            if(!q->begin) {
+                if(prev) {
+                    prev->next = next;
+                } else {
+                    out->queues = next;
+                }
+                free(q->to);
+                free(q);
+            } else {
+                prev = q;
+            }
+            q = next;
+        }
+    }
+    
+    if(out->queues) {
+        out->scheduled = true;
+        XmppCall(xmpp, output_round, NULL);
+    }
+}
+
+/*
+ * sends an otr message to a peer
+ * fragments and all following messages of the same peer are queued until
+ * the previous fragments are sent
+ * must be called in the xmpp thread
+ */
+static void otr_output(Xmpp *xmpp, const char *to, const char *message) {
+    XmppOtrOutput *out = &xmpp->otr_output;
+    XmppOtrPeerQueue *q = out->queues;
+    XmppOtrPeerQueue *last = NULL;
+    while(q) {
+        if(!strcmp(q->to, to)) {
+            break;
+        }
+        last = q;
+        q = q->next;
+    }
+    
+    if(!q && !is_fragment(message)) {
+        Xmpp_Send(xmpp, to, message);
+        return;
+    }
+    
+    if(!q) {
+        q = calloc(1, sizeof(XmppOtrPeerQueue));
+        q->to = strdup(to);
+        if(last) {
+            last->next = q;
+        } else {
+            out->queues = q;
+        }
+    }
+    
+    XmppOtrOutMsg *msg = malloc(sizeof(XmppOtrOutMsg));
+    msg->message = strdup(message);
+    msg->next = NULL;
+    if(q->end) {
+        q->end->next = msg;
+    } else {
+        q->begin = msg;
+    }
+    q->end = msg;
+    
+    if(!out->scheduled) {
+        out->scheduled = true;
+        XmppCall(xmpp, output_round, NULL);
+    }
+}
+
+/*
+ * parses the header of a v3 (?OTR|sender|receiver,k,n,data,) or
+ * v2 (?OTR,k,n,data,) fragment
+ * returns 0 on success
+ */
+static int fragment_parse(const char *msg, unsigned int *instance, unsigned short *k, unsigned short *n, const char **data, size_t *datalen) {
+    unsigned int receiver;
+    int pos = 0;
+    if(!strncmp(msg, "?OTR|", 5)) {
+        if(sscanf(msg, "?OTR|%x|%x,%hu,%hu,%n", instance, &receiver, k, n, &pos) < 4 || pos == 0) {
+            return 1;
+        }
+    } else if(!strncmp(msg, "?OTR,", 5)) {
+        *instance = 0;
+        if(sscanf(msg, "?OTR,%hu,%hu,%n", k, n, &pos) < 2 || pos == 0) {
+            return 1;
+        }
+    } else {
+        return 1;
+    }
+    
+    const char *end = strchr(msg + pos, ',');
+    if(!end) {
+        return 1;
+    }
+    *data = msg + pos;
+    *datalen = end - *data;
+    return 0;
+}
+
+/*
+ * frees the incomplete message of the entry
+ * c->lock must be held
+ */
+static void fragment_drop(XmppOtrContexts *c, XmppOtrContextEntry *e) {
+    if(e->fragment) {
+        free(e->fragment);
+        e->fragment = NULL;
+        c->fragments_pending--;
+    }
+    e->fragment_len = 0;
+    e->fragment_alloc = 0;
+    e->fragment_k = 0;
+    e->fragment_n = 0;
+}
+
+/*
+ * collects the fragments of a message from a peer
+ *
+ * The pieces are appended to a buffer with exponential growth and the
+ * complete message is passed to libotr, which otherwise copies the whole
+ * buffer for every fragment. Messages longer than OTR_FRAGMENT_MAX_MESSAGE
+ * and sequences, that are abandoned or out of order, are dropped.
+ *
+ * returns OTR_FRAGMENT_COMPLETE and the reassembled message in result,
+ * OTR_FRAGMENT_INCOMPLETE if more fragments are needed or OTR_FRAGMENT_NONE,
+ * if message is not a fragment
+ * must be called in the xmpp thread
+ */
+static enum OtrFragmentStatus otr_reassemble(Xmpp *xmpp, const char *from, const char *message, char **result) {
+    unsigned int instance;
+    unsigned short k, n;
+    const char *data;
+    size_t datalen;
+    if(fragment_parse(message, &instance, &k, &n, &data, &datalen) || k == 0 || k > n) {
+        return OTR_FRAGMENT_NONE;
+    }
+    
+    enum OtrFragmentStatus ret = OTR_FRAGMENT_INCOMPLETE;
+    XmppOtrContexts *c = &xmpp->otr_contexts;
+    pthread_mutex_lock(&c->lock);
+    XmppOtrContextEntry *e = contexts_get(c, from, k == 1);
+    if(!e) {
+        // no pending message, drop the fragment like libotr
+        pthread_mutex_unlock(&c->lock);
+        return ret;
+    }
+    
+    if(k == 1) {
+        if(!e->fragment && c->fragments_pending >= OTR_FRAGMENT_MAX_PENDING) {
+            contexts_evict(c, e);
+            pthread_mutex_unlock(&c->lock);
+            return ret;
+        }
+        fragment_drop(c, e);
+        e->fragment_n = n;
+        e->fragment_instance = instance;
+    } else if(!e->fragment || n != e->fragment_n || k != e->fragment_k + 1 || instance != e->fragment_instance) {
+        // out of order, drop the message like libotr
+        fragment_drop(c, e);
+        contexts_evict(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return ret;
+    }
+    
+    if(e->fragment_len + datalen >= OTR_FRAGMENT_MAX_MESSAGE) {
+        fragment_drop(c, e);
+        contexts_evict(c, e);
+        pthread_mutex_unlock(&c->lock);
+        
+        char *log = NULL;
+        asprintf(&log, "otr: fragmented message from %s exceeds %d bytes, dropped\n", from, OTR_FRAGMENT_MAX_MESSAGE);
+        XmppLog(log);
+        free(log);
+        return ret;
+    }
+    
+    if(!e->fragment || e->fragment_len + datalen >= e->fragment_alloc) {
+        size_t newalloc = e->fragment_alloc ? e->fragment_alloc : 1024;
+        while(e->fragment_len + datalen >= newalloc) {
+            newalloc *= 2;
+        }
+        if(!e->fragment) {
+            c->fragments_pending++;
+        }
+        e->fragment = realloc(e->fragment, newalloc);
+        e->fragment_alloc = newalloc;
+    }
+    memcpy(e->fragment + e->fragment_len, data, datalen);
+    e->fragment_len += datalen;
+    e->fragment[e->fragment_len] = 0;
+    e->fragment_k = k;
+    
+    if(k == n) {
+        *result = e->fragment;
+        e->fragment = NULL;
+        c->fragments_pending--;
+        fragment_drop(c, e);
+        contexts_evict(c, e);
+        ret = OTR_FRAGMENT_COMPLETE;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+// ------------------------- private key generation -------------------------
+
+struct XmppOtrQueuedMsg {
+    char *to;
+    
+    /*
+     * message to encrypt and send or NULL to start the otr session
+     */
+    char *message;
+    
+    XmppOtrQueuedMsg *next;
+};
+
+typedef struct OtrKeygenJob {
+    Xmpp *xmpp;
+    void *newkey;
+    gcry_error_t err;
+    uint64_t start;
+} OtrKeygenJob;
+
+static void keygen_enqueue(Xmpp *xmpp, const char *to, const char *message) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    
+    // don't start the same session twice
+    if(!message) {
+        for(XmppOtrQueuedMsg *q=kg->queue_begin;q;q=q->next) {
+            if(!q->message && !strcmp(q->to, to)) {
+                return;
+            }
+        }
+    }
+    
+    XmppOtrQueuedMsg *q = malloc(sizeof(XmppOtrQueuedMsg));
+    q->to = strdup(to);
+    q->message = message ? strdup(message) : NULL;
+    q->next = NULL;
+    if(kg->queue_end) {
+        kg->queue_end->next = q;
+    } else {
+        kg->queue_begin = q;
+    }
+    kg->queue_end = q;
+}
+
+static void keygen_finish(Xmpp *xmpp, OtrKeygenJob *job) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    
+    gcry_error_t err = job->err;
+    if(!err) {
+        char *filename = app_configfile("otr.private_key");
+        err = otrl_privkey_generate_finish(xmpp->userstate, job->newkey, filename);
+        free(filename);
+    } else {
+        otrl_privkey_generate_cancelled(xmpp->userstate, job->newkey);
+    }
+    kg->running = false;
+    
+    // the workers have their own copy of the private key
+    if(!err && xmpp->otr_pool) {
+        otrpool_submit_all(xmpp->otr_pool, OTR_JOB_RELOAD_PRIVKEY);
+    }
+    
+    char *log = NULL;
+    if(err) {
+        asprintf(&log, "otr: private key generation failed: %s\n", gcry_strerror(err));
+    } else {
+        asprintf(&log, "otr: private key generated in %.1f s\n", (double)(monotime_ns() - job->start) / 1e9);
+    }
+    XmppLog(log);
+    free(log);
+    
+    // flush the queue in order, drop it if the connection is gone
+    XmppOtrQueuedMsg *q = kg->queue_begin;
+    kg->queue_begin = NULL;
+    kg->queue_end = NULL;
+    while(q) {
+        if(xmpp->running && !err) {
+            if(q->message) {
+                otr_send_message(xmpp, q->to, q->message);
+            } else {
+                start_otr(xmpp, q->to);
+            }
+        }
+        
+        XmppOtrQueuedMsg *next = q->next;
+        free(q->to);
+        free(q->message);
+        free(q);
+        q = next;
+    }
+    
+    free(job);
+}
+
+/*
+ * discards a calculated key and the queued operations, when the xmpp
+ * thread is gone
+ * kg->lock must be locked
+ */
+static void keygen_cancel(Xmpp *xmpp, OtrKeygenJob *job) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    otrl_privkey_generate_cancelled(xmpp->userstate, job->newkey);
+    free(job);
+    
+    kg->running = false;
+    XmppOtrQueuedMsg *q = kg->queue_begin;
+    kg->queue_begin = NULL;
+    kg->queue_end = NULL;
+    while(q) {
+        XmppOtrQueuedMsg *next = q->next;
+        free(q->to);
+        free(q->message);
+        free(q);
+        q = next;
+    }
+    
+    XmppLog("otr: private key generation cancelled: xmpp thread stopped\n");
+}
+
+static void keygen_finish_cb(Xmpp *xmpp, void *unused) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    pthread_mutex_lock(&kg->lock);
+    OtrKeygenJob *job = kg->job;
+    kg->job = NULL;
+    pthread_mutex_unlock(&kg->lock);
+    
+    if(job) {
+        keygen_finish(xmpp, job);
+    }
+}
+
+static void* keygen_thread(void *data) {
+    OtrKeygenJob *job = data;
+    Xmpp *xmpp = job->xmpp;
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    job->err = otrl_privkey_generate_calculate(job->newkey);
+    
+    // the key is always finished in the xmpp thread, because it modifies
+    // the userstate
+    // after the loop exited, the userstate is not used anymore and the
+    // key is discarded here
+    pthread_mutex_lock(&kg->lock);
+    if(kg->loop_exited) {
+        keygen_cancel(xmpp, job);
+    } else {
+        kg->job = job;
+        XmppCall(xmpp, keygen_finish_cb, NULL);
+    }
+    pthread_mutex_unlock(&kg->lock);
+    return NULL;
+}
+
+void otr_keygen_loop_start(Xmpp *xmpp) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    pthread_mutex_lock(&kg->lock);
+    kg->loop_exited = false;
+    pthread_mutex_unlock(&kg->lock);
+}
+
+void otr_keygen_loop_exit(Xmpp *xmpp) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    pthread_mutex_lock(&kg->lock);
+    kg->loop_exited = true;
+    // posted, but not processed by the loop
+    if(kg->job) {
+        keygen_cancel(xmpp, kg->job);
+        kg->job = NULL;
+    }
+    pthread_mutex_unlock(&kg->lock);
+}
+
+/*
+ * starts the private key generation, must be called in the xmpp thread
+ */
+static void keygen_start(Xmpp *xmpp, const char *accountname, const char *protocol) {
+    XmppOtrKeygen *kg = &xmpp->otr_keygen;
+    if(kg->running) {
+        return;
+    }
+    
+    OtrKeygenJob *job = malloc(sizeof(OtrKeygenJob));
+    job->xmpp = xmpp;
+    job->newkey = NULL;
+    job->err = 0;
+    job->start = monotime_ns();
+    
+    gcry_error_t err = otrl_privkey_generate_start(xmpp->userstate, accountname, protocol, &job->newkey);
+    if(err) {
+        char *log = NULL;
+        asprintf(&log, "otr: cannot start private key generation: %s\n", gcry_strerror(err));
+        XmppLog(log);
+        free(log);
+        free(job);
+        return;
+    }
+    
+    pthread_t t;
+    if(pthread_create(&t, NULL, keygen_thread, job)) {
+        perror("pthread_create");
+        otrl_privkey_generate_cancelled(xmpp->userstate, job->newkey);
+        free(job);
+        return;
+    }
+    pthread_detach(t);
+    
+    kg->running = true;
+    XmppLog("otr: generating private key\n");
+}
+
+// ------------------------- libotr calls -------------------------
+
+/*
+ * The following functions call libotr with the userstate of op. They run
+ * in the xmpp thread (op = &xmpp->otr_opdata) or in an otr worker.
+ */
+
+static char* otr_query(XmppOtrOpdata *op, const char *recipient) {
+    Xmpp *xmpp = op->xmpp;
+    char *msg_crypt = NULL;
     otrl_message_sending(
-            xmpp->userstate,
+            op->userstate,
             &otr_ops,
-            xmpp,
+            op,
             xmpp->settings.jid,
             IM_PROTOCOL,
             recipient,
@@ -79,28 +1052,34 @@ void start_otr(Xmpp *xmpp, const char *recipient) {
             NULL,
             NULL,
             NULL);
-    Xmpp_Send(xmpp, recipient, msg_crypt);
-    free(msg_crypt);
+    return msg_crypt;
 }
 
-void stop_otr(Xmpp *xmpp, const char *recipient) {
+static void otr_disconnect(XmppOtrOpdata *op, const char *recipient) {
+    Xmpp *xmpp = op->xmpp;
     // this seems to work, however we don't get the gone_insecure message
     otrl_message_disconnect(
-            xmpp->userstate,
+            op->userstate,
             &otr_ops,
-            xmpp,
+            op,
             xmpp->settings.jid,
             IM_PROTOCOL,
             recipient,
             OTRL_INSTAG_BEST);
+    contexts_update(xmpp, op->userstate, recipient, NULL, OTRL_MSGSTATE_PLAINTEXT);
 }
 
-char *encrypt_message(Xmpp *xmpp, const char *to, const char *message, int *error) {
+static char* otr_encrypt(XmppOtrOpdata *op, const char *to, const char *message, int *error) {
+    IM4_TRACE(otr_encrypt_entry, to, strlen(message));
+    IM4_TRACE_START(start, otr_encrypt_return);
+    
+    Xmpp *xmpp = op->xmpp;
+    op->peer = to;
     char *enctext = NULL;
     int err = otrl_message_sending(
-            xmpp->userstate,
+            op->userstate,
             &otr_ops,
-            xmpp,
+            op,
             xmpp->settings.jid,
             IM_PROTOCOL,
             to,
@@ -108,20 +1087,27 @@ char *encrypt_message(Xmpp *xmpp, const char *to, const char *message, int *erro
             message,
             NULL,
             &enctext,
-            OTRL_FRAGMENT_SEND_SKIP,
+            OTRL_FRAGMENT_SEND_ALL,
             NULL,
             NULL,
             NULL);
     *error = err;
+    op->peer = NULL;
     
+    IM4_TRACE(otr_encrypt_return, to, strlen(message), IM4_TRACE_ELAPSED(start), err);
     return enctext;
 }
 
-char *decrypt_message(Xmpp *xmpp, const char *from, const char *message, int *error) {
+static char* otr_decrypt(XmppOtrOpdata *op, const char *from, const char *message, int *error) {
+    IM4_TRACE(otr_decrypt_entry, from, strlen(message));
+    IM4_TRACE_START(start, otr_decrypt_return);
+    
+    Xmpp *xmpp = op->xmpp;
+    op->peer = from;
     char *msg_decrypt = NULL;
-    int err = otrl_message_receiving(xmpp->userstate,
+    int err = otrl_message_receiving(op->userstate,
                                      &otr_ops,
-                                     xmpp,
+                                     op,
                                      xmpp->settings.jid,
                                      IM_PROTOCOL,
                                      from,
@@ -132,9 +1118,240 @@ char *decrypt_message(Xmpp *xmpp, const char *from, const char *message, int *er
                                      NULL,
                                      NULL);
     *error = err;
+    op->peer = NULL;
+    
+    IM4_TRACE(otr_decrypt_return, from, strlen(message), IM4_TRACE_ELAPSED(start), err);
     return msg_decrypt;
 }
 
+/*
+ * checks, if the otr session with from was finished by the peer
+ * us: userstate of the calling thread, a cached context owned by another
+ * userstate is ignored
+ */
+static bool otr_session_finished(Xmpp *xmpp, OtrlUserState us, const char *from) {
+    XmppOtrContexts *c = &xmpp->otr_contexts;
+    pthread_mutex_lock(&c->lock);
+    XmppOtrContextEntry *e = contexts_get(c, from, false);
+    ConnContext *context = e && e->userstate == us ? e->context : NULL;
+    OtrlMessageState cached = e ? e->msgstate : OTRL_MSGSTATE_PLAINTEXT;
+    pthread_mutex_unlock(&c->lock);
+    
+    // libotr doesn't call gone_insecure, when the peer finishes the session
+    if(cached == OTRL_MSGSTATE_ENCRYPTED && context && context->msgstate == OTRL_MSGSTATE_FINISHED) {
+        contexts_update(xmpp, us, from, NULL, OTRL_MSGSTATE_FINISHED);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * passes the result of otr_decrypt to the app
+ */
+static void otr_deliver(Xmpp *xmpp, const char *from, const char *msg, int err, bool finished, uint64_t decrypt_ns) {
+    if(err == 1) {
+        // this message could be part of an otr handshake
+        printf("internal otr message\n");
+        // check conversation encryption status
+        if(finished) {
+            app_update_secure_status(xmpp, from, false);
+        }
+    }
+    
+    if(msg) {
+        // otr messages are html
+        InboundMessage *user_msg = pipeline_process(from, XmppInboundRulesScope(xmpp, from), msg, true, true, decrypt_ns, 0);
+        user_msg->history_timestamp = XmppHistoryAdd(xmpp, user_msg->xid, false, true, user_msg->message);
+        
+        IM4_TRACE(message_dispatch, from, strlen(user_msg->text), true);
+        app_inbound_message(xmpp, user_msg);
+    }
+}
+
+// ------------------------- otr worker pool -------------------------
+
+static void otr_job_run(OtrWorker *worker, OtrJob *job) {
+    XmppOtrOpdata *op = &worker->opdata;
+    switch(job->type) {
+        case OTR_JOB_LOAD: {
+            otr_read_files(op->userstate, false, NULL);
+            otrpool_snapshot(worker);
+            break;
+        }
+        case OTR_JOB_RELOAD_PRIVKEY: {
+            char *privkey_file = app_configfile("otr.private_key");
+            otrl_privkey_read(op->userstate, privkey_file);
+            free(privkey_file);
+            break;
+        }
+        case OTR_JOB_ENCRYPT: {
+            job->result = otr_encrypt(op, job->peer, job->message, &job->err);
+            break;
+        }
+        case OTR_JOB_DECRYPT: {
+            uint64_t start = monotime_ns();
+            job->result = otr_decrypt(op, job->peer, job->message, &job->err);
+            job->duration_ns = monotime_ns() - start;
+            job->finished = job->err == 1 && otr_session_finished(op->xmpp, op->userstate, job->peer);
+            break;
+        }
+        case OTR_JOB_START: {
+            job->result = otr_query(op, job->peer);
+            break;
+        }
+        case OTR_JOB_STOP: {
+            otr_disconnect(op, job->peer);
+            break;
+        }
+        default: break;
+    }
+    
+    // the xmpp thread only merges the snapshots, it never locks the shard
+    if(worker->fingerprints_dirty) {
+        worker->fingerprints_dirty = false;
+        otrpool_snapshot(worker);
+        fingerprints_changed(op->xmpp);
+    }
+}
+
+static void otr_job_complete(Xmpp *xmpp, OtrJob *job) {
+    switch(job->type) {
+        case OTR_JOB_ENCRYPT: {
+            if(job->result) {
+                otr_output(xmpp, job->peer, job->result);
+                Xmpp_Send_State(xmpp, job->peer, XMPP_CHATSTATE_ACTIVE);
+            }
+            break;
+        }
+        case OTR_JOB_DECRYPT: {
+            otr_deliver(xmpp, job->peer, job->result, job->err, job->finished, job->duration_ns);
+            break;
+        }
+        case OTR_JOB_START:
+        case OTR_JOB_SEND: {
+            if(job->result) {
+                otr_output(xmpp, job->peer, job->result);
+            }
+            break;
+        }
+        case OTR_JOB_KEYGEN: {
+            keygen_start(xmpp, xmpp->settings.jid, IM_PROTOCOL);
+            if(xmpp->otr_keygen.running && job->peer) {
+                keygen_enqueue(xmpp, job->peer, NULL);
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+void otr_set_workers(Xmpp *xmpp, int nworkers) {
+    if(xmpp->otr_pool || nworkers <= 0 || !xmpp->userstate) {
+        return;
+    }
+    xmpp->otr_pool = otrpool_create(xmpp, nworkers, otr_job_run, otr_job_complete);
+    if(xmpp->otr_pool) {
+        pthread_mutex_lock(&xmpp->otr_lock);
+        xmpp->otr_sharded = true;
+        pthread_mutex_unlock(&xmpp->otr_lock);
+        
+        char *log = NULL;
+        asprintf(&log, "otr: %d worker threads\n", xmpp->otr_pool->nworkers);
+        XmppLog(log);
+        free(log);
+    }
+}
+
+// ------------------------- otr operations -------------------------
+
+void start_otr(Xmpp *xmpp, const char *recipient) {
+    otr_wait_state(xmpp, "start_otr");
+    
+    // without a private key, the session can't be established
+    if(!xmpp->otr_keygen.running && !otrl_privkey_find(xmpp->userstate, xmpp->settings.jid, IM_PROTOCOL)) {
+        keygen_start(xmpp, xmpp->settings.jid, IM_PROTOCOL);
+    }
+    if(xmpp->otr_keygen.running) {
+        keygen_enqueue(xmpp, recipient, NULL);
+        return;
+    }
+    
+    if(xmpp->otr_pool) {
+        otrpool_submit(xmpp->otr_pool, otrpool_job(OTR_JOB_START, recipient, NULL));
+        return;
+    }
+    
+    char *msg_crypt = otr_query(&xmpp->otr_opdata, recipient);
+    if(msg_crypt) {
+        otr_output(xmpp, recipient, msg_crypt);
+        free(msg_crypt);
+    }
+}
+
+void stop_otr(Xmpp *xmpp, const char *recipient) {
+    otr_wait_state(xmpp, "stop_otr");
+    
+    if(xmpp->otr_pool) {
+        otrpool_submit(xmpp->otr_pool, otrpool_job(OTR_JOB_STOP, recipient, NULL));
+        return;
+    }
+    
+    otr_disconnect(&xmpp->otr_opdata, recipient);
+}
+
+void otr_send_message(Xmpp *xmpp, const char *to, const char *message) {
+    // messages are sent when the private key is ready
+    if(xmpp->otr_keygen.running) {
+        keygen_enqueue(xmpp, to, message);
+        return;
+    }
+    
+    if(xmpp->otr_pool) {
+        otrpool_submit(xmpp->otr_pool, otrpool_job(OTR_JOB_ENCRYPT, to, message));
+        return;
+    }
+    
+    int err;
+    char *text = encrypt_message(xmpp, to, message, &err);
+    if(text) {
+        otr_output(xmpp, to, text);
+        Xmpp_Send_State(xmpp, to, XMPP_CHATSTATE_ACTIVE);
+        free(text);
+    }
+}
+
+void otr_receive_message(Xmpp *xmpp, const char *from, const char *message) {
+    char *reassembled = NULL;
+    switch(otr_reassemble(xmpp, from, message, &reassembled)) {
+        case OTR_FRAGMENT_NONE: break;
+        case OTR_FRAGMENT_INCOMPLETE: return;
+        case OTR_FRAGMENT_COMPLETE: message = reassembled; break;
+    }
+    
+    if(xmpp->otr_pool) {
+        otrpool_submit(xmpp->otr_pool, otrpool_job(OTR_JOB_DECRYPT, from, message));
+    } else {
+        int err;
+        uint64_t start = monotime_ns();
+        char *msg = decrypt_message(xmpp, from, message, &err);
+        uint64_t decrypt_ns = monotime_ns() - start;
+        bool finished = err == 1 && otr_session_finished(xmpp, xmpp->userstate, from);
+        otr_deliver(xmpp, from, msg, err, finished, decrypt_ns);
+        free(msg);
+    }
+    free(reassembled);
+}
+
+char *encrypt_message(Xmpp *xmpp, const char *to, const char *message, int *error) {
+    otr_wait_state(xmpp, "encrypt_message");
+    return otr_encrypt(&xmpp->otr_opdata, to, message, error);
+}
+
+char *decrypt_message(Xmpp *xmpp, const char *from, const char *message, int *error) {
+    otr_wait_state(xmpp, "decrypt_message");
+    return otr_decrypt(&xmpp->otr_opdata, from, message, error);
+}
+
 
 // OTR AppOps Functions
 
@@ -145,18 +1362,22 @@ OtrlPolicy otr_policy(void *opdata, ConnContext *context) {
 void otr_create_privkey(void *opdata, const char *accountname,
     const char *protocol)
 {
-    //Xmpp *xmpp = opdata;
-    
-    char *filename = app_configfile("otr.private_key");
+    XmppOtrOpdata *op = opdata;
+    Xmpp *xmpp = op->xmpp;
     
-    XmppLog("otr: create private key\n");
-    
-    char *buf = NULL;
-    asprintf(&buf, "account = %s\nfilename = %s\n", accountname, filename);
-    XmppLog(buf);
-    free(buf);
-    
-    free(filename);
+    // generating the key takes seconds, therefore it is generated in the
+    // background and the current operation fails
+    // the otr session with the current peer is restarted, when the key
+    // is ready
+    if(op->worker) {
+        // keygen state is owned by the xmpp thread
+        otrpool_complete(xmpp->otr_pool, otrpool_job(OTR_JOB_KEYGEN, op->peer, NULL));
+        return;
+    }
+    keygen_start(xmpp, accountname, protocol);
+    if(xmpp->otr_keygen.running && op->peer) {
+        keygen_enqueue(xmpp, op->peer, NULL);
+    }
 }
 
 int otr_is_logged_in(void *opdata, const char *accountname,
@@ -168,8 +1389,15 @@ int otr_is_logged_in(void *opdata, const char *accountname,
 void otr_inject_message(void *opdata, const char *accountname,
     const char *protocol, const char *recipient, const char *message)
 {
-    Xmpp *xmpp = opdata;
-    Xmpp_Send(xmpp, recipient, message);
+    XmppOtrOpdata *op = opdata;
+    if(op->worker) {
+        // send in the xmpp thread, in order with the job results
+        OtrJob *job = otrpool_job(OTR_JOB_SEND, recipient, NULL);
+        job->result = strdup(message);
+        otrpool_complete(op->xmpp->otr_pool, job);
+        return;
+    }
+    otr_output(op->xmpp, recipient, message);
 }
 
 void otr_update_context_list(void *opdata) {
@@ -180,14 +1408,18 @@ void otr_new_fingerprint(void *opdata, OtrlUserState us,
     const char *accountname, const char *protocol,
     const char *username, unsigned char fingerprint[20])
 {
-    Xmpp *xmpp = opdata;
-    app_handle_new_fingerprint(xmpp, username, fingerprint, 20);
+    XmppOtrOpdata *op = opdata;
+    app_handle_new_fingerprint(op->xmpp, username, fingerprint, 20);
 }
 
 void otr_write_fingerprints(void *opdata) {
-    Xmpp *xmpp = opdata;
-    char *filename = app_configfile("otr.fingerprints");
-    otrl_privkey_write_fingerprints(xmpp->userstate, filename);
+    XmppOtrOpdata *op = opdata;
+    if(op->worker) {
+        // the worker creates a new snapshot after the job (otr_job_run)
+        op->worker->fingerprints_dirty = true;
+        return;
+    }
+    fingerprints_changed(op->xmpp);
 }
 
 void otr_gone_secure(void *opdata, ConnContext *context) {
@@ -196,8 +1428,9 @@ void otr_gone_secure(void *opdata, ConnContext *context) {
     XmppLog(buf);
     free(buf);
     
-    Xmpp *xmpp = opdata;
-    app_update_secure_status(xmpp, context->username, true);
+    XmppOtrOpdata *op = opdata;
+    contexts_update(op->xmpp, op->userstate, context->username, context, OTRL_MSGSTATE_ENCRYPTED);
+    app_update_secure_status(op->xmpp, context->username, true);
 }
 
 void otr_gone_insecure(void *opdata, ConnContext *context) {
@@ -206,8 +1439,9 @@ void otr_gone_insecure(void *opdata, ConnContext *context) {
     XmppLog(buf);
     free(buf);
     
-    Xmpp *xmpp = opdata;
-    app_update_secure_status(xmpp, context->username, false);
+    XmppOtrOpdata *op = opdata;
+    contexts_update(op->xmpp, op->userstate, context->username, context, OTRL_MSGSTATE_PLAINTEXT);
+    app_update_secure_status(op->xmpp, context->username, false);
 }
 
 void otr_still_secure(void *opdata, ConnContext *context, int is_reply) {
@@ -216,19 +1450,27 @@ void otr_still_secure(void *opdata, ConnContext *context, int is_reply) {
     XmppLog(buf);
     free(buf);
     
-    Xmpp *xmpp = opdata;
-    app_update_secure_status(xmpp, context->username, true);
+    XmppOtrOpdata *op = opdata;
+    contexts_update(op->xmpp, op->userstate, context->username, context, OTRL_MSGSTATE_ENCRYPTED);
+    app_update_secure_status(op->xmpp, context->username, true);
 }
 
 int otr_max_message_size(void *opdata, ConnContext *context) {
-    return 1024*1024;
+    XmppOtrOpdata *op = opdata;
+    size_t size = op->xmpp->otr_output.fragment_size;
+    if(size == 0) {
+        size = OTR_FRAGMENT_SIZE_DEFAULT;
+    } else if(size < OTR_FRAGMENT_SIZE_MIN) {
+        size = OTR_FRAGMENT_SIZE_MIN;
+    }
+    return (int)size;
 }
 
 const char * otr_account_name(void *opdata, const char *account,
     const char *protocol)
 {
-    Xmpp *xmpp = opdata;
-    return xmpp->settings.jid;
+    XmppOtrOpdata *op = opdata;
+    return op->xmpp->settings.jid;
 }
 
 void otr_account_name_free(void *opdata, const char *account_name) {
@@ -271,19 +1513,20 @@ void otr_handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
     ConnContext *context, const char *message,
     gcry_error_t err)
 {
-    app_otr_error(opdata, context->username, msg_event);
+    XmppOtrOpdata *op = opdata;
+    app_otr_error(op->xmpp, context->username, msg_event);
 }
 
 void otr_create_instag(void *opdata, const char *accountname,
     const char *protocol)
 {
-    Xmpp *xmpp = opdata;
+    XmppOtrOpdata *op = opdata;
     
     char *basepath = app_configfile("");
     
     char *filename;
     asprintf(&filename, "%s/instag_%s.txt", basepath, accountname);
-    otrl_instag_generate(xmpp->userstate, filename, accountname, protocol);
+    otrl_instag_generate(op->userstate, filename, accountname, protocol);
     
     free(basepath);
     free(filename);
@@ -37,6 +37,36 @@
 
 #include "xmpp.h"
 
+/*
+ * default max otr message size, larger messages are fragmented
+ */
+#define OTR_FRAGMENT_SIZE_DEFAULT 16384
+
+/*
+ * loads the private key, fingerprints and instance tags into
+ * xmpp->userstate in a background thread
+ */
+void otr_load_state(Xmpp *xmpp);
+
+/*
+ * waits until otr_load_state is finished
+ * op is only used for logging
+ */
+void otr_wait_state(Xmpp *xmpp, const char *op);
+
+/*
+ * stops the fingerprints persister thread and writes pending changes
+ * must be called in the xmpp thread or when the xmpp thread is not running
+ */
+void otr_flush_fingerprints(Xmpp *xmpp);
+
+/*
+ * called by the xmpp thread, when the event loop starts and after it
+ * exited (a calculated private key is discarded after the exit)
+ */
+void otr_keygen_loop_start(Xmpp *xmpp);
+void otr_keygen_loop_exit(Xmpp *xmpp);
+
 /*
  * starts the otr session with recipient
  */
@@ -47,6 +77,33 @@ void start_otr(Xmpp *xmpp, const char *recipient);
  */
 void stop_otr(Xmpp *xmpp, const char *recipient);
 
+/*
+ * encrypts and sends the message in the xmpp thread or the otr worker pool
+ * if the private key is generated, the message is queued
+ */
+void otr_send_message(Xmpp *xmpp, const char *to, const char *message);
+
+/*
+ * decrypts the message and passes it to the app
+ */
+void otr_receive_message(Xmpp *xmpp, const char *from, const char *message);
+
+/*
+ * returns the cached msgstate of the otr session with jid
+ * can be called from any thread
+ */
+OtrlMessageState otr_context_msgstate(Xmpp *xmpp, const char *jid);
+
+/*
+ * creates the otr worker pool
+ */
+void otr_set_workers(Xmpp *xmpp, int nworkers);
+
+/*
+ * encrypt/decrypt in the calling thread with xmpp->userstate
+ * encrypt_message sends fragments with inject_message and only returns
+ * the message, that is not sent yet
+ */
 char *encrypt_message(Xmpp *xmpp, const char *to, const char *message, int *error);
 char *decrypt_message(Xmpp *xmpp, const char *from, const char *message, int *error);
 
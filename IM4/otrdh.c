@@ -0,0 +1,155 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "otrdh.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libotr/dh.h>
+
+#ifdef OTRL_DH_KEYPAIR_SOURCE
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * keypair stack, the generator pushes, libotr pops
+ */
+static DH_keypair *pool_keys;
+static size_t pool_size;
+static size_t pool_count;
+
+static uint64_t pool_hits;
+static uint64_t pool_misses;
+
+/*
+ * otrl_dh_gen_keypair keypair source
+ * called by libotr in the xmpp thread or in the otr workers
+ */
+static int pool_keypair(unsigned int groupid, DH_keypair *kp) {
+    if(groupid != DH1536_GROUP_ID) {
+        return 1;
+    }
+    
+    int ret = 1;
+    pthread_mutex_lock(&pool_lock);
+    if(pool_count > 0) {
+        *kp = pool_keys[--pool_count];
+        pool_hits++;
+        ret = 0;
+    } else {
+        pool_misses++;
+    }
+    // wake up the generator
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    
+    return ret;
+}
+
+static void* pool_thread(void *data) {
+#ifdef __APPLE__
+    // keypairs are generated when the cpu is not needed for anything else
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#endif
+    
+    for(;;) {
+        pthread_mutex_lock(&pool_lock);
+        while(pool_count >= pool_size) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        
+        DH_keypair kp;
+        otrl_dh_keypair_init(&kp);
+        if(otrl_dh_gen_keypair_fresh(DH1536_GROUP_ID, &kp)) {
+            fprintf(stderr, "otrdh: cannot generate dh keypair\n");
+            otrl_dh_keypair_free(&kp);
+            break;
+        }
+        
+        pthread_mutex_lock(&pool_lock);
+        if(pool_count < pool_size) {
+            pool_keys[pool_count++] = kp;
+            kp.priv = NULL;
+            kp.pub = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        
+        otrl_dh_keypair_free(&kp);
+    }
+    
+    return NULL;
+}
+
+int otrdh_pool_init(size_t size) {
+    if(size == 0 || pool_keys) {
+        return 1;
+    }
+    
+    pool_keys = calloc(size, sizeof(DH_keypair));
+    pool_size = size;
+    
+    pthread_t t;
+    if(pthread_create(&t, NULL, pool_thread, NULL)) {
+        perror("pthread_create");
+        free(pool_keys);
+        pool_keys = NULL;
+        pool_size = 0;
+        return 1;
+    }
+    pthread_detach(t);
+    
+    otrl_dh_set_keypair_source(pool_keypair);
+    return 0;
+}
+
+void otrdh_pool_stats(OtrDHPoolStats *stats) {
+    pthread_mutex_lock(&pool_lock);
+    stats->size = pool_size;
+    stats->available = pool_count;
+    stats->hits = pool_hits;
+    stats->misses = pool_misses;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+// libotr without otrl_dh_set_keypair_source
+
+int otrdh_pool_init(size_t size) {
+    return 1;
+}
+
+void otrdh_pool_stats(OtrDHPoolStats *stats) {
+    memset(stats, 0, sizeof(OtrDHPoolStats));
+}
+
+#endif
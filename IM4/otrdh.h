@@ -0,0 +1,83 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef otrdh_h
+#define otrdh_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Pool of pre-generated DH keypairs
+ *
+ * A background thread generates DH keypairs until the pool is full. libotr
+ * takes the keypairs for the AKE and the key rotation from the pool
+ * (otrl_dh_set_keypair_source) and only generates a keypair itself, if
+ * the pool is empty.
+ *
+ * The keypair source is a patch of libotr (build_dependencies.sh). With
+ * an unpatched libotr the pool is not available.
+ */
+
+typedef struct OtrDHPoolStats {
+    /*
+     * max number of keypairs in the pool
+     */
+    size_t size;
+    
+    /*
+     * number of keypairs currently in the pool
+     */
+    size_t available;
+    
+    /*
+     * number of keypairs taken from the pool
+     */
+    uint64_t hits;
+    
+    /*
+     * number of keypairs generated by libotr, because the pool was empty
+     */
+    uint64_t misses;
+} OtrDHPoolStats;
+
+/*
+ * starts the keypair generator thread and registers the pool in libotr
+ * size: max number of keypairs in the pool
+ *
+ * can only be called once
+ * returns 0 on success, 1 if the pool is not available
+ */
+int otrdh_pool_init(size_t size);
+
+/*
+ * get the current pool statistics
+ */
+void otrdh_pool_stats(OtrDHPoolStats *stats);
+
+#endif /* otrdh_h */
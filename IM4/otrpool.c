@@ -0,0 +1,263 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "otrpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libotr/context.h>
+
+/*
+ * FNV-1a hash of the bare jid
+ */
+static uint32_t peer_hash(const char *peer) {
+    uint32_t h = 2166136261u;
+    for(const char *p=peer;*p && *p != '/';p++) {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int otrpool_worker_index(OtrPool *pool, const char *peer) {
+    return (int)(peer_hash(peer) % (uint32_t)pool->nworkers);
+}
+
+static void* worker_thread(void *data) {
+    OtrWorker *w = data;
+    OtrPool *pool = w->pool;
+    
+    for(;;) {
+        pthread_mutex_lock(&w->lock);
+        while(!w->queue_begin) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        OtrJob *job = w->queue_begin;
+        w->queue_begin = job->next;
+        if(!w->queue_begin) {
+            w->queue_end = NULL;
+        }
+        pthread_mutex_unlock(&w->lock);
+        job->next = NULL;
+        
+        pthread_mutex_lock(&w->state_lock);
+        w->opdata.peer = job->peer;
+        pool->run(w, job);
+        w->opdata.peer = NULL;
+        pthread_mutex_unlock(&w->state_lock);
+        
+        switch(job->type) {
+            case OTR_JOB_ENCRYPT:
+            case OTR_JOB_DECRYPT:
+            case OTR_JOB_START: {
+                otrpool_complete(pool, job);
+                break;
+            }
+            default: {
+                otrpool_job_free(job);
+                break;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+static void worker_enqueue(OtrWorker *w, OtrJob *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if(w->queue_end) {
+        w->queue_end->next = job;
+    } else {
+        w->queue_begin = job;
+    }
+    w->queue_end = job;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+OtrPool* otrpool_create(Xmpp *xmpp, int nworkers, otrpool_run_func run, otrpool_complete_func complete) {
+    OtrPool *pool = malloc(sizeof(OtrPool));
+    memset(pool, 0, sizeof(OtrPool));
+    pool->xmpp = xmpp;
+    pool->run = run;
+    pool->complete = complete;
+    pthread_mutex_init(&pool->lock, NULL);
+    
+    pool->workers = calloc(nworkers, sizeof(OtrWorker));
+    for(int i=0;i<nworkers;i++) {
+        OtrWorker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        pthread_mutex_init(&w->state_lock, NULL);
+        pthread_mutex_init(&w->snapshot_lock, NULL);
+        w->opdata.xmpp = xmpp;
+        w->opdata.userstate = otrl_userstate_create();
+        w->opdata.worker = w;
+        
+        worker_enqueue(w, otrpool_job(OTR_JOB_LOAD, NULL, NULL));
+        
+        if(pthread_create(&w->thread, NULL, worker_thread, w)) {
+            perror("pthread_create");
+            break;
+        }
+        pthread_detach(w->thread);
+        pool->nworkers++;
+    }
+    
+    if(pool->nworkers == 0) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    
+    return pool;
+}
+
+OtrJob* otrpool_job(enum OtrJobType type, const char *peer, const char *message) {
+    OtrJob *job = malloc(sizeof(OtrJob));
+    memset(job, 0, sizeof(OtrJob));
+    job->type = type;
+    job->peer = peer ? strdup(peer) : NULL;
+    job->message = message ? strdup(message) : NULL;
+    return job;
+}
+
+void otrpool_job_free(OtrJob *job) {
+    free(job->peer);
+    free(job->message);
+    if(job->result) {
+        free(job->result);
+    }
+    free(job);
+}
+
+void otrpool_submit(OtrPool *pool, OtrJob *job) {
+    worker_enqueue(&pool->workers[otrpool_worker_index(pool, job->peer)], job);
+}
+
+void otrpool_submit_all(OtrPool *pool, enum OtrJobType type) {
+    for(int i=0;i<pool->nworkers;i++) {
+        worker_enqueue(&pool->workers[i], otrpool_job(type, NULL, NULL));
+    }
+}
+
+static void drain_cb(Xmpp *xmpp, void *userdata) {
+    otrpool_drain(userdata);
+}
+
+void otrpool_complete(OtrPool *pool, OtrJob *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if(pool->done_end) {
+        pool->done_end->next = job;
+    } else {
+        pool->done_begin = job;
+    }
+    pool->done_end = job;
+    
+    // one pending drain callback processes all completed jobs
+    bool notify = !pool->notified;
+    pool->notified = true;
+    pthread_mutex_unlock(&pool->lock);
+    
+    if(notify) {
+        XmppCall(pool->xmpp, drain_cb, pool);
+    }
+}
+
+void otrpool_drain(OtrPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    OtrJob *job = pool->done_begin;
+    pool->done_begin = NULL;
+    pool->done_end = NULL;
+    pool->notified = false;
+    pthread_mutex_unlock(&pool->lock);
+    
+    while(job) {
+        OtrJob *next = job->next;
+        pool->complete(pool->xmpp, job);
+        otrpool_job_free(job);
+        job = next;
+    }
+}
+
+void otrpool_snapshot(OtrWorker *w) {
+    OtrPool *pool = w->pool;
+    char *buf = NULL;
+    size_t buflen = 0;
+    FILE *out = open_memstream(&buf, &buflen);
+    if(!out) {
+        return;
+    }
+    
+    // same format as otrl_privkey_write_fingerprints_FILEp
+    for(ConnContext *ctx=w->opdata.userstate->context_root;ctx;ctx=ctx->next) {
+        // fingerprints are only stored in master contexts
+        if(ctx->their_instance != OTRL_INSTAG_MASTER) {
+            continue;
+        }
+        // every shard contains all peers from the fingerprints file
+        if(otrpool_worker_index(pool, ctx->username) != w->index) {
+            continue;
+        }
+        for(Fingerprint *fp=ctx->fingerprint_root.next;fp;fp=fp->next) {
+            fprintf(out, "%s\t%s\t%s\t", ctx->username, ctx->accountname, ctx->protocol);
+            for(int j=0;j<20;j++) {
+                fprintf(out, "%02x", fp->fingerprint[j]);
+            }
+            fprintf(out, "\t%s\n", fp->trust ? fp->trust : "");
+        }
+    }
+    fclose(out);
+    
+    pthread_mutex_lock(&w->snapshot_lock);
+    char *old = w->fingerprints;
+    w->fingerprints = buf;
+    w->fingerprints_len = buflen;
+    pthread_mutex_unlock(&w->snapshot_lock);
+    free(old);
+}
+
+int otrpool_write_fingerprints(OtrPool *pool, FILE *out) {
+    int ret = 0;
+    for(int i=0;i<pool->nworkers;i++) {
+        OtrWorker *w = &pool->workers[i];
+        pthread_mutex_lock(&w->snapshot_lock);
+        if(w->fingerprints) {
+            fwrite(w->fingerprints, 1, w->fingerprints_len, out);
+        } else {
+            ret = 1;
+        }
+        pthread_mutex_unlock(&w->snapshot_lock);
+    }
+    return ret;
+}
@@ -0,0 +1,229 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IM4_otrpool_h
+#define IM4_otrpool_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "xmpp.h"
+
+/*
+ * OTR worker pool
+ *
+ * Every worker owns a separate OtrlUserState (a shard) and a FIFO job queue.
+ * Jobs are assigned to a worker by the bare JID of the peer, therefore all
+ * jobs for one conversation run in order on the same worker, while
+ * different conversations are processed in parallel.
+ *
+ * Finished jobs are added to a completion queue, which is processed in the
+ * xmpp thread in FIFO order.
+ */
+
+enum OtrJobType {
+    /*
+     * worker jobs
+     */
+    OTR_JOB_LOAD = 0,
+    OTR_JOB_RELOAD_PRIVKEY,
+    OTR_JOB_ENCRYPT,
+    OTR_JOB_DECRYPT,
+    OTR_JOB_START,
+    OTR_JOB_STOP,
+    
+    /*
+     * completion queue only: messages injected by libotr in a worker and
+     * private key requests
+     */
+    OTR_JOB_SEND,
+    OTR_JOB_KEYGEN
+};
+
+typedef struct OtrJob    OtrJob;
+typedef struct OtrWorker OtrWorker;
+typedef struct OtrPool   OtrPool;
+
+struct OtrJob {
+    enum OtrJobType type;
+    
+    /*
+     * peer jid
+     */
+    char *peer;
+    
+    /*
+     * input message
+     */
+    char *message;
+    
+    /*
+     * encrypted/decrypted message or NULL
+     */
+    char *result;
+    
+    /*
+     * libotr return value
+     */
+    int err;
+    
+    /*
+     * the otr session with the peer is finished (OTR_JOB_DECRYPT)
+     */
+    bool finished;
+    
+    /*
+     * duration of the libotr call in ns (OTR_JOB_DECRYPT)
+     */
+    uint64_t duration_ns;
+    
+    OtrJob *next;
+};
+
+/*
+ * runs a job in a worker thread
+ * the worker state lock is held
+ */
+typedef void(*otrpool_run_func)(OtrWorker *worker, OtrJob *job);
+
+/*
+ * completes a job in the xmpp thread
+ */
+typedef void(*otrpool_complete_func)(Xmpp *xmpp, OtrJob *job);
+
+struct OtrWorker {
+    OtrPool *pool;
+    int index;
+    pthread_t thread;
+    
+    /*
+     * job queue
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    OtrJob *queue_begin;
+    OtrJob *queue_end;
+    
+    /*
+     * protects the userstate of this worker
+     */
+    pthread_mutex_t state_lock;
+    
+    /*
+     * libotr opdata with the userstate of this worker
+     */
+    XmppOtrOpdata opdata;
+    
+    /*
+     * the last job changed the fingerprints of this shard
+     * only accessed by the worker thread
+     */
+    bool fingerprints_dirty;
+    
+    /*
+     * fingerprints of this shard in the libotr fingerprints file format,
+     * created by the worker after a job changed them (otrpool_snapshot)
+     * NULL until the worker has loaded its shard
+     * protected by snapshot_lock
+     */
+    pthread_mutex_t snapshot_lock;
+    char *fingerprints;
+    size_t fingerprints_len;
+};
+
+struct OtrPool {
+    Xmpp *xmpp;
+    OtrWorker *workers;
+    int nworkers;
+    
+    otrpool_run_func run;
+    otrpool_complete_func complete;
+    
+    /*
+     * completion queue
+     * notified: a drain callback is pending in the xmpp thread
+     */
+    pthread_mutex_t lock;
+    OtrJob *done_begin;
+    OtrJob *done_end;
+    bool notified;
+};
+
+/*
+ * creates the pool and starts nworkers worker threads
+ * every worker gets an OTR_JOB_LOAD job as its first job
+ */
+OtrPool* otrpool_create(Xmpp *xmpp, int nworkers, otrpool_run_func run, otrpool_complete_func complete);
+
+OtrJob* otrpool_job(enum OtrJobType type, const char *peer, const char *message);
+
+void otrpool_job_free(OtrJob *job);
+
+/*
+ * returns the worker index responsible for the peer
+ */
+int otrpool_worker_index(OtrPool *pool, const char *peer);
+
+/*
+ * adds the job to the queue of the worker responsible for job->peer
+ */
+void otrpool_submit(OtrPool *pool, OtrJob *job);
+
+/*
+ * adds a job of the specified type to every worker queue
+ */
+void otrpool_submit_all(OtrPool *pool, enum OtrJobType type);
+
+/*
+ * adds the job to the completion queue
+ * can be called from any thread
+ */
+void otrpool_complete(OtrPool *pool, OtrJob *job);
+
+/*
+ * processes the completion queue, must be called in the xmpp thread
+ */
+void otrpool_drain(OtrPool *pool);
+
+/*
+ * replaces the fingerprints snapshot of the worker with the current
+ * fingerprints of its shard
+ * must be called in the worker thread, while the state lock is held
+ */
+void otrpool_snapshot(OtrWorker *worker);
+
+/*
+ * writes the fingerprints snapshots of all shards in the libotr
+ * fingerprints file format, the worker state is not locked
+ * returns 0 on success or 1, if a worker has not created a snapshot yet
+ */
+int otrpool_write_fingerprints(OtrPool *pool, FILE *out);
+
+#endif /* IM4_otrpool_h */
@@ -0,0 +1,238 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "regexreplace.h"
+#include "htmlescape.h"
+#include "utf8.h"
+#include "msgtemplate.h"
+#include "monotime.h"
+
+typedef struct PipelineAlias {
+    char *xid;
+    char *alias;
+} PipelineAlias;
+
+/*
+ * settings, protected by settings_lock
+ */
+static pthread_mutex_t settings_lock = PTHREAD_MUTEX_INITIALIZER;
+static MsgTemplate *tpl_entry;
+static PipelineAlias *aliases;
+static size_t naliases;
+static size_t aliases_alloc;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static PipelineStats stats;
+
+static const char *stage_names[] = {
+    "decrypt",
+    "html2text",
+    "normalize",
+    "rules",
+    "escape",
+    "template"
+};
+
+void pipeline_set_template(
+        const char *html_format,
+        const char *prefix_format,
+        const char *secure,
+        const char *insecure)
+{
+    MsgTemplate *tpl = msg_template_compile(html_format, prefix_format, "red", secure, insecure);
+    pthread_mutex_lock(&settings_lock);
+    MsgTemplate *old = tpl_entry;
+    tpl_entry = tpl;
+    pthread_mutex_unlock(&settings_lock);
+    msg_template_free(old);
+}
+
+void pipeline_set_alias(const char *xid, const char *alias) {
+    pthread_mutex_lock(&settings_lock);
+    size_t i;
+    for(i=0;i<naliases;i++) {
+        if(!strcmp(aliases[i].xid, xid)) {
+            break;
+        }
+    }
+    
+    if(i < naliases) {
+        free(aliases[i].alias);
+        if(alias) {
+            aliases[i].alias = strdup(alias);
+        } else {
+            free(aliases[i].xid);
+            aliases[i] = aliases[--naliases];
+        }
+    } else if(alias) {
+        if(naliases == aliases_alloc) {
+            aliases_alloc = aliases_alloc ? aliases_alloc * 2 : 16;
+            aliases = realloc(aliases, aliases_alloc * sizeof(PipelineAlias));
+        }
+        aliases[naliases].xid = strdup(xid);
+        aliases[naliases].alias = strdup(alias);
+        naliases++;
+    }
+    pthread_mutex_unlock(&settings_lock);
+}
+
+/*
+ * removes carriage returns and control characters (except tab and newline)
+ */
+static char* normalize(const char *in) {
+    size_t len = strlen(in);
+    char *out = malloc(len + 1);
+    size_t pos = 0;
+    for(size_t i=0;i<len;i++) {
+        unsigned char c = in[i];
+        if(c == '\r') {
+            if(in[i+1] != '\n') {
+                out[pos++] = '\n';
+            }
+        } else if((c >= 0x20 && c != 0x7f) || c == '\n' || c == '\t') {
+            out[pos++] = c;
+        }
+    }
+    out[pos] = 0;
+    return out;
+}
+
+/*
+ * returns the compiled entry template
+ * must be called with settings_lock
+ */
+static MsgTemplate* entry_template(void) {
+    if(!tpl_entry) {
+        // UITemplate defaults
+        tpl_entry = msg_template_compile(NULL, "< %s(%t) %a: ", "red", "\xf0\x9f\x94\x92", "");
+    }
+    return tpl_entry;
+}
+
+InboundMessage* pipeline_process(
+        const char *from,
+        TextReplacementScope *scope,
+        const char *msg,
+        bool html,
+        bool secure,
+        uint64_t decrypt_ns,
+        uint64_t html_ns)
+{
+    InboundMessage *m = calloc(1, sizeof(InboundMessage));
+    m->from = strdup(from);
+    m->secure = secure;
+    m->stage_ns[PIPELINE_DECRYPT] = decrypt_ns;
+    m->stage_ns[PIPELINE_HTML2TEXT] = html_ns;
+    
+    m->xid = strdup(from);
+    char *res = strchr(m->xid, '/');
+    m->resource = strdup(res ? res : "");
+    if(res) {
+        *res = 0;
+    }
+    
+    uint64_t t0 = monotime_ns();
+    // decrypted otr messages can contain anything
+    size_t len = strlen(msg);
+    char *repaired = NULL;
+    if(!utf8_validate(msg, len)) {
+        repaired = utf8_repair(msg, len, NULL);
+        msg = repaired;
+    }
+    m->text = normalize(msg);
+    free(repaired);
+    uint64_t t1 = monotime_ns();
+    
+    apply_scoped_rules(scope, m->xid, TEXT_REPLACEMENT_IN, &m->text);
+    uint64_t t2 = monotime_ns();
+    
+    m->message = html ? strdup(m->text) : html_linkify(m->text, strlen(m->text), true, NULL);
+    uint64_t t3 = monotime_ns();
+    
+    char time_str[16];
+    msg_template_time(time_str);
+    pthread_mutex_lock(&settings_lock);
+    for(size_t i=0;i<naliases;i++) {
+        if(!strcmp(aliases[i].xid, m->xid)) {
+            m->alias = strdup(aliases[i].alias);
+            break;
+        }
+    }
+    if(!m->alias) {
+        m->alias = strdup(m->xid);
+    }
+    MsgTemplateValues values = { time_str, m->xid, m->alias, m->secure, m->message };
+    m->html = msg_template_render(entry_template(), &values, NULL);
+    pthread_mutex_unlock(&settings_lock);
+    uint64_t t4 = monotime_ns();
+    
+    m->stage_ns[PIPELINE_NORMALIZE] = t1 - t0;
+    m->stage_ns[PIPELINE_RULES] = t2 - t1;
+    m->stage_ns[PIPELINE_ESCAPE] = t3 - t2;
+    m->stage_ns[PIPELINE_TEMPLATE] = t4 - t3;
+    
+    pthread_mutex_lock(&stats_lock);
+    stats.messages++;
+    for(int i=0;i<PIPELINE_NSTAGES;i++) {
+        stats.total_ns[i] += m->stage_ns[i];
+        if(m->stage_ns[i] > stats.max_ns[i]) {
+            stats.max_ns[i] = m->stage_ns[i];
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    
+    return m;
+}
+
+void pipeline_message_free(InboundMessage *msg) {
+    free(msg->from);
+    free(msg->xid);
+    free(msg->resource);
+    free(msg->alias);
+    free(msg->text);
+    free(msg->message);
+    free(msg->html);
+    free(msg);
+}
+
+void pipeline_stats(PipelineStats *s) {
+    pthread_mutex_lock(&stats_lock);
+    *s = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+const char* pipeline_stage_name(enum PipelineStage stage) {
+    return stage < PIPELINE_NSTAGES ? stage_names[stage] : NULL;
+}
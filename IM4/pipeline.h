@@ -0,0 +1,166 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef pipeline_h
+#define pipeline_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "regexreplace.h"
+
+/*
+ * Inbound message pipeline
+ *
+ * Runs in the xmpp thread and prepares a received message for the
+ * conversation window:
+ *
+ * decrypt -> html to text -> normalize -> rules -> escape/linkify -> template
+ *
+ * normalize replaces invalid UTF-8 with U+FFFD, converts line breaks to LF
+ * and removes control characters.
+ *
+ * decrypt (otr.c) and html to text (xmpp.c) are done by the caller, which
+ * passes their durations. The result is an html fragment, that the main
+ * thread only has to insert into the conversation log.
+ */
+
+enum PipelineStage {
+    PIPELINE_DECRYPT = 0,
+    PIPELINE_HTML2TEXT,
+    PIPELINE_NORMALIZE,
+    PIPELINE_RULES,
+    PIPELINE_ESCAPE,
+    PIPELINE_TEMPLATE,
+    PIPELINE_NSTAGES
+};
+
+typedef struct InboundMessage {
+    /*
+     * sender full jid
+     */
+    char *from;
+    
+    /*
+     * bare jid and resource part (including '/', can be empty) of from
+     */
+    char *xid;
+    char *resource;
+    
+    /*
+     * alias of xid or xid
+     */
+    char *alias;
+    
+    /*
+     * message after the text replacement rules (text or html)
+     */
+    char *text;
+    
+    /*
+     * escaped and linkified message (html)
+     */
+    char *message;
+    
+    /*
+     * conversation log entry (html)
+     */
+    char *html;
+    
+    bool secure;
+    
+    /*
+     * history timestamp (XmppHistoryAdd) or 0
+     */
+    int64_t history_timestamp;
+    
+    /*
+     * duration of each stage
+     */
+    uint64_t stage_ns[PIPELINE_NSTAGES];
+} InboundMessage;
+
+typedef struct PipelineStats {
+    uint64_t messages;
+    
+    /*
+     * total and max duration of each stage
+     */
+    uint64_t total_ns[PIPELINE_NSTAGES];
+    uint64_t max_ns[PIPELINE_NSTAGES];
+} PipelineStats;
+
+/*
+ * Sets the templates for received messages (see UITemplate)
+ * html_format: html format with %m placeholder or NULL
+ * prefix_format: plain text prefix, used if html_format is NULL
+ * secure, insecure: %s placeholder values
+ *
+ * Can be called from any thread, the strings are copied.
+ */
+void pipeline_set_template(
+        const char *html_format,
+        const char *prefix_format,
+        const char *secure,
+        const char *insecure);
+
+/*
+ * Sets the alias of xid, NULL removes the alias
+ */
+void pipeline_set_alias(const char *xid, const char *alias);
+
+/*
+ * Processes a received message
+ * scope: cached text replacement scope of the conversation or NULL
+ * html: msg is html (xhtml-im body or otr message), otherwise plain text,
+ *       that is escaped
+ * decrypt_ns, html_ns: durations of the previous stages
+ */
+InboundMessage* pipeline_process(
+        const char *from,
+        TextReplacementScope *scope,
+        const char *msg,
+        bool html,
+        bool secure,
+        uint64_t decrypt_ns,
+        uint64_t html_ns);
+
+void pipeline_message_free(InboundMessage *msg);
+
+/*
+ * returns the stage durations of all processed messages
+ */
+void pipeline_stats(PipelineStats *stats);
+
+/*
+ * name of a PipelineStage
+ */
+const char* pipeline_stage_name(enum PipelineStage stage);
+
+#endif /* pipeline_h */
@@ -31,18 +31,462 @@
 
 
 #include "regexreplace.h"
+#include "trace.h"
+#include "monotime.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <fnmatch.h>
 
-static TextReplacementRule *rules;
-static size_t nrules;
+#ifdef __linux__
+#include <sys/inotify.h>
+#else
+#include <sys/event.h>
+#endif
+
+/*
+ * rule set of a selection of rules
+ * scopes (direction and bare jid), that select the same rules, share the
+ * rule set
+ */
+typedef struct ScopedRuleSet ScopedRuleSet;
+struct ScopedRuleSet {
+    /*
+     * indices of the selected rules in the config rules array
+     */
+    size_t *selection;
+    size_t nselection;
+    
+    TextReplacementRuleSet *set;
+    
+    /*
+     * shallow copies of the selected rules, the compiled regex and strings
+     * are owned by the rules config
+     */
+    TextReplacementRule *rules;
+    
+    ScopedRuleSet *next;
+};
+
+/*
+ * loaded rules config
+ *
+ * Readers (apply_all_rules) don't lock. A reader registers in the
+ * readers counter of the current epoch, before it loads the config.
+ * After a reload published a new config, it switches the epoch and
+ * frees the old config, when all readers of the previous epoch are done.
+ */
+typedef struct RulesConfig {
+    /*
+     * all rules of the file
+     */
+    TextReplacementRule *rules;
+    size_t nrules;
+    
+    /*
+     * incremented with every reload, starts with 1
+     */
+    uint64_t generation;
+    
+    /*
+     * rule set for outgoing messages without a jid
+     */
+    ScopedRuleSet *global;
+    
+    /*
+     * the config contains rules with a jid pattern or for incoming
+     * messages
+     */
+    bool jid_scopes;
+    bool inbound;
+    
+    /*
+     * rule sets of all used scopes
+     */
+    pthread_mutex_t scoped_lock;
+    ScopedRuleSet *scoped;
+} RulesConfig;
+
+static _Atomic(RulesConfig*) rules_config;
+static atomic_uint rules_config_epoch;
+static atomic_uint rules_config_readers[2];
+static uint64_t rules_config_generation;
+
+static char *rules_file;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool watching;
+
+static atomic_uint_fast64_t rules_budget_ns;
+static atomic_int rules_budget_policy;
+
+/*
+ * registers a reader in the current epoch and loads the config
+ * returns the epoch slot for rules_config_release
+ */
+static unsigned int rules_config_acquire(RulesConfig **config) {
+    for(;;) {
+        unsigned int epoch = atomic_load(&rules_config_epoch);
+        unsigned int slot = epoch & 1;
+        atomic_fetch_add(&rules_config_readers[slot], 1);
+        // a publisher could have switched the epoch before the increment
+        // and doesn't wait for this slot, try again
+        if(atomic_load(&rules_config_epoch) != epoch) {
+            atomic_fetch_sub(&rules_config_readers[slot], 1);
+            continue;
+        }
+        *config = atomic_load(&rules_config);
+        return slot;
+    }
+}
+
+static void rules_config_release(unsigned int epoch) {
+    atomic_fetch_sub(&rules_config_readers[epoch], 1);
+}
+
+static bool rule_in_scope(TextReplacementRule *rule, const char *jid, int direction) {
+    if(!rule->compiled || !(rule->scope_direction & direction)) {
+        return false;
+    }
+    if(!rule->scope_jid) {
+        return true;
+    }
+    return jid && fnmatch(rule->scope_jid, jid, 0) == 0;
+}
+
+/*
+ * selects the rules of the config, that apply to messages from/to jid
+ * (bare jid or NULL) in the direction
+ * selection must have space for config->nrules entries
+ * returns the number of selected rules
+ */
+static size_t rules_config_select(RulesConfig *config, const char *jid, int direction, size_t *selection) {
+    size_t n = 0;
+    for(size_t i=0;i<config->nrules;i++) {
+        if(rule_in_scope(&config->rules[i], jid, direction)) {
+            selection[n++] = i;
+        }
+    }
+    return n;
+}
+
+/*
+ * compiles a rule set with the selected rules of the config
+ * the selection array is owned by the new rule set
+ */
+static ScopedRuleSet* scoped_rule_set_new(RulesConfig *config, size_t *selection, size_t nselection) {
+    ScopedRuleSet *scoped = calloc(1, sizeof(ScopedRuleSet));
+    scoped->selection = selection;
+    scoped->nselection = nselection;
+    scoped->rules = calloc(nselection + 1, sizeof(TextReplacementRule));
+    for(size_t i=0;i<nselection;i++) {
+        scoped->rules[i] = config->rules[selection[i]];
+    }
+    scoped->set = compile_rule_set(scoped->rules, nselection);
+    return scoped;
+}
+
+static void scoped_rule_set_free(ScopedRuleSet *scoped) {
+    free_rule_set(scoped->set);
+    free(scoped->rules);
+    free(scoped->selection);
+    free(scoped);
+}
+
+/*
+ * returns the rule set of the scope, the rule set is valid as long as the
+ * config is valid
+ * the rules are selected on every call, callers should cache the result
+ * in a TextReplacementScope
+ */
+static TextReplacementRuleSet* rules_config_get_scope(RulesConfig *config, const char *jid, int direction) {
+    if(direction == TEXT_REPLACEMENT_OUT && (!jid || !config->jid_scopes)) {
+        return config->global->set;
+    }
+    if(direction == TEXT_REPLACEMENT_IN && !config->inbound) {
+        return NULL;
+    }
+    if(!config->jid_scopes) {
+        jid = NULL;
+    }
+    
+    size_t *selection = calloc(config->nrules + 1, sizeof(size_t));
+    size_t nselection = rules_config_select(config, jid, direction, selection);
+    if(nselection == 0) {
+        free(selection);
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&config->scoped_lock);
+    ScopedRuleSet *scoped = config->global;
+    if(scoped->nselection != nselection || memcmp(scoped->selection, selection, nselection * sizeof(size_t))) {
+        scoped = config->scoped;
+        while(scoped) {
+            if(scoped->nselection == nselection && !memcmp(scoped->selection, selection, nselection * sizeof(size_t))) {
+                break;
+            }
+            scoped = scoped->next;
+        }
+    }
+    if(scoped) {
+        free(selection);
+    } else {
+        scoped = scoped_rule_set_new(config, selection, nselection);
+        scoped->next = config->scoped;
+        config->scoped = scoped;
+    }
+    pthread_mutex_unlock(&config->scoped_lock);
+    
+    return scoped->set;
+}
+
+static RulesConfig* rules_config_new(TextReplacementRule *rules, size_t nrules) {
+    RulesConfig *config = calloc(1, sizeof(RulesConfig));
+    config->rules = rules;
+    config->nrules = nrules;
+    config->generation = ++rules_config_generation;
+    pthread_mutex_init(&config->scoped_lock, NULL);
+    for(size_t i=0;i<nrules;i++) {
+        if(rules[i].scope_jid) {
+            config->jid_scopes = true;
+        }
+        if(rules[i].scope_direction & TEXT_REPLACEMENT_IN) {
+            config->inbound = true;
+        }
+    }
+    size_t *selection = calloc(nrules + 1, sizeof(size_t));
+    size_t nselection = rules_config_select(config, NULL, TEXT_REPLACEMENT_OUT, selection);
+    config->global = scoped_rule_set_new(config, selection, nselection);
+    return config;
+}
+
+static void rules_config_free(RulesConfig *config) {
+    ScopedRuleSet *scoped = config->scoped;
+    while(scoped) {
+        ScopedRuleSet *next = scoped->next;
+        scoped_rule_set_free(scoped);
+        scoped = next;
+    }
+    scoped_rule_set_free(config->global);
+    pthread_mutex_destroy(&config->scoped_lock);
+    free_rules(config->rules, config->nrules);
+    free(config);
+}
+
+/*
+ * publishes a new config and frees the old one
+ * must be called with reload_lock
+ */
+static void rules_config_publish(RulesConfig *config) {
+    RulesConfig *old = atomic_exchange(&rules_config, config);
+    if(!old) {
+        return;
+    }
+    
+    // wait for all readers, that could have loaded the old config
+    unsigned int epoch = atomic_fetch_add(&rules_config_epoch, 1) & 1;
+    while(atomic_load(&rules_config_readers[epoch]) > 0) {
+        usleep(1000);
+    }
+    
+    if(atomic_load_explicit(&old->global->set->stats.messages, memory_order_relaxed) > 0) {
+        fprintf(stderr, "Text replacement rules profile:\n");
+        print_rule_set_profile(stderr, old->global->set, 10);
+    }
+    
+    rules_config_free(old);
+}
+
+/*
+ * loads and compiles the rules file and publishes the new rule set
+ */
+static int reload_rules(void) {
+    pthread_mutex_lock(&reload_lock);
+    uint64_t start = monotime_ns();
+    
+    TextReplacementRule *new_rules;
+    size_t new_nrules;
+    if(load_rules(rules_file, &new_rules, &new_nrules)) {
+        pthread_mutex_unlock(&reload_lock);
+        return 1;
+    }
+    RulesConfig *config = rules_config_new(new_rules, new_nrules);
+    uint64_t compiled = monotime_ns();
+    
+    rules_config_publish(config);
+    pthread_mutex_unlock(&reload_lock);
+    
+    IM4_TRACE(rules_reload, new_nrules, compiled - start);
+    fprintf(stderr, "Loaded %zu text replacement rules in %.3f ms\n", new_nrules, (compiled - start) / 1000000.0);
+    return 0;
+}
+
+/*
+ * max seconds between two checks, if the rules file doesn't exist (kqueue)
+ */
+#define RULES_WATCH_MAX_DELAY 16
+
+/*
+ * waits until the rules file was changed
+ * returns 0 on success, 1 on error
+ */
+#ifdef __linux__
+static int wait_rules_changed(int fd, const char *name) {
+    // watches the directory, editors often replace the file
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        
+        for(char *p=buf;p<buf+n;) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            if(event->len > 0 && !strcmp(event->name, name)) {
+                return 0;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+#else
+static int wait_rules_changed(int kq, const char *file) {
+#ifdef O_EVTONLY
+    int fd = open(file, O_EVTONLY);
+#else
+    int fd = open(file, O_RDONLY);
+#endif
+    if(fd < 0) {
+        // the file was replaced or deleted, wait until it exists again
+        // the failed reload was already logged once
+        unsigned int delay = 1;
+        for(;;) {
+            sleep(delay);
+            if(!access(file, F_OK)) {
+                return 0;
+            }
+            if(delay < RULES_WATCH_MAX_DELAY) {
+                delay *= 2;
+            }
+        }
+    }
+    
+    struct kevent kev;
+    EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD|EV_CLEAR, NOTE_WRITE|NOTE_EXTEND|NOTE_DELETE|NOTE_RENAME, 0, NULL);
+    int ret = kevent(kq, &kev, 1, &kev, 1, NULL) < 0 ? 1 : 0;
+    
+    // closing the fd removes the event
+    close(fd);
+    return ret;
+}
+#endif
+
+static void* rules_watch_thread(void *unused) {
+    (void)unused;
+#ifdef __linux__
+    // path is split into the directory and the file name
+    char *path = strdup(rules_file);
+    char *name = strrchr(path, '/');
+    const char *dir;
+    if(name) {
+        *name = 0;
+        name++;
+        dir = *path ? path : "/";
+    } else {
+        name = path;
+        dir = ".";
+    }
+    
+    int fd = inotify_init1(IN_CLOEXEC);
+    if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) < 0) {
+        perror("inotify");
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(path);
+        return NULL;
+    }
+#else
+    int fd = kqueue();
+    if(fd < 0) {
+        perror("kqueue");
+        return NULL;
+    }
+    const char *name = rules_file;
+#endif
+    
+    while(!wait_rules_changed(fd, name)) {
+        // wait until the editor has finished writing
+        usleep(100000);
+        if(reload_rules()) {
+            fprintf(stderr, "Cannot reload %s\n", rules_file);
+        }
+    }
+    
+    close(fd);
+#ifdef __linux__
+    free(path);
+#endif
+    return NULL;
+}
 
 int load_rules_config(const char *file) {
-    return load_rules(file, &rules, &nrules);
+    if(!rules_file) {
+        rules_file = strdup(file);
+    }
+    int ret = reload_rules();
+    
+    // watch the rules file and reload the rules, when it is changed
+    if(!watching) {
+        pthread_t t;
+        if(pthread_create(&t, NULL, rules_watch_thread, NULL)) {
+            perror("pthread_create");
+        } else {
+            pthread_detach(t);
+            watching = true;
+        }
+    }
+    
+    return ret;
+}
+
+/*
+ * parses the arguments of a scope directive: <in|out|inout> [jid pattern]
+ * returns 0 on success
+ */
+static int parse_scope(char *args, int *direction, char **jid) {
+    char *saveptr;
+    char *dir = strtok_r(args, " \t", &saveptr);
+    char *pattern = strtok_r(NULL, " \t", &saveptr);
+    if(!dir) {
+        return 1;
+    }
+    
+    int d;
+    if(!strcmp(dir, "out")) {
+        d = TEXT_REPLACEMENT_OUT;
+    } else if(!strcmp(dir, "in")) {
+        d = TEXT_REPLACEMENT_IN;
+    } else if(!strcmp(dir, "inout")) {
+        d = TEXT_REPLACEMENT_IN | TEXT_REPLACEMENT_OUT;
+    } else {
+        return 1;
+    }
+    
+    *direction = d;
+    free(*jid);
+    *jid = pattern && strcmp(pattern, "*") ? strdup(pattern) : NULL;
+    return 0;
 }
 
 int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
@@ -68,9 +512,10 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
     size_t linelen = 0;
     
     // read format version
-    size_t vlen = getline(&line, &linelen, in);
-    if(vlen == 0) {
+    ssize_t vlen = getline(&line, &linelen, in);
+    if(vlen <= 0) {
         free(line);
+        free(r);
         fclose(in);
         return 0;
     }
@@ -81,10 +526,15 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
     if(strcmp(line, "?v1")) {
         fprintf(stderr, "Unknown file format version: %s\n", line);
         free(line);
+        free(r);
         fclose(in);
         return 1;
     }
     
+    // scope of the following rules
+    int scope_direction = TEXT_REPLACEMENT_OUT;
+    char *scope_jid = NULL;
+    
     // read rules
     while(getline(&line, &linelen, in) >= 0) {
         char *ln = line;
@@ -100,6 +550,13 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
             continue;
         }
         
+        if(!strncmp(ln, "?scope", 6) && (ln[6] == ' ' || ln[6] == '\t')) {
+            if(parse_scope(ln + 7, &scope_direction, &scope_jid)) {
+                fprintf(stderr, "Invalid text replacement scope: %s\n", ln);
+            }
+            continue;
+        }
+        
         // find first \t separator
         int separator = 0;
         for(int i=0;i<lnlen;i++) {
@@ -122,6 +579,9 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
             }
             r[rules_size].pattern = pattern;
             r[rules_size].replacement = replacement;
+            r[rules_size].scope_direction = scope_direction;
+            r[rules_size].scope_jid = scope_jid ? strdup(scope_jid) : NULL;
+            compile_replacement(&r[rules_size]);
             
             // compile the rule
             if(regcomp(&r[rules_size].regex, ln, REG_EXTENDED) == 0) {
@@ -139,6 +599,7 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
     if(line) {
         free(line);
     }
+    free(scope_jid);
     
     *rules = r;
     *len = rules_size;
@@ -146,15 +607,68 @@ int load_rules(const char *file, TextReplacementRule **rules, size_t *len) {
     return 0;
 }
 
-TextReplacementRule* get_rules(size_t *numelm) {
-    *numelm = nrules;
-    return rules;
+void compile_replacement(TextReplacementRule *rule) {
+    const char *in = rule->replacement;
+    size_t len = strlen(in);
+    
+    // the unescaped text is never longer than the replacement and
+    // every char adds at most one segment
+    char *text = malloc(len + 1);
+    TextReplacementSegment *segments = calloc(len + 1, sizeof(TextReplacementSegment));
+    size_t nsegments = 0;
+    size_t pos = 0;
+    size_t literal_start = 0;
+    int nmatch = 1;
+    
+    for(size_t i=0;i<len;i++) {
+        char c = in[i];
+        if(c == '\\') {
+            c = in[++i];
+            switch(c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '\0': continue;
+            }
+        } else if(c == '$' && in[i+1] >= '0' && in[i+1] <= '9') {
+            if(pos > literal_start) {
+                segments[nsegments].str = text + literal_start;
+                segments[nsegments].len = pos - literal_start;
+                segments[nsegments].group = -1;
+                nsegments++;
+            }
+            int group = in[++i] - '0';
+            segments[nsegments].group = group;
+            nsegments++;
+            if(group >= nmatch) {
+                nmatch = group + 1;
+            }
+            literal_start = pos;
+            continue;
+        }
+        text[pos++] = c;
+    }
+    if(pos > literal_start) {
+        segments[nsegments].str = text + literal_start;
+        segments[nsegments].len = pos - literal_start;
+        segments[nsegments].group = -1;
+        nsegments++;
+    }
+    text[pos] = 0;
+    
+    rule->segments = segments;
+    rule->nsegments = nsegments;
+    rule->template_text = text;
+    rule->nmatch = nmatch;
 }
 
 void free_rules(TextReplacementRule *rules, size_t nelm) {
     for(size_t i=0;i<nelm;i++) {
         free(rules[i].pattern);
         free(rules[i].replacement);
+        free(rules[i].segments);
+        free(rules[i].template_text);
+        free(rules[i].scope_jid);
         if(rules[i].compiled) {
             regfree(&rules[i].regex);
         }
@@ -229,6 +743,42 @@ char* str_unescape_and_replace(
     return newstr;
 }
 
+/*
+ * returns the length of the replacement for a match
+ */
+static size_t template_length(TextReplacementRule *rule, regmatch_t *matches) {
+    size_t len = 0;
+    for(size_t i=0;i<rule->nsegments;i++) {
+        TextReplacementSegment *seg = &rule->segments[i];
+        if(seg->group < 0) {
+            len += seg->len;
+        } else if(matches[seg->group].rm_so >= 0) {
+            len += matches[seg->group].rm_eo - matches[seg->group].rm_so;
+        }
+    }
+    return len;
+}
+
+/*
+ * writes the replacement for a match to out
+ * returns the number of bytes written
+ */
+static size_t template_write(TextReplacementRule *rule, const char *in, regmatch_t *matches, char *out) {
+    char *start = out;
+    for(size_t i=0;i<rule->nsegments;i++) {
+        TextReplacementSegment *seg = &rule->segments[i];
+        if(seg->group < 0) {
+            memcpy(out, seg->str, seg->len);
+            out += seg->len;
+        } else if(matches[seg->group].rm_so >= 0) {
+            size_t len = matches[seg->group].rm_eo - matches[seg->group].rm_so;
+            memcpy(out, in + matches[seg->group].rm_so, len);
+            out += len;
+        }
+    }
+    return out - start;
+}
+
 char* apply_rule(char *msg_in, TextReplacementRule *rule) {
     size_t len = strlen(msg_in);
     char *in = msg_in;
@@ -238,48 +788,52 @@ char* apply_rule(char *msg_in, TextReplacementRule *rule) {
     size_t alloc = 0;
     size_t pos = 0;
     char *newstr = NULL;
-    while(in < end) {
-        regmatch_t matches[2];
-        int ret = regexec(&rule->regex, in, 2, matches, 0);
+    char *last_end = NULL;
+    while(in <= end) {
+        // ^ only matches at the start of the message
+        regmatch_t matches[10];
+        int ret = regexec(&rule->regex, in, rule->nmatch, matches, in > msg_in ? REG_NOTBOL : 0);
         if(ret) {
             break;
         }
         
-        // add anything before the match
-        size_t cplen = matches[0].rm_so;
-        if(cplen >= alloc) {
-            alloc += cplen + 1024;
-            newstr = realloc(newstr, alloc);
-        }
-        if(cplen > 0) {
-            memcpy(newstr+pos, in, cplen);
-            pos += cplen;
+        // an empty match directly after the previous match is not replaced
+        // (like sed), after an empty match the next code point is copied,
+        // otherwise regexec would find the same match again
+        bool empty = matches[0].rm_so == matches[0].rm_eo;
+        bool replace = !(empty && matches[0].rm_so == 0 && in == last_end);
+        const char *next = in + matches[0].rm_eo;
+        size_t skip = 0;
+        if(empty && next < end) {
+            skip = 1;
+            while(next + skip < end && (next[skip] & 0xc0) == 0x80) {
+                skip++;
+            }
         }
         
-        // replace matches[0] with replacement
-        // if a capture group exists, adjust the replacement
-        char *rpl = rule->replacement;
-        if(matches[1].rm_so >= 0) {
-            size_t cg_len = matches[1].rm_eo - matches[1].rm_so;
-            char *capture_group = malloc(cg_len + 1);
-            memcpy(capture_group, in+matches[1].rm_so, cg_len);
-            capture_group[cg_len] = 0;
-            rpl = str_unescape_and_replace(rule->replacement, "$1", capture_group);
-            free(capture_group);
-        }
-        size_t rpl_len = strlen(rpl);
-        
-        if(pos + rpl_len >= alloc) {
-            alloc += rpl_len + 1024;
+        // add anything before the match and the replacement
+        size_t cplen = matches[0].rm_so;
+        size_t rpl_len = replace ? template_length(rule, matches) : 0;
+        if(pos + cplen + rpl_len + skip >= alloc) {
+            alloc = alloc ? alloc * 2 : len + 1024;
+            while(pos + cplen + rpl_len + skip >= alloc) {
+                alloc *= 2;
+            }
             newstr = realloc(newstr, alloc);
         }
-        memcpy(newstr + pos, rpl, rpl_len);
-        pos += rpl_len;
-        if(rpl != rule->replacement) {
-            free(rpl); // rpl was allocated by str_replace
+        memcpy(newstr+pos, in, cplen);
+        pos += cplen;
+        if(replace) {
+            pos += template_write(rule, in, matches, newstr+pos);
         }
+        memcpy(newstr+pos, in + matches[0].rm_eo, skip);
+        pos += skip;
         
-        in = in + matches[0].rm_eo;
+        in = in + matches[0].rm_eo + skip;
+        last_end = empty ? NULL : in;
+        if(empty && skip == 0) {
+            break; // empty match at the end of the message
+        }
     }
     
     // if no match was found, we can return the original msg ptr
@@ -290,30 +844,852 @@ char* apply_rule(char *msg_in, TextReplacementRule *rule) {
     // add remaining str
     size_t remaining = end - in;
     if(pos + remaining >= alloc) {
-        alloc += remaining + 1;
+        alloc = pos + remaining + 1;
         newstr = realloc(newstr, alloc);
     }
-    if(remaining > 0) {
-        memcpy(newstr+pos, in, remaining);
-        pos += remaining;
+    memcpy(newstr+pos, in, remaining);
+    pos += remaining;
+    newstr[pos] = 0;
+    
+    free(msg_in);
+    return newstr;
+}
+
+void apply_rules_sequential(TextReplacementRule *rules, size_t nrules, char **msg) {
+    char *msg_in = *msg;
+    for(int i=0;i<nrules;i++) {
+        if(rules[i].compiled) {
+            msg_in = apply_rule(msg_in, &rules[i]);
+        }
+    }
+    *msg = msg_in;
+}
+
+void apply_all_rules(char **msg) {
+    apply_scoped_rules(NULL, NULL, TEXT_REPLACEMENT_OUT, msg);
+}
+
+void apply_scoped_rules(TextReplacementScope *scope, const char *jid, int direction, char **msg) {
+    RulesConfig *config;
+    unsigned int epoch = rules_config_acquire(&config);
+    if(!config) {
+        rules_config_release(epoch);
+        return;
     }
     
-    if(pos >= alloc) {
-        alloc++;
+    TextReplacementRuleSet *set;
+    if(scope && scope->generation == config->generation) {
+        set = scope->set;
+    } else {
+        char *bare_jid = NULL;
+        if(jid) {
+            bare_jid = strdup(jid);
+            char *res = strchr(bare_jid, '/');
+            if(res) {
+                *res = 0;
+            }
+        }
+        set = rules_config_get_scope(config, bare_jid, direction);
+        free(bare_jid);
+        if(scope) {
+            scope->generation = config->generation;
+            scope->set = set;
+        }
+    }
+    
+    if(set) {
+        apply_rule_set_budget(
+                set,
+                msg,
+                atomic_load(&rules_budget_ns),
+                atomic_load(&rules_budget_policy));
+    }
+    rules_config_release(epoch);
+}
+
+void set_rules_budget(uint64_t budget_ns, TextReplacementBudgetPolicy policy) {
+    atomic_store(&rules_budget_ns, budget_ns);
+    atomic_store(&rules_budget_policy, policy);
+}
+
+
+
+// ------------------------- rule set -------------------------
+
+/*
+ * Aho-Corasick automaton (dfa)
+ */
+typedef struct AhoCorasick {
+    /*
+     * state transitions, nstates * nclasses
+     */
+    int *delta;
+    
+    /*
+     * index of the literal, that ends in the state, or -1
+     */
+    int *out;
+    
+    /*
+     * next state in the fail chain, that has an output, or -1
+     */
+    int *link;
+    
+    int nstates;
+    int nclasses;
+    
+    /*
+     * byte to character class
+     */
+    unsigned char classes[256];
+} AhoCorasick;
+
+struct TextReplacementStage {
+    /*
+     * first rule and number of rules of this stage
+     */
+    size_t begin;
+    size_t count;
+    
+    /*
+     * automaton of a literal stage, delta is NULL for a regex stage
+     */
+    AhoCorasick ac;
+    
+    /*
+     * unescaped literal of each rule, indexed by rule - begin
+     */
+    char **literals;
+    size_t *literal_len;
+    
+    /*
+     * expanded replacement template of each rule, indexed by rule - begin
+     */
+    char **replacements;
+    size_t *replacement_len;
+    
+    /*
+     * index of the prefilter literal, that is required for a match of a
+     * regex stage, or -1
+     */
+    int filter;
+    
+    /*
+     * profile: number of executions, messages changed by the stage,
+     * total and max execution time
+     * updated with relaxed atomics, the stage can be applied by the in
+     * and out threads at the same time
+     */
+    _Atomic uint64_t calls;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t time_ns;
+    _Atomic uint64_t max_ns;
+};
+
+struct TextReplacementPrefilter {
+    AhoCorasick ac;
+    
+    /*
+     * number of distinct required literals
+     */
+    size_t nliterals;
+};
+
+/*
+ * returns the unescaped pattern, if the pattern doesn't contain any
+ * regex operators, otherwise NULL
+ */
+static char* pattern_literal(const char *pattern) {
+    size_t len = strlen(pattern);
+    if(len == 0) {
+        return NULL;
+    }
+    
+    char *literal = malloc(len + 1);
+    size_t pos = 0;
+    for(size_t i=0;i<len;i++) {
+        char c = pattern[i];
+        if(c == '\\') {
+            c = pattern[++i];
+            if(!c || !strchr(".[]()*+?{}|^$\\", c)) {
+                // undefined escape sequence or trailing backslash
+                free(literal);
+                return NULL;
+            }
+        } else if(strchr(".[]()*+?{}|^$", c)) {
+            free(literal);
+            return NULL;
+        }
+        literal[pos++] = c;
+    }
+    literal[pos] = 0;
+    return literal;
+}
+
+/*
+ * returns the position of the closing ']' of the bracket expression,
+ * that starts at pattern[i]
+ */
+static size_t skip_bracket(const char *pattern, size_t i) {
+    i++;
+    if(pattern[i] == '^') {
+        i++;
+    }
+    if(pattern[i] == ']') {
+        i++;
+    }
+    while(pattern[i] && pattern[i] != ']') {
+        if(pattern[i] == '[' && pattern[i+1] && strchr(".=:", pattern[i+1])) {
+            // [:class:], [=equiv=], [.coll.]
+            char delim = pattern[i+1];
+            i += 2;
+            while(pattern[i] && !(pattern[i] == delim && pattern[i+1] == ']')) {
+                i++;
+            }
+            if(pattern[i]) {
+                i++;
+            }
+        }
+        if(pattern[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+/*
+ * returns the longest literal, that every match of the extended regex
+ * pattern must contain, or NULL
+ *
+ * Only the top level of the pattern is considered, groups and bracket
+ * expressions end a literal. A top level alternation has no required
+ * literal.
+ */
+static char* pattern_required_literal(const char *pattern) {
+    size_t len = strlen(pattern);
+    char *run = malloc(len + 1);
+    size_t runlen = 0;
+    char *best = NULL;
+    size_t bestlen = 0;
+    
+    int depth = 0;
+    size_t i = 0;
+    while(i <= len) {
+        char c = pattern[i];
+        int literal = 0;
+        size_t next = i + 1;
+        if(c == '\\' && pattern[i+1] && strchr(".[]()*+?{}|^$\\", pattern[i+1])) {
+            c = pattern[i+1];
+            literal = 1;
+            next = i + 2;
+        } else if(c == '\\') {
+            // backreference or an extension like \w \b
+            next = pattern[i+1] ? i + 2 : i + 1;
+        } else if(c == '[') {
+            next = skip_bracket(pattern, i) + 1;
+        } else if(c == '{') {
+            // interval expression
+            while(pattern[next] && pattern[next-1] != '}') {
+                next++;
+            }
+        } else if(c == '(') {
+            depth++;
+        } else if(c == ')') {
+            depth--;
+        } else if(c == '|' && depth == 0) {
+            free(run);
+            free(best);
+            return NULL;
+        } else if(c && !strchr(".*+?}|^$", c)) {
+            literal = 1;
+        }
+        
+        char q = next <= len ? pattern[next] : 0;
+        if(literal && depth == 0 && q != '*' && q != '?' && q != '{') {
+            run[runlen++] = c;
+            if(q != '+') {
+                i = next;
+                continue;
+            }
+        }
+        
+        // end of the current literal run
+        if(runlen > bestlen) {
+            free(best);
+            run[runlen] = 0;
+            best = strdup(run);
+            bestlen = runlen;
+        }
+        runlen = 0;
+        if(next > len) {
+            break;
+        }
+        i = next;
+    }
+    
+    free(run);
+    return best;
+}
+
+/*
+ * returns true, if the strings a and b can overlap in a text
+ * (one contains the other or a suffix of one is a prefix of the other)
+ */
+static bool str_overlap(const char *a, size_t alen, const char *b, size_t blen) {
+    // b starts at offset shift relative to a
+    for(long shift=-(long)blen+1;shift<(long)alen;shift++) {
+        long from = shift > 0 ? shift : 0;
+        long to = shift + (long)blen < (long)alen ? shift + (long)blen : (long)alen;
+        bool match = true;
+        for(long i=from;i<to;i++) {
+            if(a[i] != b[i-shift]) {
+                match = false;
+                break;
+            }
+        }
+        if(match) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * checks if the literal rule j can be applied in the same pass as the
+ * literal rules of the stage
+ *
+ * This is the case, if the literals of the stage and rule j can't overlap
+ * in any text and the replacements of the stage can't create new matches
+ * for rule j.
+ */
+static bool stage_compatible(
+        char **literals,
+        size_t *literal_len,
+        char **replacements,
+        size_t *replacement_len,
+        size_t begin,
+        size_t j)
+{
+    const char *lit = literals[j];
+    size_t len = literal_len[j];
+    for(size_t i=begin;i<j;i++) {
+        if(str_overlap(literals[i], literal_len[i], lit, len)) {
+            return false;
+        }
+        const char *rpl = replacements[i];
+        size_t rpl_len = replacement_len[i];
+        if(rpl_len == 0) {
+            // removing text can join two parts of a longer literal
+            if(len > 1) {
+                return false;
+            }
+        } else if(str_overlap(rpl, rpl_len, lit, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * returns the replacement of a literal rule
+ * $0 is the literal, a literal pattern has no capture groups
+ */
+static char* template_expand_literal(TextReplacementRule *rule, const char *literal, size_t literal_len, size_t *len) {
+    regmatch_t matches[10];
+    matches[0].rm_so = 0;
+    matches[0].rm_eo = literal_len;
+    for(int i=1;i<10;i++) {
+        matches[i].rm_so = -1;
+        matches[i].rm_eo = -1;
+    }
+    size_t rpl_len = template_length(rule, matches);
+    char *rpl = malloc(rpl_len + 1);
+    template_write(rule, literal, matches, rpl);
+    rpl[rpl_len] = 0;
+    *len = rpl_len;
+    return rpl;
+}
+
+/*
+ * builds the automaton for the literals
+ * equal literals share the output of the last literal
+ */
+static void ac_build(AhoCorasick *ac, char **literals, size_t *literal_len, size_t count) {
+    // character classes: one class per byte used in the literals,
+    // class 0 for all other bytes
+    memset(ac->classes, 0, 256);
+    int nclasses = 1;
+    int maxstates = 1;
+    for(size_t r=0;r<count;r++) {
+        const unsigned char *lit = (const unsigned char*)literals[r];
+        for(size_t i=0;i<literal_len[r];i++) {
+            if(ac->classes[lit[i]] == 0) {
+                ac->classes[lit[i]] = nclasses++;
+            }
+        }
+        maxstates += literal_len[r];
+    }
+    
+    // trie
+    int *delta = malloc(maxstates * nclasses * sizeof(int));
+    int *out = malloc(maxstates * sizeof(int));
+    int *link = malloc(maxstates * sizeof(int));
+    for(int i=0;i<maxstates*nclasses;i++) {
+        delta[i] = -1;
+    }
+    out[0] = -1;
+    link[0] = -1;
+    int nstates = 1;
+    for(size_t r=0;r<count;r++) {
+        const unsigned char *lit = (const unsigned char*)literals[r];
+        int state = 0;
+        for(size_t i=0;i<literal_len[r];i++) {
+            int *t = &delta[state * nclasses + ac->classes[lit[i]]];
+            if(*t < 0) {
+                out[nstates] = -1;
+                *t = nstates++;
+            }
+            state = *t;
+        }
+        out[state] = (int)r;
+    }
+    
+    // fail links (bfs), missing transitions point to the transition of
+    // the fail state, which results in a complete dfa
+    int *fail = malloc(nstates * sizeof(int));
+    int *queue = malloc(nstates * sizeof(int));
+    size_t qbegin = 0;
+    size_t qend = 0;
+    for(int c=0;c<nclasses;c++) {
+        int t = delta[c];
+        if(t < 0) {
+            delta[c] = 0;
+        } else {
+            fail[t] = 0;
+            link[t] = -1;
+            queue[qend++] = t;
+        }
+    }
+    while(qbegin < qend) {
+        int state = queue[qbegin++];
+        for(int c=0;c<nclasses;c++) {
+            int *t = &delta[state * nclasses + c];
+            if(*t < 0) {
+                *t = delta[fail[state] * nclasses + c];
+            } else {
+                int f = delta[fail[state] * nclasses + c];
+                fail[*t] = f;
+                link[*t] = out[f] >= 0 ? f : link[f];
+                queue[qend++] = *t;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    
+    ac->delta = delta;
+    ac->out = out;
+    ac->link = link;
+    ac->nstates = nstates;
+    ac->nclasses = nclasses;
+}
+
+static void ac_free(AhoCorasick *ac) {
+    free(ac->delta);
+    free(ac->out);
+    free(ac->link);
+}
+
+/*
+ * builds the prefilter for all regex stages with a required literal
+ */
+static TextReplacementPrefilter* prefilter_build(TextReplacementRuleSet *set) {
+    char **literals = calloc(set->nstages + 1, sizeof(char*));
+    size_t *literal_len = calloc(set->nstages + 1, sizeof(size_t));
+    size_t nliterals = 0;
+    
+    for(size_t i=0;i<set->nstages;i++) {
+        TextReplacementStage *st = &set->stages[i];
+        if(st->ac.delta) {
+            continue;
+        }
+        char *lit = pattern_required_literal(set->rules[st->begin].pattern);
+        if(!lit) {
+            continue;
+        }
+        
+        int filter = -1;
+        for(size_t l=0;l<nliterals;l++) {
+            if(!strcmp(literals[l], lit)) {
+                filter = (int)l;
+                break;
+            }
+        }
+        if(filter < 0) {
+            filter = (int)nliterals;
+            literals[nliterals] = lit;
+            literal_len[nliterals] = strlen(lit);
+            nliterals++;
+        } else {
+            free(lit);
+        }
+        st->filter = filter;
+    }
+    
+    TextReplacementPrefilter *prefilter = NULL;
+    if(nliterals > 0) {
+        prefilter = calloc(1, sizeof(TextReplacementPrefilter));
+        ac_build(&prefilter->ac, literals, literal_len, nliterals);
+        prefilter->nliterals = nliterals;
+    }
+    
+    for(size_t l=0;l<nliterals;l++) {
+        free(literals[l]);
+    }
+    free(literals);
+    free(literal_len);
+    
+    return prefilter;
+}
+
+/*
+ * marks all prefilter literals, that occur in msg
+ */
+static void prefilter_scan(TextReplacementPrefilter *prefilter, const char *msg, char *found) {
+    const unsigned char *in = (const unsigned char*)msg;
+    AhoCorasick *ac = &prefilter->ac;
+    int *delta = ac->delta;
+    int nclasses = ac->nclasses;
+    
+    memset(found, 0, prefilter->nliterals);
+    int state = 0;
+    for(size_t i=0;in[i];i++) {
+        state = delta[state * nclasses + ac->classes[in[i]]];
+        int s = ac->out[state] >= 0 ? state : ac->link[state];
+        while(s >= 0) {
+            found[ac->out[s]] = 1;
+            s = ac->link[s];
+        }
+    }
+}
+
+TextReplacementRuleSet* compile_rule_set(TextReplacementRule *rules, size_t nrules) {
+    TextReplacementRuleSet *set = calloc(1, sizeof(TextReplacementRuleSet));
+    set->rules = rules;
+    set->nrules = nrules;
+    set->stages = calloc(nrules > 0 ? nrules : 1, sizeof(TextReplacementStage));
+    
+    char **literals = calloc(nrules + 1, sizeof(char*));
+    size_t *literal_len = calloc(nrules + 1, sizeof(size_t));
+    char **replacements = calloc(nrules + 1, sizeof(char*));
+    size_t *replacement_len = calloc(nrules + 1, sizeof(size_t));
+    for(size_t i=0;i<nrules;i++) {
+        if(rules[i].compiled) {
+            literals[i] = pattern_literal(rules[i].pattern);
+        }
+        if(literals[i]) {
+            literal_len[i] = strlen(literals[i]);
+            replacements[i] = template_expand_literal(&rules[i], literals[i], literal_len[i], &replacement_len[i]);
+        }
+    }
+    
+    size_t i = 0;
+    while(i < nrules) {
+        if(!rules[i].compiled) {
+            i++;
+            continue;
+        }
+        
+        TextReplacementStage *st = &set->stages[set->nstages++];
+        st->begin = i;
+        st->count = 1;
+        st->filter = -1;
+        if(literals[i]) {
+            // add following literal rules
+            while(i + st->count < nrules
+                    && literals[i + st->count]
+                    && stage_compatible(literals, literal_len, replacements, replacement_len, i, i + st->count))
+            {
+                st->count++;
+            }
+            st->literals = malloc(st->count * sizeof(char*));
+            st->literal_len = malloc(st->count * sizeof(size_t));
+            st->replacements = malloc(st->count * sizeof(char*));
+            st->replacement_len = malloc(st->count * sizeof(size_t));
+            for(size_t r=0;r<st->count;r++) {
+                st->literals[r] = literals[i + r];
+                st->literal_len[r] = literal_len[i + r];
+                st->replacements[r] = replacements[i + r];
+                st->replacement_len[r] = replacement_len[i + r];
+                literals[i + r] = NULL;
+                replacements[i + r] = NULL;
+            }
+            ac_build(&st->ac, st->literals, st->literal_len, st->count);
+        }
+        i += st->count;
+    }
+    
+    for(size_t i=0;i<nrules;i++) {
+        free(literals[i]);
+        free(replacements[i]);
+    }
+    free(literals);
+    free(literal_len);
+    free(replacements);
+    free(replacement_len);
+    
+    set->prefilter = prefilter_build(set);
+    
+    return set;
+}
+
+void free_rule_set(TextReplacementRuleSet *set) {
+    for(size_t i=0;i<set->nstages;i++) {
+        TextReplacementStage *st = &set->stages[i];
+        if(st->literals) {
+            for(size_t r=0;r<st->count;r++) {
+                free(st->literals[r]);
+                free(st->replacements[r]);
+            }
+            free(st->literals);
+            free(st->literal_len);
+            free(st->replacements);
+            free(st->replacement_len);
+        }
+        ac_free(&st->ac);
+    }
+    if(set->prefilter) {
+        ac_free(&set->prefilter->ac);
+        free(set->prefilter);
+    }
+    free(set->stages);
+    free(set);
+}
+
+/*
+ * applies all literal rules of the stage in one pass
+ * returns msg_in, if nothing was replaced, otherwise msg_in is freed and
+ * a new string is returned
+ */
+static char* apply_literal_stage(TextReplacementStage *st, char *msg_in) {
+    const unsigned char *in = (const unsigned char*)msg_in;
+    int *delta = st->ac.delta;
+    int *out = st->ac.out;
+    int nclasses = st->ac.nclasses;
+    
+    char *newstr = NULL;
+    size_t alloc = 0;
+    size_t pos = 0;
+    
+    // msg_in is copied up to this position
+    size_t copied = 0;
+    
+    int state = 0;
+    size_t i;
+    for(i=0;in[i];i++) {
+        state = delta[state * nclasses + st->ac.classes[in[i]]];
+        int r = out[state];
+        if(r < 0) {
+            continue;
+        }
+        
+        // literals of a stage don't overlap, only a literal can overlap
+        // with its previous match, in this case the match is skipped
+        size_t start = i + 1 - st->literal_len[r];
+        if(start < copied) {
+            continue;
+        }
+        
+        const char *rpl = st->replacements[r];
+        size_t rpl_len = st->replacement_len[r];
+        size_t cplen = start - copied;
+        if(pos + cplen + rpl_len >= alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            while(pos + cplen + rpl_len >= alloc) {
+                alloc *= 2;
+            }
+            newstr = realloc(newstr, alloc);
+        }
+        memcpy(newstr + pos, msg_in + copied, cplen);
+        pos += cplen;
+        memcpy(newstr + pos, rpl, rpl_len);
+        pos += rpl_len;
+        copied = i + 1;
+    }
+    
+    if(!newstr) {
+        return msg_in;
+    }
+    
+    size_t remaining = i - copied;
+    if(pos + remaining >= alloc) {
+        alloc = pos + remaining + 1;
         newstr = realloc(newstr, alloc);
     }
+    memcpy(newstr + pos, msg_in + copied, remaining);
+    pos += remaining;
     newstr[pos] = 0;
     
     free(msg_in);
-    return newstr ? newstr : msg_in;
+    return newstr;
 }
 
-void apply_all_rules(char **msg) {
+void apply_rule_set(TextReplacementRuleSet *set, char **msg) {
+    apply_rule_set_budget(set, msg, 0, TEXT_REPLACEMENT_BUDGET_SKIP);
+}
+
+void apply_rule_set_budget(
+        TextReplacementRuleSet *set,
+        char **msg,
+        uint64_t budget_ns,
+        TextReplacementBudgetPolicy policy)
+{
     char *msg_in = *msg;
-    for(int i=0;i<nrules;i++) {
-        if(rules[i].compiled) {
-            msg_in = apply_rule(msg_in, &rules[i]);
+    
+    // required literals found in the current message
+    char *found = NULL;
+    if(set->prefilter) {
+        found = malloc(set->prefilter->nliterals);
+        prefilter_scan(set->prefilter, msg_in, found);
+    }
+    
+    // the rules free the input message, if they change it
+    char *original = NULL;
+    if(budget_ns > 0 && policy == TEXT_REPLACEMENT_BUDGET_ORIGINAL) {
+        original = strdup(msg_in);
+    }
+    
+    atomic_fetch_add_explicit(&set->stats.messages, 1, memory_order_relaxed);
+    uint64_t start = monotime_ns();
+    uint64_t t = start;
+    for(size_t i=0;i<set->nstages;i++) {
+        TextReplacementStage *st = &set->stages[i];
+        if(!st->ac.delta && st->filter >= 0 && !found[st->filter]) {
+            atomic_fetch_add_explicit(&set->stats.skipped, 1, memory_order_relaxed);
+            continue;
+        }
+        
+        if(budget_ns > 0 && t - start > budget_ns) {
+            atomic_fetch_add_explicit(&set->stats.budget_exceeded, 1, memory_order_relaxed);
+            if(original) {
+                free(msg_in);
+                msg_in = original;
+                original = NULL;
+            }
+            break;
+        }
+        
+        char *msg_out;
+        if(st->ac.delta) {
+            msg_out = apply_literal_stage(st, msg_in);
+        } else {
+            atomic_fetch_add_explicit(&set->stats.evaluated, 1, memory_order_relaxed);
+            msg_out = apply_rule(msg_in, &set->rules[st->begin]);
+        }
+        
+        uint64_t end = monotime_ns();
+        uint64_t elapsed = end - t;
+        t = end;
+        atomic_fetch_add_explicit(&st->calls, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->time_ns, elapsed, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&st->max_ns, memory_order_relaxed);
+        while(elapsed > max) {
+            // on failure max is updated to the current value
+            if(atomic_compare_exchange_weak_explicit(&st->max_ns, &max, elapsed, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
         }
+        
+        if(msg_out != msg_in) {
+            atomic_fetch_add_explicit(&st->hits, 1, memory_order_relaxed);
+            // replacements can create new occurrences of required literals
+            if(found) {
+                prefilter_scan(set->prefilter, msg_out, found);
+            }
+        }
+        msg_in = msg_out;
     }
+    free(found);
+    free(original);
+    
     *msg = msg_in;
 }
+
+static int cmp_profile_time(const void *a, const void *b) {
+    const TextReplacementProfile *x = a;
+    const TextReplacementProfile *y = b;
+    return x->time_ns < y->time_ns ? 1 : (x->time_ns > y->time_ns ? -1 : 0);
+}
+
+size_t rule_set_profile(TextReplacementRuleSet *set, TextReplacementProfile *profile, size_t n) {
+    TextReplacementProfile *all = calloc(set->nstages + 1, sizeof(TextReplacementProfile));
+    for(size_t i=0;i<set->nstages;i++) {
+        TextReplacementStage *st = &set->stages[i];
+        all[i].rule = &set->rules[st->begin];
+        all[i].nrules = st->count;
+        all[i].calls = atomic_load_explicit(&st->calls, memory_order_relaxed);
+        all[i].hits = atomic_load_explicit(&st->hits, memory_order_relaxed);
+        all[i].time_ns = atomic_load_explicit(&st->time_ns, memory_order_relaxed);
+        all[i].max_ns = atomic_load_explicit(&st->max_ns, memory_order_relaxed);
+    }
+    qsort(all, set->nstages, sizeof(TextReplacementProfile), cmp_profile_time);
+    
+    if(n > set->nstages) {
+        n = set->nstages;
+    }
+    memcpy(profile, all, n * sizeof(TextReplacementProfile));
+    free(all);
+    return n;
+}
+
+void print_rule_set_profile(FILE *out, TextReplacementRuleSet *set, size_t n) {
+    TextReplacementProfile *profile = calloc(n + 1, sizeof(TextReplacementProfile));
+    n = rule_set_profile(set, profile, n);
+    
+    fprintf(out, "%12s %12s %12s %12s  %s\n", "calls", "hits", "total ms", "max ms", "pattern");
+    for(size_t i=0;i<n;i++) {
+        TextReplacementProfile *p = &profile[i];
+        fprintf(out, "%12llu %12llu %12.3f %12.3f  %s",
+                (unsigned long long)p->calls,
+                (unsigned long long)p->hits,
+                p->time_ns / 1000000.0,
+                p->max_ns / 1000000.0,
+                p->rule->pattern);
+        if(p->nrules > 1) {
+            fprintf(out, " (+%zu literal rules)", p->nrules - 1);
+        }
+        fputc('\n', out);
+    }
+    TextReplacementStats stats;
+    rule_set_stats(set, &stats);
+    fprintf(out, "%zu messages, budget exceeded: %zu\n", stats.messages, stats.budget_exceeded);
+    
+    free(profile);
+}
+
+int print_rules_profile(FILE *out, size_t n) {
+    RulesConfig *config;
+    unsigned int epoch = rules_config_acquire(&config);
+    if(config) {
+        print_rule_set_profile(out, config->global->set, n);
+    }
+    rules_config_release(epoch);
+    return config ? 0 : 1;
+}
+
+void rule_set_stats(TextReplacementRuleSet *set, TextReplacementStats *stats) {
+    stats->messages = atomic_load_explicit(&set->stats.messages, memory_order_relaxed);
+    stats->evaluated = atomic_load_explicit(&set->stats.evaluated, memory_order_relaxed);
+    stats->skipped = atomic_load_explicit(&set->stats.skipped, memory_order_relaxed);
+    stats->budget_exceeded = atomic_load_explicit(&set->stats.budget_exceeded, memory_order_relaxed);
+}
+
+int get_rule_stats(TextReplacementStats *stats) {
+    RulesConfig *config;
+    unsigned int epoch = rules_config_acquire(&config);
+    if(config) {
+        rule_set_stats(config->global->set, stats);
+    }
+    rules_config_release(epoch);
+    return config ? 0 : 1;
+}
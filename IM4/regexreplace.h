@@ -30,12 +30,37 @@
 #define IM4_regexreplace_h
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 #include <regex.h>
 
 #define REGEX_TEXT_REPLACEMENT_RULES_FILE "regex-text-replacement.rules"
 
+/*
+ * rule scope directions
+ */
+#define TEXT_REPLACEMENT_OUT 1
+#define TEXT_REPLACEMENT_IN  2
+
+/*
+ * part of a compiled replacement template
+ */
+typedef struct TextReplacementSegment {
+    /*
+     * unescaped literal text, if group is -1
+     */
+    const char *str;
+    size_t len;
+    
+    /*
+     * capture group (0-9) or -1
+     */
+    int group;
+} TextReplacementSegment;
+
 typedef struct TextReplacementRule {
     /*
      * regex pattern
@@ -44,7 +69,7 @@ typedef struct TextReplacementRule {
     
     /*
      * replacement string
-     * If the string contains "$1", it is replaced with the first capture group
+     * "$0" is replaced with the match, "$1" - "$9" with the capture groups
      * Escaping rules:
      * \$: "$"
      * \t: <tab>
@@ -61,11 +86,165 @@ typedef struct TextReplacementRule {
      * regex compiled successfully
      */
     int compiled;
+    
+    /*
+     * compiled replacement template
+     */
+    TextReplacementSegment *segments;
+    size_t nsegments;
+    
+    /*
+     * unescaped text of all literal segments
+     */
+    char *template_text;
+    
+    /*
+     * number of regmatch_t entries needed by the template
+     */
+    int nmatch;
+    
+    /*
+     * scope: bare jid pattern (fnmatch) or NULL for all contacts
+     */
+    char *scope_jid;
+    
+    /*
+     * scope: TEXT_REPLACEMENT_OUT and/or TEXT_REPLACEMENT_IN
+     */
+    int scope_direction;
 } TextReplacementRule;
 
+typedef struct TextReplacementStage TextReplacementStage;
+typedef struct TextReplacementPrefilter TextReplacementPrefilter;
+
+typedef struct TextReplacementStats {
+    /*
+     * number of messages
+     */
+    size_t messages;
+    
+    /*
+     * number of regex rule evaluations
+     */
+    size_t evaluated;
+    
+    /*
+     * number of regex rules, that were skipped, because a required
+     * literal of the pattern was not found in the message
+     */
+    size_t skipped;
+    
+    /*
+     * number of messages, that exceeded the time budget
+     */
+    size_t budget_exceeded;
+} TextReplacementStats;
+
+/*
+ * TextReplacementStats counters of a rule set, updated with relaxed atomics
+ * by the threads, that apply the rules
+ */
+typedef struct TextReplacementCounters {
+    atomic_size_t messages;
+    atomic_size_t evaluated;
+    atomic_size_t skipped;
+    atomic_size_t budget_exceeded;
+} TextReplacementCounters;
+
+/*
+ * profile of a rule set stage
+ */
+typedef struct TextReplacementProfile {
+    /*
+     * first rule of the stage
+     */
+    TextReplacementRule *rule;
+    
+    /*
+     * number of rules, > 1 for merged literal rules
+     */
+    size_t nrules;
+    
+    /*
+     * number of executions (skipped rules are not counted)
+     */
+    uint64_t calls;
+    
+    /*
+     * number of messages changed by the stage
+     */
+    uint64_t hits;
+    
+    /*
+     * total and max execution time
+     */
+    uint64_t time_ns;
+    uint64_t max_ns;
+} TextReplacementProfile;
+
+/*
+ * What happens, when a message exceeds the time budget
+ * SKIP: the remaining rules are skipped
+ * ORIGINAL: the unmodified message is used
+ */
+typedef enum TextReplacementBudgetPolicy {
+    TEXT_REPLACEMENT_BUDGET_SKIP = 0,
+    TEXT_REPLACEMENT_BUDGET_ORIGINAL
+} TextReplacementBudgetPolicy;
+
+/*
+ * Compiled text replacement rules
+ *
+ * Consecutive literal rules (patterns without regex operators), that can
+ * not change the matches of each other, are merged into one stage. A stage
+ * is applied with one Aho-Corasick automaton in a single pass over the
+ * message. Other rules are a stage of their own and applied with regexec.
+ * The result is the same as applying the rules one after another.
+ *
+ * Regex rules with a required literal (a literal, that every match must
+ * contain) are only evaluated, if the prefilter found the literal in the
+ * message.
+ */
+typedef struct TextReplacementRuleSet {
+    /*
+     * rules array, not owned by the rule set
+     */
+    TextReplacementRule *rules;
+    size_t nrules;
+    
+    TextReplacementStage *stages;
+    size_t nstages;
+    
+    /*
+     * Aho-Corasick automaton of all required literals, can be NULL
+     */
+    TextReplacementPrefilter *prefilter;
+    
+    TextReplacementCounters stats;
+} TextReplacementRuleSet;
+
+/*
+ * per conversation cache of the scoped rule set
+ * must be initialized with zeros
+ */
+typedef struct TextReplacementScope {
+    /*
+     * rules config generation, the rule set was selected from
+     */
+    uint64_t generation;
+    
+    TextReplacementRuleSet *set;
+} TextReplacementScope;
+
 
 // ------------------------- config -------------------------
 
+/*
+ * Loads the rules config and watches the file (inotify on Linux, kqueue
+ * otherwise). When the file is changed, the rules are reloaded in the
+ * watch thread and the new rule set replaces the old one atomically.
+ * apply_all_rules never waits for a reload.
+ */
 int load_rules_config(const char *file);
 
 /*
@@ -74,20 +253,71 @@ int load_rules_config(const char *file);
  * Format:
  * # comment
  * <pattern>\t<replacement>
+ * ?scope <in|out|inout> [jid pattern]
  *
+ * A scope line sets the direction and the contacts (fnmatch pattern of the
+ * bare jid, default: *) of the following rules. Rules before the first
+ * scope line are applied to all outgoing messages.
  */
 int load_rules(const char *file, TextReplacementRule **rules, size_t *len);
 
+/*
+ * Compiles rule->replacement into a list of literal and capture group
+ * segments. load_rules compiles the replacement of all rules, other rules
+ * must be compiled before apply_rule is used.
+ */
+void compile_replacement(TextReplacementRule *rule);
+
 /*
  * Frees a TextReplacementRule array, including all pattern and replacement
- * strings and the compiled regex pattern
+ * strings, the compiled regex pattern and the replacement template
  */
 void free_rules(TextReplacementRule *rules, size_t nelm);
 
 /*
- * returns the array of loaded text replacement rules
+ * Compiles the rules into a rule set
+ * The rules array must not be freed before the rule set
+ */
+TextReplacementRuleSet* compile_rule_set(TextReplacementRule *rules, size_t nrules);
+
+void free_rule_set(TextReplacementRuleSet *set);
+
+/*
+ * returns a snapshot of the prefilter statistics of the rule set
+ * can be called while other threads apply the rules
+ */
+void rule_set_stats(TextReplacementRuleSet *set, TextReplacementStats *stats);
+
+/*
+ * returns the prefilter statistics of the loaded rules config
+ * returns 1, if no config is loaded
  */
-TextReplacementRule* get_rules(size_t *numelm);
+int get_rule_stats(TextReplacementStats *stats);
+
+/*
+ * returns the profile of the n most expensive stages of the rule set
+ * profile must have space for n entries
+ * returns the number of entries
+ */
+size_t rule_set_profile(TextReplacementRuleSet *set, TextReplacementProfile *profile, size_t n);
+
+/*
+ * prints the n most expensive stages of the rule set
+ */
+void print_rule_set_profile(FILE *out, TextReplacementRuleSet *set, size_t n);
+
+/*
+ * prints the n most expensive stages of the loaded rules config
+ * returns 1, if no config is loaded
+ */
+int print_rules_profile(FILE *out, size_t n);
+
+/*
+ * Sets the time budget per message for apply_all_rules (0: unlimited)
+ * The budget is checked before each rule, a running regexec is not
+ * interrupted.
+ */
+void set_rules_budget(uint64_t budget_ns, TextReplacementBudgetPolicy policy);
 
 
 
@@ -112,8 +342,37 @@ char* str_unescape_and_replace(
 char* apply_rule(char *msg_in, TextReplacementRule *rule);
 
 /*
- * apply all (compiled) rules to msg
+ * Applies all stages of the rule set to msg
+ * If a rule matches, *msg is freed and replaced with a new string
+ */
+void apply_rule_set(TextReplacementRuleSet *set, char **msg);
+
+/*
+ * Applies the rule set to msg with a time budget (0: unlimited)
+ * If the budget is exceeded, the remaining stages are not applied
+ */
+void apply_rule_set_budget(
+        TextReplacementRuleSet *set,
+        char **msg,
+        uint64_t budget_ns,
+        TextReplacementBudgetPolicy policy);
+
+/*
+ * Applies the rules one after another with apply_rule, without a rule set
+ */
+void apply_rules_sequential(TextReplacementRule *rules, size_t nrules, char **msg);
+
+/*
+ * apply all (compiled) rules for outgoing messages without a jid scope
+ * to msg
  */
 void apply_all_rules(char **msg);
 
+/*
+ * applies the rules of the loaded config, that are in the scope of the
+ * conversation with jid and the direction
+ * The rule set of the scope is cached in scope (can be NULL).
+ */
+void apply_scoped_rules(TextReplacementScope *scope, const char *jid, int direction, char **msg);
+
 #endif /* IM4_regexreplace_h */
@@ -0,0 +1,127 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IM4_trace_h
+#define IM4_trace_h
+
+#include <stdint.h>
+
+#include "monotime.h"
+
+/*
+ * Static tracepoints (USDT)
+ *
+ * The probes are compiled in, if IM4_USDT is defined and <sys/sdt.h> is
+ * available (Linux, systemtap-sdt-dev). A probe site is a single nop
+ * instruction until a tracer (perf, bpftrace) attaches to it.
+ * Timestamps for duration arguments are only taken, if the probe that
+ * reports the duration is enabled (probe semaphores).
+ *
+ * Without IM4_USDT, all macros expand to nothing.
+ *
+ * provider: im4
+ * 
+ * probe                args
+ * message_recv         from
+ * message_dispatch     from, size, secure
+ * message_done         from, duration_ns
+ * presence_recv        from, type
+ * presence_done        from, duration_ns
+ * roster_done          ncontacts, duration_ns
+ * call_enqueue         callback, userdata
+ * call_exec            callback, queue_ns, duration_ns
+ * send                 to, size, duration_ns
+ * otr_encrypt_entry    to, size
+ * otr_encrypt_return   to, size, duration_ns, error
+ * otr_decrypt_entry    from, size
+ * otr_decrypt_return   from, size, duration_ns, error
+ * rules_reload         nrules, duration_ns
+ */
+#define IM4_PROBES(P) \
+    P(message_recv) \
+    P(message_dispatch) \
+    P(message_done) \
+    P(presence_recv) \
+    P(presence_done) \
+    P(roster_done) \
+    P(call_enqueue) \
+    P(call_exec) \
+    P(send) \
+    P(otr_encrypt_entry) \
+    P(otr_encrypt_return) \
+    P(otr_decrypt_entry) \
+    P(otr_decrypt_return) \
+    P(rules_reload)
+
+#if defined(IM4_USDT) && defined(__linux__) && __has_include(<sys/sdt.h>)
+
+#define IM4_TRACE_USDT 1
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define IM4_PROBE_SEMAPHORE(name) im4_##name##_semaphore
+#define IM4_PROBE_DECLARE(name) extern unsigned short IM4_PROBE_SEMAPHORE(name);
+IM4_PROBES(IM4_PROBE_DECLARE)
+
+/*
+ * true, if a tracer is attached to the probe
+ */
+#define IM4_TRACE_ENABLED(name) __builtin_expect(IM4_PROBE_SEMAPHORE(name), 0)
+
+/*
+ * fire the probe im4:name
+ */
+#define IM4_TRACE(name, ...) STAP_PROBEV(im4, name, ##__VA_ARGS__)
+
+/*
+ * current timestamp (ns), if the probe is enabled, otherwise 0
+ */
+#define IM4_TRACE_TIME(name) (IM4_TRACE_ENABLED(name) ? monotime_ns() : 0)
+
+/*
+ * declare a start timestamp variable for a duration argument of probe name
+ */
+#define IM4_TRACE_START(var, name) uint64_t var = IM4_TRACE_TIME(name)
+
+/*
+ * nanoseconds since the start timestamp var
+ */
+#define IM4_TRACE_ELAPSED(var) (var ? monotime_ns() - var : 0)
+
+#else
+
+#define IM4_TRACE_ENABLED(name) 0
+#define IM4_TRACE(name, ...)
+#define IM4_TRACE_TIME(name) 0
+#define IM4_TRACE_START(var, name)
+#define IM4_TRACE_ELAPSED(var) 0
+
+#endif
+
+#endif /* IM4_trace_h */
@@ -0,0 +1,356 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "utf8.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define UTF8_SSSE3
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define UTF8_NEON
+#endif
+
+#if defined(UTF8_SSSE3) || defined(UTF8_NEON)
+#define UTF8_SIMD
+static bool use_simd = true;
+#else
+static bool use_simd = false;
+#endif
+
+bool utf8_use_simd(bool enable) {
+#ifdef UTF8_SIMD
+    use_simd = enable;
+#endif
+    return use_simd;
+}
+
+// ------------------------- scalar -------------------------
+
+/*
+ * decodes the sequence at s (Unicode Table 3-7)
+ * returns the length of the sequence, or, if it is ill-formed, the length
+ * of its maximal subpart (at least 1)
+ */
+static size_t utf8_sequence(const unsigned char *s, size_t len, bool *valid) {
+    unsigned char c = s[0];
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    size_t n;
+    if(c < 0x80) {
+        *valid = true;
+        return 1;
+    } else if(c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if(c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        if(c == 0xe0) {
+            lo = 0xa0; // overlong
+        } else if(c == 0xed) {
+            hi = 0x9f; // surrogates
+        }
+    } else if(c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if(c == 0xf0) {
+            lo = 0x90; // overlong
+        } else if(c == 0xf4) {
+            hi = 0x8f; // > U+10FFFF
+        }
+    } else {
+        *valid = false;
+        return 1;
+    }
+    
+    for(size_t i=1;i<n;i++) {
+        if(i >= len || s[i] < lo || s[i] > hi) {
+            *valid = false;
+            return i;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    *valid = true;
+    return n;
+}
+
+static bool validate_scalar(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        // ascii fast path
+        if(i + 8 <= len) {
+            uint64_t v;
+            memcpy(&v, s + i, 8);
+            if((v & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        
+        bool valid;
+        i += utf8_sequence(s + i, len - i, &valid);
+        if(!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ------------------------- simd -------------------------
+
+#ifdef UTF8_SIMD
+
+#ifdef UTF8_SSSE3
+typedef __m128i Vec;
+#define vec_load(p)          _mm_loadu_si128((const __m128i*)(p))
+#define vec_table(...)       _mm_setr_epi8(__VA_ARGS__)
+#define vec_lookup(t, idx)   _mm_shuffle_epi8(t, idx)
+#define vec_splat(c)         _mm_set1_epi8((char)(c))
+#define vec_zero()           _mm_setzero_si128()
+#define vec_and(a, b)        _mm_and_si128(a, b)
+#define vec_or(a, b)         _mm_or_si128(a, b)
+#define vec_xor(a, b)        _mm_xor_si128(a, b)
+#define vec_subs(a, b)       _mm_subs_epu8(a, b)
+#define vec_shr4(a)          _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x0f))
+#define vec_prev(a, prev, n) _mm_alignr_epi8(a, prev, 16 - (n))
+#define vec_is_ascii(a)      (_mm_movemask_epi8(a) == 0)
+#define vec_any(a)           (_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) != 0xffff)
+#endif
+
+#ifdef UTF8_NEON
+typedef uint8x16_t Vec;
+static inline uint8x16_t neon_table(
+        uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3,
+        uint8_t a4, uint8_t a5, uint8_t a6, uint8_t a7,
+        uint8_t a8, uint8_t a9, uint8_t a10, uint8_t a11,
+        uint8_t a12, uint8_t a13, uint8_t a14, uint8_t a15)
+{
+    const uint8_t t[16] = { a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15 };
+    return vld1q_u8(t);
+}
+#define vec_load(p)          vld1q_u8((const uint8_t*)(p))
+#define vec_table(...)       neon_table(__VA_ARGS__)
+#define vec_lookup(t, idx)   vqtbl1q_u8(t, idx)
+#define vec_splat(c)         vdupq_n_u8(c)
+#define vec_zero()           vdupq_n_u8(0)
+#define vec_and(a, b)        vandq_u8(a, b)
+#define vec_or(a, b)         vorrq_u8(a, b)
+#define vec_xor(a, b)        veorq_u8(a, b)
+#define vec_subs(a, b)       vqsubq_u8(a, b)
+#define vec_shr4(a)          vshrq_n_u8(a, 4)
+#define vec_prev(a, prev, n) vextq_u8(prev, a, 16 - (n))
+#define vec_is_ascii(a)      (vmaxvq_u8(a) < 0x80)
+#define vec_any(a)           (vmaxvq_u8(a) != 0)
+#endif
+
+/*
+ * error classes of a pair of bytes (byte 1: previous byte, byte 2: current)
+ */
+#define TOO_SHORT      (1<<0) // 11______ 0_______ or 11______ 11______
+#define TOO_LONG       (1<<1) // 0_______ 10______
+#define OVERLONG_3     (1<<2) // 11100000 100_____
+#define TOO_LARGE      (1<<3) // 11110100 1001____ or 11110100 101_____
+#define SURROGATE      (1<<4) // 11101101 101_____
+#define OVERLONG_2     (1<<5) // 1100000_ 10______
+#define TOO_LARGE_1000 (1<<6) // 11110101 1000____ or 1111011_ 1000____
+#define OVERLONG_4     (1<<6) // 11110000 1000____
+#define TWO_CONTS      (1<<7) // 10______ 10______
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+typedef struct Utf8Tables {
+    Vec byte_1_high;
+    Vec byte_1_low;
+    Vec byte_2_high;
+    Vec incomplete;
+} Utf8Tables;
+
+static void init_tables(Utf8Tables *t) {
+    t->byte_1_high = vec_table(
+            // 0_______ ________
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            // 10______ ________
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            // 1100____ ________
+            TOO_SHORT | OVERLONG_2,
+            // 1101____ ________
+            TOO_SHORT,
+            // 1110____ ________
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            // 1111____ ________
+            TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    t->byte_1_low = vec_table(
+            // ____0000 ________
+            CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+            // ____0001 ________
+            CARRY | OVERLONG_2,
+            // ____001_ ________
+            CARRY,
+            CARRY,
+            // ____0100 ________
+            CARRY | TOO_LARGE,
+            // ____0101 ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____011_ ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____1___ ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            // ____1101 ________
+            CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000);
+    t->byte_2_high = vec_table(
+            // ________ 0_______
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            // ________ 1000____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+            // ________ 1001____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+            // ________ 101_____
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            // ________ 11______
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    // a lead byte in the last 3 bytes of a block needs continuation bytes
+    t->incomplete = vec_table(
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff,
+            0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+}
+
+/*
+ * returns the errors of a block (0: no error)
+ */
+static inline Vec check_block(const Utf8Tables *t, Vec input, Vec prev_input) {
+    Vec prev1 = vec_prev(input, prev_input, 1);
+    Vec low = vec_splat(0x0f);
+    Vec sc = vec_and(
+            vec_and(vec_lookup(t->byte_1_high, vec_shr4(prev1)), vec_lookup(t->byte_1_low, vec_and(prev1, low))),
+            vec_lookup(t->byte_2_high, vec_shr4(input)));
+    
+    // 3rd and 4th bytes of a sequence must be continuation bytes
+    Vec prev2 = vec_prev(input, prev_input, 2);
+    Vec prev3 = vec_prev(input, prev_input, 3);
+    Vec is_third = vec_subs(prev2, vec_splat(0xe0 - 0x80));
+    Vec is_fourth = vec_subs(prev3, vec_splat(0xf0 - 0x80));
+    Vec must23 = vec_and(vec_or(is_third, is_fourth), vec_splat(0x80));
+    return vec_xor(must23, sc);
+}
+
+static bool validate_simd(const unsigned char *s, size_t len) {
+    Utf8Tables t;
+    init_tables(&t);
+    
+    Vec zero = vec_zero();
+    Vec error = zero;
+    Vec prev_input = zero;
+    Vec prev_incomplete = zero;
+    size_t i = 0;
+    for(;i+16<=len;i+=16) {
+        Vec input = vec_load(s + i);
+        if(vec_is_ascii(input)) {
+            error = vec_or(error, prev_incomplete);
+        } else {
+            error = vec_or(error, check_block(&t, input, prev_input));
+            prev_incomplete = vec_subs(input, t.incomplete);
+        }
+        prev_input = input;
+        
+        // check the accumulated errors from time to time
+        if((i & 0xfff) == 0xff0 && vec_any(error)) {
+            return false;
+        }
+    }
+    
+    // the remaining bytes are checked in a zero padded block, which also
+    // detects an incomplete sequence at the end
+    unsigned char tail[16] = { 0 };
+    memcpy(tail, s + i, len - i);
+    error = vec_or(error, check_block(&t, vec_load(tail), prev_input));
+    
+    return !vec_any(error);
+}
+
+#endif
+
+// ------------------------- public functions -------------------------
+
+bool utf8_validate(const char *str, size_t len) {
+#ifdef UTF8_SIMD
+    if(use_simd) {
+        return validate_simd((const unsigned char*)str, len);
+    }
+#endif
+    return validate_scalar((const unsigned char*)str, len);
+}
+
+char* utf8_repair(const char *str, size_t len, size_t *outlen) {
+    const unsigned char *s = (const unsigned char*)str;
+    // every invalid byte is replaced with at most 3 bytes
+    char *out = malloc(3 * len + 1);
+    size_t pos = 0;
+    size_t i = 0;
+    while(i < len) {
+        bool valid;
+        size_t n = utf8_sequence(s + i, len - i, &valid);
+        if(valid) {
+            memcpy(out + pos, s + i, n);
+            pos += n;
+        } else {
+            memcpy(out + pos, "\xef\xbf\xbd", 3);
+            pos += 3;
+        }
+        i += n;
+    }
+    out[pos] = 0;
+    if(outlen) {
+        *outlen = pos;
+    }
+    return out;
+}
+
+char* utf8_ensure(char *str) {
+    if(!str) {
+        return NULL;
+    }
+    size_t len = strlen(str);
+    if(utf8_validate(str, len)) {
+        return str;
+    }
+    char *repaired = utf8_repair(str, len, NULL);
+    free(str);
+    return repaired;
+}
@@ -0,0 +1,67 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef utf8_h
+#define utf8_h
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*
+ * UTF-8 validation and repair
+ *
+ * The validation uses the lookup algorithm by Keiser and Lemire with SSSE3
+ * or NEON, if available, otherwise a scalar decoder with an ASCII fast path.
+ */
+
+/*
+ * returns true, if str is valid UTF-8
+ */
+bool utf8_validate(const char *str, size_t len);
+
+/*
+ * returns a copy of str, in which every maximal subpart of an ill-formed
+ * sequence is replaced with U+FFFD
+ * the result is 0-terminated, the length is stored in outlen, if not NULL
+ */
+char* utf8_repair(const char *str, size_t len, size_t *outlen);
+
+/*
+ * validates a malloc'd, 0-terminated string
+ * returns str, if it is valid, otherwise str is freed and a repaired
+ * copy is returned
+ */
+char* utf8_ensure(char *str);
+
+/*
+ * enables or disables the vectorized implementation (benchmarks)
+ * returns true, if the vectorized implementation is used
+ */
+bool utf8_use_simd(bool enable);
+
+#endif /* utf8_h */
@@ -0,0 +1,118 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "watchdog.h"
+
+#include "xmpp.h"
+#include "monotime.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+
+void watchdog_init(XmppWatchdog *wd, unsigned int budget_ms) {
+    memset(wd, 0, sizeof(XmppWatchdog));
+    wd->budget = (uint64_t)budget_ms * 1000000;
+}
+
+void watchdog_check(
+        XmppWatchdog *wd,
+        uint64_t start,
+        const char *name,
+        void *func,
+        const char *stanza,
+        const char *type)
+{
+    uint64_t elapsed = monotime_ns() - start;
+    wd->busy += elapsed;
+    if(elapsed > wd->max) {
+        wd->max = elapsed;
+    }
+    if(wd->budget == 0 || elapsed <= wd->budget) {
+        return;
+    }
+    wd->stalls++;
+    
+    // most callbacks are static functions, therefore dladdr only returns
+    // a name, if the address matches a symbol exactly
+    Dl_info info;
+    if(!name && func && dladdr(func, &info) && info.dli_saddr == func) {
+        name = info.dli_sname;
+    }
+    
+    char *buf = NULL;
+    asprintf(&buf, "xmpp: stall: %s%s%p %s%s%s took %llu ms (budget: %llu ms)\n",
+             name ? name : "",
+             name ? " " : "",
+             func,
+             stanza ? stanza : "",
+             type ? "/" : "",
+             type ? type : "",
+             (unsigned long long)(elapsed / 1000000),
+             (unsigned long long)(wd->budget / 1000000));
+    XmppLog(buf);
+    free(buf);
+}
+
+void watchdog_iteration_end(XmppWatchdog *wd) {
+    uint64_t us = wd->busy / 1000;
+    int bucket = 0;
+    while(us > 0 && bucket < XMPP_WATCHDOG_BUCKETS-1) {
+        us >>= 1;
+        bucket++;
+    }
+    wd->histogram[bucket]++;
+    wd->iterations++;
+    wd->busy = 0;
+}
+
+void watchdog_log_histogram(XmppWatchdog *wd) {
+    char *buf = NULL;
+    asprintf(&buf, "xmpp: loop iterations: %llu stalls: %llu max callback: %llu us\n",
+             (unsigned long long)wd->iterations,
+             (unsigned long long)wd->stalls,
+             (unsigned long long)(wd->max / 1000));
+    XmppLog(buf);
+    free(buf);
+    
+    for(int i=0;i<XMPP_WATCHDOG_BUCKETS;i++) {
+        if(wd->histogram[i] == 0) {
+            continue;
+        }
+        unsigned long long from = i == 0 ? 0 : 1ULL << (i-1);
+        unsigned long long to = 1ULL << i;
+        if(i == XMPP_WATCHDOG_BUCKETS-1) {
+            asprintf(&buf, "  >= %llu us: %llu\n", from, (unsigned long long)wd->histogram[i]);
+        } else {
+            asprintf(&buf, "  [%llu, %llu) us: %llu\n", from, to, (unsigned long long)wd->histogram[i]);
+        }
+        XmppLog(buf);
+        free(buf);
+    }
+}
@@ -0,0 +1,114 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IM4_watchdog_h
+#define IM4_watchdog_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * number of histogram buckets
+ * bucket 0: < 1 us, bucket n: [2^(n-1), 2^n) us, last bucket: everything above
+ */
+#define XMPP_WATCHDOG_BUCKETS 24
+
+/*
+ * default stall budget for a single callback (ms)
+ */
+#define XMPP_WATCHDOG_DEFAULT_BUDGET 50
+
+/*
+ * The watchdog measures all stanza handlers and XmppCall callbacks that run
+ * in the xmpp thread. Every invocation that exceeds the budget is reported
+ * to the log. The busy time of each loop iteration is recorded in a
+ * histogram.
+ *
+ * All watchdog data is owned by the xmpp thread.
+ */
+typedef struct XmppWatchdog {
+    /*
+     * max duration of a single callback (ns)
+     */
+    uint64_t budget;
+    
+    /*
+     * accumulated callback time of the current loop iteration (ns)
+     */
+    uint64_t busy;
+    
+    /*
+     * loop iteration busy time histogram
+     */
+    uint64_t histogram[XMPP_WATCHDOG_BUCKETS];
+    
+    /*
+     * number of loop iterations
+     */
+    uint64_t iterations;
+    
+    /*
+     * number of callbacks that exceeded the budget
+     */
+    uint64_t stalls;
+    
+    /*
+     * longest callback duration (ns)
+     */
+    uint64_t max;
+} XmppWatchdog;
+
+void watchdog_init(XmppWatchdog *wd, unsigned int budget_ms);
+
+/*
+ * Finishes the measurement of a callback, that was started at start
+ *
+ * name:   callback name or NULL, if func should be used
+ * func:   callback function pointer
+ * stanza: stanza name (message, presence, iq) or NULL
+ * type:   stanza type attribute or NULL
+ */
+void watchdog_check(
+        XmppWatchdog *wd,
+        uint64_t start,
+        const char *name,
+        void *func,
+        const char *stanza,
+        const char *type);
+
+/*
+ * adds the busy time of the current loop iteration to the histogram
+ */
+void watchdog_iteration_end(XmppWatchdog *wd);
+
+/*
+ * writes the loop iteration histogram to the log
+ */
+void watchdog_log_histogram(XmppWatchdog *wd);
+
+#endif /* IM4_watchdog_h */
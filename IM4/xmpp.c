@@ -36,16 +36,32 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <poll.h>
 #include <sys/socket.h>
 
 #include "otr.h"
+#include "otrdh.h"
+#include "trace.h"
+#include "pipeline.h"
+#include "regexreplace.h"
+#include "utf8.h"
+#include "monotime.h"
 
 
 static Xmpp *im_account;
 
 static xmpp_log_level_t xmpp_log_level = XMPP_LEVEL_INFO;
 
+/*
+ * raw inbound stream capture, see XmppSetCaptureFile
+ * capture_file is protected by capture_lock, capture_enabled is the
+ * lock-free check for the log handler
+ */
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file;
+static atomic_bool capture_enabled;
+
 xmpp_log_level_t XmppGetLogLevel(void) {
     return xmpp_log_level;
 }
@@ -54,6 +70,28 @@ void XmppSetLogLevel(xmpp_log_level_t level) {
     xmpp_log_level = level;
 }
 
+void XmppSetCaptureFile(const char *path) {
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    if(path) {
+        capture_file = fopen(path, "a");
+        if(!capture_file) {
+            perror("XmppSetCaptureFile");
+        }
+    }
+    atomic_store(&capture_enabled, capture_file != NULL);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void XmppSetOtrDHPool(size_t size) {
+    if(size > 0 && otrdh_pool_init(size)) {
+        XmppLog("otr: DH keypair pool not available\n");
+    }
+}
+
 void XmppLog(const char *str) {
     app_add_log(str, strlen(str));
     fprintf(stderr, "%s", str);
@@ -64,6 +102,16 @@ static void log_handler(void *userdata,
                         const char *area,
                         const char *msg)
 {
+    // libstrophe logs every received chunk with the prefix "RECV: "
+    if(atomic_load_explicit(&capture_enabled, memory_order_relaxed) && level == XMPP_LEVEL_DEBUG && !strncmp(msg, "RECV: ", 6)) {
+        pthread_mutex_lock(&capture_lock);
+        if(capture_file) {
+            fputs(msg + 6, capture_file);
+            fflush(capture_file);
+        }
+        pthread_mutex_unlock(&capture_lock);
+    }
+    
     if(level < xmpp_log_level) {
         return;
     }
@@ -96,6 +144,14 @@ Xmpp* XmppCreate(XmppSettings settings) {
     xmpp->settings = settings;
     xmpp->log = &logf;
     xmpp->ctx = ctx;
+    watchdog_init(&xmpp->watchdog, XMPP_WATCHDOG_DEFAULT_BUDGET);
+    xmpp->created = monotime_ns();
+    pthread_mutex_init(&xmpp->otr_lock, NULL);
+    pthread_cond_init(&xmpp->otr_cond, NULL);
+    pthread_mutex_init(&xmpp->otr_persist.lock, NULL);
+    pthread_cond_init(&xmpp->otr_persist.cond, NULL);
+    pthread_mutex_init(&xmpp->otr_contexts.lock, NULL);
+    pthread_mutex_init(&xmpp->otr_keygen.lock, NULL);
     
     if(settings.jid) {
         if(xmpp->settings.resource && strlen(xmpp->settings.resource) > 0) {
@@ -104,23 +160,71 @@ Xmpp* XmppCreate(XmppSettings settings) {
             xmpp->xid = strdup(xmpp->settings.jid);
         }
         
+        // the otr files are loaded in the background, otr operations wait
+        // in otr_wait_state until the loader is finished
         xmpp->userstate = otrl_userstate_create();
-        
-        char *privkey_file = app_configfile("otr.private_key");
-        gcry_error_t otrerr = otrl_privkey_read(xmpp->userstate, privkey_file);
-        free(privkey_file);
-        
-        char *fingerprints_file = app_configfile("otr.fingerprints");
-        otrerr = otrl_privkey_read_fingerprints(xmpp->userstate, fingerprints_file, NULL, NULL);
-        
-        char *instancetags_file = app_configfile("otr.instance_tags");
-        otrerr = otrl_instag_read(xmpp->userstate, instancetags_file);
-        free(instancetags_file);
+        xmpp->otr_opdata.xmpp = xmpp;
+        xmpp->otr_opdata.userstate = xmpp->userstate;
+        otr_load_state(xmpp);
     }
     
     return xmpp;
 }
 
+void XmppSetOtrWorkers(Xmpp *xmpp, int nworkers) {
+    otr_set_workers(xmpp, nworkers);
+}
+
+void XmppSetOtrFragmentSize(Xmpp *xmpp, size_t size) {
+    xmpp->otr_output.fragment_size = size;
+}
+
+void XmppWaitOtr(Xmpp *xmpp) {
+    otr_wait_state(xmpp, "app");
+}
+
+static void flush_otr(Xmpp *xmpp, void *unused) {
+    otr_flush_fingerprints(xmpp);
+    
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    pthread_mutex_lock(&p->lock);
+    p->flushed++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void XmppFlushOtr(Xmpp *xmpp, unsigned int timeout_ms) {
+    if(!xmpp->userstate) {
+        return;
+    }
+    if(!xmpp->running) {
+        otr_flush_fingerprints(xmpp);
+        return;
+    }
+    
+    XmppOtrPersist *p = &xmpp->otr_persist;
+    pthread_mutex_lock(&p->lock);
+    uint64_t flushed = p->flushed;
+    pthread_mutex_unlock(&p->lock);
+    
+    XmppCall(xmpp, flush_otr, NULL);
+    
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t t = (uint64_t)now.tv_usec * 1000 + (uint64_t)timeout_ms * 1000000;
+    struct timespec abstime;
+    abstime.tv_sec = now.tv_sec + t / 1000000000;
+    abstime.tv_nsec = t % 1000000000;
+    
+    pthread_mutex_lock(&p->lock);
+    while(p->flushed == flushed) {
+        if(pthread_cond_timedwait(&p->cond, &p->lock, &abstime)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
 void XmppRecreate(Xmpp *xmpp, XmppSettings settings) {
     xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, &logf);
     
@@ -142,6 +246,29 @@ void XmppSetStartupPresence(Xmpp *xmpp, int num, const char *show, const char *s
     xmpp->startup_presence_num = num;
 }
 
+void XmppSetStallBudget(Xmpp *xmpp, unsigned int ms) {
+    xmpp->watchdog.budget = (uint64_t)ms * 1000000;
+}
+
+void XmppSetHistory(Xmpp *xmpp, HistoryStore *history, bool secure) {
+    xmpp->history = history;
+    xmpp->history_secure = secure;
+}
+
+int64_t XmppHistoryAdd(Xmpp *xmpp, const char *xid, bool out, bool secure, const char *msg) {
+    if(!xmpp->history || (secure && !xmpp->history_secure)) {
+        return 0;
+    }
+    unsigned int flags = 0;
+    if(out) {
+        flags |= HISTORY_OUT;
+    }
+    if(secure) {
+        flags |= HISTORY_SECURE;
+    }
+    return history_append(xmpp->history, xid, history_now(), flags, msg, strlen(msg));
+}
+
 typedef struct StrBuf {
     char *str;
     size_t alloc;
@@ -184,16 +311,13 @@ static char* html_stanza2text(xmpp_ctx_t *ctx, xmpp_stanza_t *html) {
 /*
  * xmpp message handler
  */
-static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata) {
-    Xmpp *xmpp = userdata;
-    
+static int handle_message(Xmpp *xmpp, xmpp_stanza_t *stanza, const char *from) {
     const char *type = xmpp_stanza_get_type(stanza);
     if(type && !strcmp(type, "error")) {
         printf("message_cb: type = error\n");
         return 1;
     }
     
-    const char *from = xmpp_stanza_get_attribute(stanza, "from");
     if(!from) {
         printf("message_cb: missing from attribute\n");
         return 1;
@@ -208,7 +332,7 @@ static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
         while(children) {
             const char *ns = xmpp_stanza_get_ns(children);
             const char *name = xmpp_stanza_get_name(children);
-            if(!strcmp(ns, "http://jabber.org/protocol/chatstates")) {
+            if(ns && !strcmp(ns, "http://jabber.org/protocol/chatstates")) {
                 // chat status updates
                 if(!strcmp(name, "composing")) {
                     app_chatstate(xmpp, from, XMPP_CHATSTATE_COMPOSING);
@@ -231,10 +355,13 @@ static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
     
     xmpp_stanza_t *html = xmpp_stanza_get_child_by_name(stanza, "html");
     char *html_text = NULL;
+    uint64_t html_ns = 0;
     if(html) {
         xmpp_stanza_t *html_body = xmpp_stanza_get_child_by_name(html, "body");
         if(html_body) {
+            uint64_t start = monotime_ns();
             html_text = html_stanza2text(xmpp->ctx, html_body);
+            html_ns = monotime_ns() - start;
         }
     }
     
@@ -243,41 +370,23 @@ static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
     
     if(body_text) {
         size_t len = strlen(body_text);
-        char *decrypt_msg = NULL;
-        char *user_msg = body_text;
-        bool secure = false;
         
         // check for otr messages
         if(len > 4 && !memcmp(body_text, "?OTR", 4)) {
-            int otr_err;
-            decrypt_msg = decrypt_message(xmpp, from, body_text, &otr_err);
-            user_msg = decrypt_msg;
-            secure = true;
+            // the decrypted message is passed to the app by the otr module
+            otr_receive_message(xmpp, from, body_text);
+        } else {
+            // prepare the message in the xmpp thread
+            TextReplacementScope *scope = XmppInboundRulesScope(xmpp, from);
+            InboundMessage *user_msg = html_text
+                    ? pipeline_process(from, scope, html_text, true, false, 0, html_ns)
+                    : pipeline_process(from, scope, body_text, false, false, 0, 0);
             
-            if(otr_err == 1) {
-                // this message could be part of an otr handshake
-                printf("internal otr message\n");
-                // check conversation encryption status
-                ConnContext *root = xmpp->userstate->context_root;
-                ConnContext *child = root->recent_rcvd_child;
-                
-                if(child && child->username && !strcmp(child->username, from)) {
-                    if(child->msgstate == OTRL_MSGSTATE_FINISHED) {
-                        app_update_secure_status(xmpp, from, false);
-                    }
-                }
-            }
-        } else if(html_text) {
-            user_msg = html_text;
-        }
-        
-        // send the mssage to the app thread
-        if(user_msg) {
-            app_message(xmpp, from, user_msg, secure);
-        }
-        
-        if(decrypt_msg) {
-            free(decrypt_msg);
+            user_msg->history_timestamp = XmppHistoryAdd(xmpp, user_msg->xid, false, false, user_msg->message);
+            
+            // send the mssage to the app thread
+            IM4_TRACE(message_dispatch, from, strlen(user_msg->text), false);
+            app_inbound_message(xmpp, user_msg);
         }
     }
     
@@ -287,11 +396,117 @@ static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
     return 1;
 }
 
+// ------------------------- inbound rules scopes -------------------------
+
+struct XmppInboundScope {
+    char *xid;
+    TextReplacementScope scope;
+    XmppInboundScope *next;
+};
+
+#define XMPP_INBOUND_SCOPES_INITIAL_SIZE 64
+
+/*
+ * max number of cached scopes, the cache is cleared, when it is full
+ */
+#define XMPP_INBOUND_SCOPES_MAX 4096
+
+/*
+ * FNV-1a hash of the bare jid
+ */
+static uint32_t xid_hash(const char *jid, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i=0;i<len;i++) {
+        h ^= (unsigned char)jid[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void inbound_scopes_clear(XmppInboundScopes *map) {
+    for(size_t i=0;i<map->size;i++) {
+        XmppInboundScope *e = map->table[i];
+        while(e) {
+            XmppInboundScope *next = e->next;
+            free(e->xid);
+            free(e);
+            e = next;
+        }
+        map->table[i] = NULL;
+    }
+    map->count = 0;
+}
+
+static void inbound_scopes_grow(XmppInboundScopes *map) {
+    size_t newsize = map->size ? map->size * 2 : XMPP_INBOUND_SCOPES_INITIAL_SIZE;
+    XmppInboundScope **newtable = calloc(newsize, sizeof(XmppInboundScope*));
+    for(size_t i=0;i<map->size;i++) {
+        XmppInboundScope *e = map->table[i];
+        while(e) {
+            XmppInboundScope *next = e->next;
+            size_t slot = xid_hash(e->xid, strlen(e->xid)) & (newsize - 1);
+            e->next = newtable[slot];
+            newtable[slot] = e;
+            e = next;
+        }
+    }
+    free(map->table);
+    map->table = newtable;
+    map->size = newsize;
+}
+
+TextReplacementScope* XmppInboundRulesScope(Xmpp *xmpp, const char *from) {
+    XmppInboundScopes *map = &xmpp->inbound_scopes;
+    const char *res = strchr(from, '/');
+    size_t len = res ? (size_t)(res - from) : strlen(from);
+    uint32_t hash = xid_hash(from, len);
+    
+    if(map->size > 0) {
+        XmppInboundScope *e = map->table[hash & (map->size - 1)];
+        while(e) {
+            if(!strncmp(e->xid, from, len) && e->xid[len] == 0) {
+                return &e->scope;
+            }
+            e = e->next;
+        }
+    }
+    
+    if(map->count >= XMPP_INBOUND_SCOPES_MAX) {
+        inbound_scopes_clear(map);
+    }
+    if(map->count >= map->size * 3 / 4) {
+        inbound_scopes_grow(map);
+    }
+    XmppInboundScope *e = calloc(1, sizeof(XmppInboundScope));
+    e->xid = strndup(from, len);
+    size_t slot = hash & (map->size - 1);
+    e->next = map->table[slot];
+    map->table[slot] = e;
+    map->count++;
+    return &e->scope;
+}
+
+static int message_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata) {
+    const char *from = xmpp_stanza_get_attribute(stanza, "from");
+    IM4_TRACE(message_recv, from);
+    IM4_TRACE_START(start, message_done);
+    
+    Xmpp *xmpp = userdata;
+    uint64_t wd_start = monotime_ns();
+    int ret = handle_message(xmpp, stanza, from);
+    watchdog_check(&xmpp->watchdog, wd_start, "message_cb", message_cb, "message", xmpp_stanza_get_type(stanza));
+    
+    IM4_TRACE(message_done, from, IM4_TRACE_ELAPSED(start));
+    return ret;
+}
+
 /*
  * callback function for roster queries
  */
 static int query_roster_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata) {
     XmppQuery *xquery = userdata;
+    IM4_TRACE_START(start, roster_done);
+    uint64_t wd_start = monotime_ns();
     
     const char *type = xmpp_stanza_get_type(stanza);
     if(!strcmp(type, "error")) {
@@ -331,8 +546,10 @@ static int query_roster_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userd
         
         printf("END\n");
         app_refresh_contactlist(xquery->xmpp, contacts, contactsNum);
+        IM4_TRACE(roster_done, contactsNum, IM4_TRACE_ELAPSED(start));
     }
     
+    watchdog_check(&xquery->xmpp->watchdog, wd_start, "query_roster_cb", query_roster_cb, "iq", type);
     
     free(xquery->id);
     free(xquery);
@@ -344,17 +561,21 @@ static int presence_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
     
     const char *type = xmpp_stanza_get_attribute(stanza, "type");
     const char *from = xmpp_stanza_get_attribute(stanza, "from");
+    IM4_TRACE(presence_recv, from, type);
+    IM4_TRACE_START(start, presence_done);
+    uint64_t wd_start = monotime_ns();
     
     char *show = NULL;
     char *status = NULL;
     xmpp_stanza_t *show_elm = xmpp_stanza_get_child_by_name(stanza, "show");
     xmpp_stanza_t *status_elm = xmpp_stanza_get_child_by_name(stanza, "status");
     
+    // the app converts the strings with initWithUTF8String
     if(show_elm) {
-        show = xmpp_stanza_get_text(show_elm);
+        show = utf8_ensure(xmpp_stanza_get_text(show_elm));
     }
     if(status_elm) {
-        status = xmpp_stanza_get_text(status_elm);
+        status = utf8_ensure(xmpp_stanza_get_text(status_elm));
     }
     
     if(type && !strcmp(type, "subscribe")) {
@@ -366,6 +587,8 @@ static int presence_cb(xmpp_conn_t *conn, xmpp_stanza_t *stanza, void *userdata)
     free(show);
     free(status);
     
+    watchdog_check(&xmpp->watchdog, wd_start, "presence_cb", presence_cb, "presence", type);
+    IM4_TRACE(presence_done, from, IM4_TRACE_ELAPSED(start));
     return 1;
 }
 
@@ -395,6 +618,11 @@ static void connect_cb(
     Xmpp *xmpp = userdata;
     
     if(status == XMPP_CONN_CONNECT) {
+        char *log = NULL;
+        asprintf(&log, "xmpp: connected %.1f ms after startup\n", (double)(monotime_ns() - xmpp->created) / 1000000);
+        XmppLog(log);
+        free(log);
+        
         xmpp_handler_add(conn, message_cb, NULL, "message", NULL, xmpp);
         xmpp_handler_add(conn, presence_cb, NULL, "presence", NULL, xmpp);
         
@@ -469,9 +697,36 @@ int XmppQueryContacts(Xmpp *xmpp) {
     return 0;
 }
 
+/*
+ * writes the average and max duration of each inbound pipeline stage to
+ * the log
+ */
+static void log_pipeline_stats(void) {
+    PipelineStats stats;
+    pipeline_stats(&stats);
+    if(stats.messages == 0) {
+        return;
+    }
+    
+    char *buf = NULL;
+    asprintf(&buf, "pipeline: %llu messages\n", (unsigned long long)stats.messages);
+    XmppLog(buf);
+    free(buf);
+    
+    for(int i=0;i<PIPELINE_NSTAGES;i++) {
+        asprintf(&buf, "  %-10s avg: %llu us max: %llu us\n",
+                pipeline_stage_name(i),
+                (unsigned long long)(stats.total_ns[i] / stats.messages / 1000),
+                (unsigned long long)(stats.max_ns[i] / 1000));
+        XmppLog(buf);
+        free(buf);
+    }
+}
+
 static void* xmpp_run_thread(void *data) {
     Xmpp *xmpp = data;
     xmpp->running = 1;
+    otr_keygen_loop_start(xmpp);
     
     /*
     struct pollfd pfd[1];
@@ -480,6 +735,7 @@ static void* xmpp_run_thread(void *data) {
     */
     
     if(session_xmpp_connect(xmpp)) {
+        otr_keygen_loop_exit(xmpp);
         return NULL;
     }
     printf("xmpp connected\n");
@@ -509,7 +765,14 @@ static void* xmpp_run_thread(void *data) {
                 for(int i=0;i<nev;i++) {
                     XmppEvent *xmpp_event = events[i].udata;
                     if(xmpp_event) {
+                        IM4_TRACE_START(exec_start, call_exec);
+                        uint64_t wd_start = monotime_ns();
                         xmpp_event->callback(xmpp, xmpp_event->userdata);
+                        watchdog_check(&xmpp->watchdog, wd_start, NULL, xmpp_event->callback, NULL, NULL);
+                        IM4_TRACE(call_exec,
+                                  xmpp_event->callback,
+                                  exec_start && xmpp_event->enqueued ? exec_start - xmpp_event->enqueued : 0,
+                                  IM4_TRACE_ELAPSED(exec_start));
                         free(xmpp_event);
                         
                     }
@@ -523,8 +786,18 @@ static void* xmpp_run_thread(void *data) {
                 */
             }
         }
+        
+        watchdog_iteration_end(&xmpp->watchdog);
     }
     
+    watchdog_log_histogram(&xmpp->watchdog);
+    log_pipeline_stats();
+    
+    if(xmpp->userstate) {
+        otr_flush_fingerprints(xmpp);
+    }
+    otr_keygen_loop_exit(xmpp);
+    
     return NULL;
 }
 
@@ -562,10 +835,42 @@ void XmppStop(Xmpp *xmpp) {
     XmppCall(xmpp, xmpp_stop_cb, NULL);
 }
 
+/*
+ * writes the profile of the 10 most expensive text replacement rules to
+ * the log
+ */
+static void log_rules_profile(void) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if(!out) {
+        return;
+    }
+    int err = print_rules_profile(out, 10);
+    fclose(out);
+    if(!err) {
+        XmppLog("text replacement rules profile:\n");
+        XmppLog(buf);
+    }
+    free(buf);
+}
+
+static void log_loop_stats(Xmpp *xmpp, void *unused) {
+    watchdog_log_histogram(&xmpp->watchdog);
+    log_pipeline_stats();
+    log_rules_profile();
+}
+
+void XmppLogLoopStats(Xmpp *xmpp) {
+    XmppCall(xmpp, log_loop_stats, NULL);
+}
+
 void XmppCall(Xmpp *xmpp, xmpp_callback_func cb, void *userdata) {
     XmppEvent *ev = malloc(sizeof(XmppEvent));
     ev->callback = cb;
     ev->userdata = userdata;
+    ev->enqueued = IM4_TRACE_TIME(call_exec);
+    IM4_TRACE(call_enqueue, cb, userdata);
     
     struct kevent kev;
     EV_SET(&kev, (uintptr_t)ev, EVFILT_USER, EV_ADD|EV_ONESHOT, NOTE_TRIGGER, 0, ev);
@@ -722,6 +1027,7 @@ void XmppRemove(Xmpp *xmpp, const char *xid, bool unsub) {
 }
 
 void Xmpp_Send(Xmpp *xmpp, const char *to, const char *message) {
+    IM4_TRACE_START(start, send);
     char idbuf[16];
     snprintf(idbuf, 16, "%d", ++xmpp->iq_id);
     
@@ -730,28 +1036,20 @@ void Xmpp_Send(Xmpp *xmpp, const char *to, const char *message) {
     xmpp_message_set_body(msg, message);
     xmpp_send(xmpp->connection, msg);
     xmpp_stanza_release(msg);
+    
+    IM4_TRACE(send, to, strlen(message), IM4_TRACE_ELAPSED(start));
 }
 
 static void send_xmpp_msg(Xmpp *xmpp, void *userdata) {
     xmpp_msg *msg = userdata;
     
-    char *text = NULL;
     if(msg->encrypt) {
-        int err;
-        text = encrypt_message(xmpp, msg->to, msg->message, &err);
+        otr_send_message(xmpp, msg->to, msg->message);
     } else {
-        text = msg->message;
-    }
-    
-    if(text) {
-        Xmpp_Send(xmpp, msg->to, text);
+        Xmpp_Send(xmpp, msg->to, msg->message);
         Xmpp_Send_State(xmpp, msg->to, XMPP_CHATSTATE_ACTIVE);
     }
     
-    if(text != msg->message) {
-        free(text);
-    }
-    
     free(msg->to);
     free(msg->message);
     free(msg);
@@ -954,7 +1252,7 @@ XmppSession* XmppGetSession(Xmpp *xmpp, const char *recipient) {
     if(!session) {
         if(conv->nsessions >= conv->snalloc) {
             conv->snalloc += 4;
-            conv->sessions = realloc(conv->sessions, sizeof(XmppSession*) * conv->nsessions);
+            conv->sessions = realloc(conv->sessions, sizeof(XmppSession*) * conv->snalloc);
         }
         
         session = malloc(sizeof(XmppSession));
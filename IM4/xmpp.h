@@ -31,6 +31,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <strophe.h>
 
@@ -48,6 +49,10 @@
 #include <libotr/message.h>
 #include <libotr/privkey.h>
 
+#include "watchdog.h"
+#include "history.h"
+#include "regexreplace.h"
+
 #define XMPP_STATUS_OFFLINE 0
 #define XMPP_STATUS_ONLINE  1
 #define XMPP_STATUS_AWAY    2
@@ -59,6 +64,12 @@ typedef struct XmppEvent        XmppEvent;
 typedef struct XmppSession      XmppSession;
 typedef struct XmppConversation XmppConversation;
 typedef struct Xmpp             Xmpp;
+typedef struct XmppOtrQueuedMsg XmppOtrQueuedMsg;
+typedef struct XmppOtrContextEntry XmppOtrContextEntry;
+typedef struct XmppOtrPeerQueue XmppOtrPeerQueue;
+typedef struct XmppInboundScope XmppInboundScope;
+typedef struct OtrWorker        OtrWorker;
+typedef struct OtrPool          OtrPool;
 
 typedef struct XmppSettings {
     char *jid;
@@ -136,6 +147,166 @@ struct XmppConversation {
     void *userdata2;
 };
 
+/*
+ * write-behind state of the otr fingerprints file (otr.c)
+ * all fields are protected by lock
+ */
+typedef struct XmppOtrPersist {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    
+    /*
+     * the persister thread is running, stop requests the thread to exit
+     */
+    bool running;
+    bool stop;
+    
+    /*
+     * the fingerprints have changed since the last snapshot
+     */
+    bool dirty;
+    
+    /*
+     * a snapshot was requested from the xmpp thread
+     */
+    bool requested;
+    
+    /*
+     * serialized fingerprints, created in the xmpp thread
+     */
+    char *snapshot;
+    size_t snapshot_len;
+    
+    /*
+     * timestamp of the last write (ns, monotime_ns)
+     */
+    uint64_t last_write;
+    
+    /*
+     * number of completed XmppFlushOtr requests
+     */
+    uint64_t flushed;
+} XmppOtrPersist;
+
+/*
+ * state of the background otr private key generation (otr.c)
+ * running and the queue are only accessed in the xmpp thread
+ */
+typedef struct XmppOtrKeygen {
+    /*
+     * key generation is in progress
+     */
+    bool running;
+    
+    /*
+     * otr operations that wait for the private key, in order
+     */
+    XmppOtrQueuedMsg *queue_begin;
+    XmppOtrQueuedMsg *queue_end;
+    
+    /*
+     * handover of the calculated key to the xmpp thread
+     * loop_exited: the xmpp thread doesn't process XmppCall events anymore
+     * job: calculated key, that was posted to the xmpp thread
+     * protected by lock
+     */
+    pthread_mutex_t lock;
+    bool loop_exited;
+    struct OtrKeygenJob *job;
+} XmppOtrKeygen;
+
+/*
+ * hash map of peer jid (libotr username) to the libotr context and the
+ * last known msgstate (otr.c)
+ * updated by the libotr callbacks in the xmpp thread and in the otr
+ * workers, all fields are protected by lock
+ */
+typedef struct XmppOtrContexts {
+    pthread_mutex_t lock;
+    
+    /*
+     * hash table, the size is a power of 2
+     */
+    XmppOtrContextEntry **table;
+    size_t size;
+    
+    /*
+     * number of entries
+     */
+    size_t count;
+    
+    /*
+     * number of entries with an incomplete fragmented message
+     */
+    size_t fragments_pending;
+} XmppOtrContexts;
+
+/*
+ * hash map of bare jid to the text replacement scope of incoming messages
+ * (the inbound counterpart of the scope in the conversation window)
+ * only accessed in the xmpp thread
+ */
+typedef struct XmppInboundScopes {
+    /*
+     * hash table, the size is a power of 2
+     */
+    XmppInboundScope **table;
+    size_t size;
+    
+    /*
+     * number of entries
+     */
+    size_t count;
+} XmppInboundScopes;
+
+/*
+ * outgoing otr messages (otr.c), only accessed in the xmpp thread
+ *
+ * Fragments of large messages are queued per peer and sent round-robin,
+ * a bounded number of bytes per event loop iteration, so that the
+ * stanzas of other conversations are not blocked by a large message.
+ */
+typedef struct XmppOtrOutput {
+    /*
+     * peers with queued messages, in round-robin order
+     */
+    XmppOtrPeerQueue *queues;
+    
+    /*
+     * a send round is scheduled with XmppCall
+     */
+    bool scheduled;
+    
+    /*
+     * max size of an otr message, larger messages are fragmented
+     * 0: OTR_FRAGMENT_SIZE_DEFAULT
+     */
+    size_t fragment_size;
+} XmppOtrOutput;
+
+/*
+ * opdata of the libotr callbacks
+ */
+typedef struct XmppOtrOpdata {
+    Xmpp *xmpp;
+    
+    /*
+     * userstate used by the current libotr call
+     */
+    OtrlUserState userstate;
+    
+    /*
+     * worker that runs the current libotr call or NULL (xmpp thread)
+     */
+    OtrWorker *worker;
+    
+    /*
+     * peer of the current libotr call
+     */
+    const char *peer;
+} XmppOtrOpdata;
+
 struct Xmpp {
     XmppSettings  settings;
     xmpp_ctx_t    *ctx;
@@ -175,6 +346,72 @@ struct Xmpp {
     size_t conversationsalloc;
     
     OtrlUserState userstate;
+    
+    /*
+     * the otr state is loaded by a background thread (otr_load_state)
+     * otr_sharded: the fingerprints and instance tags are loaded by the
+     * otr workers, userstate only contains the private key
+     * otr_loaded and otr_sharded are protected by otr_lock
+     */
+    pthread_mutex_t otr_lock;
+    pthread_cond_t  otr_cond;
+    bool            otr_loaded;
+    bool            otr_sharded;
+    
+    /*
+     * fingerprints write-behind
+     */
+    XmppOtrPersist otr_persist;
+    
+    /*
+     * private key generation
+     */
+    XmppOtrKeygen otr_keygen;
+    
+    /*
+     * otr context and msgstate per peer
+     */
+    XmppOtrContexts otr_contexts;
+    
+    /*
+     * otr fragment scheduling
+     */
+    XmppOtrOutput otr_output;
+    
+    /*
+     * libotr opdata for otr operations in the xmpp thread
+     */
+    XmppOtrOpdata otr_opdata;
+    
+    /*
+     * otr worker pool or NULL, if all otr operations run in the xmpp thread
+     */
+    OtrPool *otr_pool;
+    
+    /*
+     * XmppCreate timestamp (ns, monotime_ns), used for the startup log
+     */
+    uint64_t created;
+    
+    /*
+     * xmpp thread stall detection and loop statistics
+     */
+    XmppWatchdog watchdog;
+    
+    /*
+     * text replacement scopes of incoming messages
+     */
+    XmppInboundScopes inbound_scopes;
+    
+    /*
+     * conversation history or NULL (not owned)
+     */
+    HistoryStore *history;
+    
+    /*
+     * store otr encrypted messages in the history
+     */
+    bool history_secure;
 };
 
 
@@ -200,6 +437,11 @@ typedef struct XmppQuery {
 struct XmppEvent {
     xmpp_callback_func callback;
     void *userdata;
+    
+    /*
+     * XmppCall timestamp (ns), only set when tracing is enabled
+     */
+    uint64_t enqueued;
 };
 
 xmpp_log_level_t XmppGetLogLevel(void);
@@ -211,10 +453,86 @@ void XmppSetLogLevel(xmpp_log_level_t level);
  */
 void XmppLog(const char *str);
 
+/*
+ * append the raw inbound XML stream to the file at path
+ * the capture can be replayed with bench/xmppreplay
+ * NULL disables the capture
+ */
+void XmppSetCaptureFile(const char *path);
+
+/*
+ * pre-generate up to size otr DH keypairs in the background
+ * 0: libotr generates the keypairs on demand (default)
+ * can only be enabled once
+ */
+void XmppSetOtrDHPool(size_t size);
+
 Xmpp* XmppCreate(XmppSettings settings);
 
+/*
+ * wait until the otr state (private key, fingerprints, instance tags) is
+ * loaded, required before xmpp->userstate is accessed outside of the
+ * otr functions
+ */
+void XmppWaitOtr(Xmpp *xmpp);
+
+/*
+ * write pending otr fingerprint changes to disk
+ * waits at most timeout_ms for the xmpp thread
+ */
+void XmppFlushOtr(Xmpp *xmpp, unsigned int timeout_ms);
+
+/*
+ * run otr operations in a pool of nworkers threads
+ * 0: run otr operations in the xmpp thread (default)
+ * must be called before XmppRun
+ */
+void XmppSetOtrWorkers(Xmpp *xmpp, int nworkers);
+
+/*
+ * max size of an otr message, larger messages are sent in fragments
+ * must be called before XmppRun
+ */
+void XmppSetOtrFragmentSize(Xmpp *xmpp, size_t size);
+
 void XmppSetStartupPresence(Xmpp *xmpp, int num, const char *show, const char *status);
 
+/*
+ * sets the max duration of a single callback in the xmpp thread
+ * callbacks that take longer are reported to the log
+ * 0: disable stall reports
+ */
+void XmppSetStallBudget(Xmpp *xmpp, unsigned int ms);
+
+/*
+ * enables the conversation history (NULL: disabled)
+ * the store is not owned by the xmpp object
+ * secure: store otr encrypted messages (as plaintext)
+ * must be called before XmppRun
+ */
+void XmppSetHistory(Xmpp *xmpp, HistoryStore *history, bool secure);
+
+/*
+ * adds a message (html) to the history of the conversation with xid
+ * returns the history timestamp of the message or 0, if the message
+ * is not stored (history disabled or secure message)
+ * can be called from any thread
+ */
+int64_t XmppHistoryAdd(Xmpp *xmpp, const char *xid, bool out, bool secure, const char *msg);
+
+/*
+ * returns the text replacement scope for incoming messages from the
+ * conversation with from (full or bare jid)
+ * must be called in the xmpp thread
+ */
+TextReplacementScope* XmppInboundRulesScope(Xmpp *xmpp, const char *from);
+
+/*
+ * writes the xmpp thread loop statistics, the inbound pipeline stage times
+ * and the text replacement rules profile to the log
+ */
+void XmppLogLoopStats(Xmpp *xmpp);
+
 void XmppRecreate(Xmpp *xmpp, XmppSettings settings);
 
 //int XmppConnect(Xmpp *xmpp);
@@ -0,0 +1,147 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * app.h implementation for the headless benchmark tools
+ */
+
+#include "bench.h"
+
+#include <string.h>
+
+#include "app.h"
+
+BenchApp bench_app = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void app_event(const char *from) {
+    uint64_t now = bench_time();
+    if(bench_app.first == 0) {
+        bench_app.first = now;
+    }
+    bench_app.last = now;
+    
+    // senders with the resource t<ns> carry the server send timestamp
+    const char *res = from ? strchr(from, '/') : NULL;
+    if(res && res[1] == 't') {
+        uint64_t ts = strtoull(res+2, NULL, 10);
+        if(ts > 0 && ts <= now) {
+            bench_samples_add(&bench_app.latency, now - ts);
+        }
+    }
+}
+
+static void app_done(void) {
+    pthread_mutex_lock(&bench_app.lock);
+    bench_app.done = 1;
+    pthread_cond_signal(&bench_app.cond);
+    pthread_mutex_unlock(&bench_app.lock);
+}
+
+char* app_configfile(const char *name) {
+    char *path = NULL;
+    asprintf(&path, "%s/%s", bench_app.configdir ? bench_app.configdir : "/tmp", name);
+    return path;
+}
+
+void app_call_mainthread(app_func func, void *userdata) {
+    func(userdata);
+}
+
+void app_refresh_contactlist(void *xmpp, XmppContact *contacts, size_t numcontacts) {
+    // the first contact name may contain the timestamp
+    if(numcontacts > 0 && contacts[0].name && contacts[0].name[0] == 't') {
+        uint64_t ts = strtoull(contacts[0].name+1, NULL, 10);
+        uint64_t now = bench_time();
+        if(ts > 0 && ts <= now) {
+            bench_samples_add(&bench_app.latency, now - ts);
+        }
+    }
+    
+    bench_app.rosters++;
+    bench_app.contacts += numcontacts;
+    
+    for(size_t i=0;i<numcontacts;i++) {
+        free(contacts[i].jid);
+        free(contacts[i].name);
+        free(contacts[i].subscription);
+        free(contacts[i].group);
+    }
+    free(contacts);
+}
+
+void app_set_status(Xmpp *xmpp, int status) {
+    bench_app.status = status;
+    if(status == XMPP_STATUS_OFFLINE) {
+        app_done();
+    }
+}
+
+void app_handle_presence(Xmpp *xmpp, const char *from, const char *type, const char *show, const char *status) {
+    bench_app.presences++;
+    app_event(from);
+}
+
+void app_handle_presence_subscribe(Xmpp *xmpp, const char *from) {
+    bench_app.presences++;
+    app_event(from);
+}
+
+void app_handle_new_fingerprint(Xmpp *xmpp, const char *from, const unsigned char *fingerprint, size_t fplen) {
+    
+}
+
+void app_otr_error(Xmpp *xmpp, const char *from, uint64_t error) {
+    
+}
+
+void app_inbound_message(Xmpp *xmpp, InboundMessage *msg) {
+    if(!strncmp(msg->from, "control@", 8) && !strcmp(msg->text, "done")) {
+        pipeline_message_free(msg);
+        app_done();
+        return;
+    }
+    bench_app.messages++;
+    app_event(msg->from);
+    pipeline_message_free(msg);
+}
+
+void app_chatstate(Xmpp *xmpp, const char *from, enum XmppChatstate state) {
+    bench_app.chatstates++;
+    app_event(from);
+}
+
+void app_update_secure_status(Xmpp *xmpp, const char *from, bool issecure) {
+    
+}
+
+void app_add_log(const char *msg, size_t len) {
+    // XmppLog already writes everything to stderr
+}
@@ -0,0 +1,110 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "monotime.h"
+
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+uint64_t bench_time(void) {
+    return monotime_ns();
+}
+
+void bench_samples_add(BenchSamples *s, uint64_t value) {
+    if(s->length == s->alloc) {
+        s->alloc = s->alloc ? s->alloc * 2 : 1024;
+        s->values = realloc(s->values, s->alloc * sizeof(uint64_t));
+    }
+    s->values[s->length++] = value;
+}
+
+static int cmp_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+uint64_t bench_samples_percentile(BenchSamples *s, double p) {
+    if(s->length == 0) {
+        return 0;
+    }
+    qsort(s->values, s->length, sizeof(uint64_t), cmp_uint64);
+    size_t index = (size_t)(p / 100.0 * (s->length - 1) + 0.5);
+    return s->values[index];
+}
+
+void bench_samples_free(BenchSamples *s) {
+    free(s->values);
+    memset(s, 0, sizeof(BenchSamples));
+}
+
+void bench_usage(BenchUsage *usage) {
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    usage->user = r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6;
+    usage->sys = r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+    usage->maxrss = r.ru_maxrss;
+}
+
+size_t bench_heap_used(void) {
+#if defined(__APPLE__)
+    malloc_statistics_t stats;
+    malloc_zone_statistics(NULL, &stats);
+    return stats.size_in_use;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks;
+#else
+    return 0;
+#endif
+}
+
+int bench_app_wait(int timeout) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout;
+    
+    int ret = 0;
+    pthread_mutex_lock(&bench_app.lock);
+    while(!bench_app.done && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&bench_app.cond, &bench_app.lock, &ts);
+    }
+    int done = bench_app.done;
+    pthread_mutex_unlock(&bench_app.lock);
+    return done ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IM4_bench_h
+#define IM4_bench_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * monotonic timestamp in ns
+ */
+uint64_t bench_time(void);
+
+typedef struct BenchSamples {
+    uint64_t *values;
+    size_t length;
+    size_t alloc;
+} BenchSamples;
+
+void bench_samples_add(BenchSamples *s, uint64_t value);
+
+/*
+ * returns the p-th percentile (0-100) of all samples
+ * the samples array is sorted by this function
+ */
+uint64_t bench_samples_percentile(BenchSamples *s, double p);
+
+void bench_samples_free(BenchSamples *s);
+
+typedef struct BenchUsage {
+    /*
+     * user cpu time (s)
+     */
+    double user;
+    
+    /*
+     * system cpu time (s)
+     */
+    double sys;
+    
+    /*
+     * max resident set size (kB)
+     */
+    long maxrss;
+} BenchUsage;
+
+/*
+ * get the resource usage of the current process
+ */
+void bench_usage(BenchUsage *usage);
+
+/*
+ * number of bytes currently allocated with malloc
+ * returns 0 if not supported on this platform
+ */
+size_t bench_heap_used(void);
+
+/*
+ * State of the stub app.h implementation (app_stub.c)
+ *
+ * The app_* functions are called directly in the xmpp thread. They count
+ * the events and, if the resource part of the sender JID has the
+ * format "t<ns>", record the latency between this timestamp and the
+ * app_* call.
+ */
+typedef struct BenchApp {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    
+    /*
+     * directory for app_configfile
+     */
+    const char *configdir;
+    
+    uint64_t messages;
+    uint64_t presences;
+    uint64_t chatstates;
+    uint64_t rosters;
+    uint64_t contacts;
+    
+    /*
+     * latency samples (ns)
+     */
+    BenchSamples latency;
+    
+    /*
+     * timestamp of the first and last event
+     */
+    uint64_t first;
+    uint64_t last;
+    
+    /*
+     * set, when the control message "done" is received or
+     * the connection status changes to offline
+     */
+    int done;
+    
+    /*
+     * last status set with app_set_status
+     */
+    int status;
+} BenchApp;
+
+extern BenchApp bench_app;
+
+/*
+ * wait until bench_app.done is set or the timeout (s) is reached
+ * returns 0 if done is set
+ */
+int bench_app_wait(int timeout);
+
+#endif /* IM4_bench_h */
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# builds the headless benchmark tools
+#
+# run this script from the project root directory
+# requirements: libstrophe, libotr and on Linux libkqueue (found with pkg-config)
+#
+# set IM4_USDT=1 to compile in the USDT tracepoints (see IM4/trace.h)
+
+# check current directory
+if [ ! -d "IM4" ] || [ ! -d "bench" ]; then
+	echo "run this script from the project root directory"
+	exit 1
+fi
+
+CC=${CC:-cc}
+BUILDDIR=bench/build
+
+# prefer the dependencies built by build_dependencies.sh (patched libotr)
+if [ -d dep/install/lib/pkgconfig ]; then
+	PKG_CONFIG_PATH="$(pwd)/dep/install/lib/pkgconfig${PKG_CONFIG_PATH:+:$PKG_CONFIG_PATH}"
+	export PKG_CONFIG_PATH
+fi
+
+PKGS="libstrophe libotr"
+if [ "$(uname)" = "Linux" ]; then
+	PKGS="$PKGS libkqueue"
+fi
+
+if ! PKG_CFLAGS=$(pkg-config --cflags $PKGS); then
+	echo "missing dependencies: $PKGS"
+	exit 1
+fi
+PKG_LIBS=$(pkg-config --libs $PKGS)
+
+BENCH_CFLAGS="-std=gnu11 -O2 -g -D_GNU_SOURCE -IIM4 -Ibench $PKG_CFLAGS"
+if [ -n "$IM4_USDT" ]; then
+	BENCH_CFLAGS="$BENCH_CFLAGS -DIM4_USDT"
+fi
+# SSSE3 is part of the macOS x86_64 baseline (used by utf8.c)
+if [ "$(uname -m)" = "x86_64" ]; then
+	BENCH_CFLAGS="$BENCH_CFLAGS -mssse3"
+fi
+
+# xmppreplay includes xmpp.c
+CORE_SRC="IM4/history.c IM4/historyreader.c IM4/htmlescape.c IM4/msgtemplate.c IM4/otr.c IM4/otrdh.c IM4/otrpool.c IM4/pipeline.c IM4/regexreplace.c IM4/trace.c IM4/utf8.c IM4/watchdog.c"
+BENCH_SRC="bench/bench.c bench/app_stub.c"
+
+mkdir -p $BUILDDIR
+
+echo "build: $BUILDDIR/xmppbench"
+if ! $CC $BENCH_CFLAGS $CFLAGS -o $BUILDDIR/xmppbench bench/xmppbench.c bench/fakeserver.c IM4/xmpp.c $BENCH_SRC $CORE_SRC $PKG_LIBS -lpthread -ldl $LDFLAGS; then
+	echo "build failed"
+	exit 1
+fi
+
+echo "build: $BUILDDIR/xmppreplay"
+if ! $CC $BENCH_CFLAGS $CFLAGS -o $BUILDDIR/xmppreplay bench/xmppreplay.c $BENCH_SRC $CORE_SRC $PKG_LIBS -lpthread -ldl $LDFLAGS; then
+	echo "build failed"
+	exit 1
+fi
+
+echo "build: $BUILDDIR/microbench"
+if ! $CC $BENCH_CFLAGS $CFLAGS -o $BUILDDIR/microbench bench/microbench.c $BENCH_SRC $CORE_SRC $PKG_LIBS -lpthread -ldl $LDFLAGS; then
+	echo "build failed"
+	exit 1
+fi
+
+# otrbench replaces xmpp.c
+echo "build: $BUILDDIR/otrbench"
+if ! $CC $BENCH_CFLAGS $CFLAGS -o $BUILDDIR/otrbench bench/otrbench.c $BENCH_SRC $CORE_SRC $PKG_LIBS -lpthread -ldl $LDFLAGS; then
+	echo "build failed"
+	exit 1
+fi
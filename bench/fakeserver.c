@@ -0,0 +1,413 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fakeserver.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SERVER_JID "bench@localhost/bench"
+
+#define STREAM_HEADER "<?xml version='1.0'?>" \
+    "<stream:stream xmlns='jabber:client' " \
+    "xmlns:stream='http://etherx.jabber.org/streams' " \
+    "id='im4bench' from='localhost' version='1.0'>"
+
+#define FEATURES_SASL "<stream:features>" \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+    "<mechanism>PLAIN</mechanism>" \
+    "</mechanisms>" \
+    "</stream:features>"
+
+#define FEATURES_BIND "<stream:features>" \
+    "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>" \
+    "<session xmlns='urn:ietf:params:xml:ns:xmpp-session'><optional/></session>" \
+    "</stream:features>"
+
+typedef struct Srv {
+    int fd;
+    
+    /*
+     * input buffer
+     */
+    char *buf;
+    size_t len;
+    size_t alloc;
+    
+    /*
+     * current scan position and start of the current element
+     */
+    size_t scan;
+    size_t start;
+    int depth;
+    
+    /*
+     * output buffer
+     */
+    char *out;
+    size_t outlen;
+    size_t outalloc;
+} Srv;
+
+static void srv_append(Srv *s, const char *str, size_t len) {
+    if(s->outlen + len > s->outalloc) {
+        s->outalloc = s->outalloc * 2 + len;
+        s->out = realloc(s->out, s->outalloc);
+    }
+    memcpy(s->out + s->outlen, str, len);
+    s->outlen += len;
+}
+
+static void srv_printf(Srv *s, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void srv_printf(Srv *s, const char *format, ...) {
+    char *str = NULL;
+    va_list ap;
+    va_start(ap, format);
+    int len = vasprintf(&str, format, ap);
+    va_end(ap);
+    if(len > 0) {
+        srv_append(s, str, len);
+    }
+    free(str);
+}
+
+static int srv_flush(Srv *s) {
+    size_t pos = 0;
+    while(pos < s->outlen) {
+        ssize_t w = write(s->fd, s->out + pos, s->outlen - pos);
+        if(w <= 0) {
+            return 1;
+        }
+        pos += w;
+    }
+    s->outlen = 0;
+    return 0;
+}
+
+static int srv_send(Srv *s, const char *str) {
+    srv_append(s, str, strlen(str));
+    return srv_flush(s);
+}
+
+/*
+ * returns the next complete top-level element or the stream header
+ * the returned string must be freed
+ * returns NULL on EOF or if the client closed the stream
+ */
+static char* srv_next(Srv *s) {
+    for(;;) {
+        while(s->scan < s->len) {
+            char *p = s->buf + s->scan;
+            if(*p != '<') {
+                s->scan++;
+                continue;
+            }
+            char *end = memchr(p, '>', s->len - s->scan);
+            if(!end) {
+                break; // incomplete tag
+            }
+            size_t tagpos = s->scan;
+            s->scan += end - p + 1;
+            
+            char *elm = NULL;
+            size_t elmstart = 0;
+            if(p[1] == '?') {
+                continue; // xml declaration
+            } else if(p[1] == '/') {
+                s->depth--;
+                if(s->depth == 0) {
+                    return NULL; // </stream:stream>
+                }
+                if(s->depth == 1) {
+                    elmstart = s->start;
+                    elm = s->buf + elmstart;
+                }
+            } else if(end[-1] == '/') {
+                if(s->depth == 1) {
+                    elmstart = tagpos;
+                    elm = p;
+                }
+            } else {
+                s->depth++;
+                if(s->depth == 1) {
+                    elmstart = tagpos;
+                    elm = p; // stream header
+                } else if(s->depth == 2) {
+                    s->start = tagpos;
+                }
+            }
+            
+            if(elm) {
+                size_t elmlen = s->scan - elmstart;
+                char *ret = malloc(elmlen + 1);
+                memcpy(ret, elm, elmlen);
+                ret[elmlen] = 0;
+                
+                memmove(s->buf, s->buf + s->scan, s->len - s->scan);
+                s->len -= s->scan;
+                s->scan = 0;
+                s->start = 0;
+                return ret;
+            }
+        }
+        
+        if(s->alloc - s->len < 4096) {
+            s->alloc = s->alloc * 2 + 4096;
+            s->buf = realloc(s->buf, s->alloc);
+        }
+        ssize_t r = read(s->fd, s->buf + s->len, s->alloc - s->len);
+        if(r <= 0) {
+            return NULL;
+        }
+        s->len += r;
+    }
+}
+
+/*
+ * returns the value of the attribute name in the start tag of elm
+ */
+static char* srv_attr(const char *elm, const char *name) {
+    const char *end = strchr(elm, '>');
+    size_t namelen = strlen(name);
+    for(const char *p=elm;p && p<end;p++) {
+        p = strstr(p, name);
+        if(!p || p > end) {
+            break;
+        }
+        if(p[-1] == ' ' && p[namelen] == '=') {
+            char quote = p[namelen+1];
+            const char *value = p + namelen + 2;
+            const char *value_end = strchr(value, quote);
+            if(value_end) {
+                return strndup(value, value_end - value);
+            }
+        }
+    }
+    return NULL;
+}
+
+static const char *presence_show[] = { NULL, "away", "chat", "dnd", "xa" };
+
+static void flood_stanza(Srv *s, FakeServerConfig *cfg, size_t n, const char *body) {
+    size_t contact = n % cfg->contacts;
+    unsigned long long ts = bench_time();
+    switch(cfg->scenario) {
+        case FAKESERVER_MESSAGES: {
+            srv_printf(s, "<message type='chat' from='contact%zu@localhost/t%llu' to='" SERVER_JID "' id='m%zu'><body>%s</body></message>", contact, ts, n, body);
+            break;
+        }
+        case FAKESERVER_PRESENCE: {
+            if(n % 10 == 9) {
+                srv_printf(s, "<presence type='unavailable' from='contact%zu@localhost/t%llu' to='" SERVER_JID "'/>", contact, ts);
+            } else {
+                const char *show = presence_show[n % 5];
+                srv_printf(s, "<presence from='contact%zu@localhost/t%llu' to='" SERVER_JID "'>", contact, ts);
+                if(show) {
+                    srv_printf(s, "<show>%s</show>", show);
+                }
+                srv_printf(s, "<status>status message %zu</status></presence>", n);
+            }
+            break;
+        }
+        case FAKESERVER_CHATSTATE: {
+            srv_printf(s, "<message type='chat' from='contact%zu@localhost/t%llu' to='" SERVER_JID "' id='c%zu'><%s xmlns='http://jabber.org/protocol/chatstates'/></message>", contact, ts, n, n % 2 ? "paused" : "composing");
+            break;
+        }
+        default: break;
+    }
+}
+
+static void send_roster(Srv *s, FakeServerConfig *cfg, const char *id) {
+    srv_printf(s, "<iq type='result' id='%s' to='" SERVER_JID "'><query xmlns='jabber:iq:roster'>", id);
+    
+    // the timestamp of the first contact is set after the roster is complete
+    size_t tspos = 0;
+    for(size_t i=0;i<cfg->contacts;i++) {
+        if(i == 0) {
+            srv_printf(s, "<item jid='contact0@localhost' name='t");
+            tspos = s->outlen;
+            srv_printf(s, "%020llu' subscription='both'/>", 0ULL);
+        } else {
+            srv_printf(s, "<item jid='contact%zu@localhost' name='Contact %zu' subscription='both'><group>Group %zu</group></item>", i, i, i % 16);
+        }
+    }
+    srv_printf(s, "</query></iq>");
+    
+    if(cfg->contacts > 0) {
+        char ts[32];
+        snprintf(ts, 32, "%020llu", (unsigned long long)bench_time());
+        memcpy(s->out + tspos, ts, 20);
+    }
+    srv_flush(s);
+}
+
+static void flood(Srv *s, FakeServerConfig *cfg) {
+    char *body = malloc(cfg->bodysize + 1);
+    const char *lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. ";
+    size_t loremlen = strlen(lorem);
+    for(size_t i=0;i<cfg->bodysize;i++) {
+        body[i] = lorem[i % loremlen];
+    }
+    body[cfg->bodysize] = 0;
+    
+    uint64_t start = bench_time();
+    size_t sent = 0;
+    while(sent < cfg->count) {
+        size_t target;
+        if(cfg->rate > 0) {
+            uint64_t elapsed = bench_time() - start;
+            target = (size_t)(elapsed * cfg->rate / 1000000000) + 1;
+        } else {
+            target = sent + 64;
+        }
+        if(target > cfg->count) {
+            target = cfg->count;
+        }
+        if(target <= sent) {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        
+        for(;sent<target;sent++) {
+            flood_stanza(s, cfg, sent, body);
+        }
+        if(srv_flush(s)) {
+            break;
+        }
+    }
+    
+    free(body);
+}
+
+static void fakeserver_run(int fd, FakeServerConfig *cfg) {
+    Srv s;
+    memset(&s, 0, sizeof(Srv));
+    s.fd = fd;
+    
+    char *elm;
+    
+    // stream header and SASL
+    if(!(elm = srv_next(&s))) {
+        return;
+    }
+    free(elm);
+    srv_send(&s, STREAM_HEADER FEATURES_SASL);
+    if(!(elm = srv_next(&s))) {
+        return;
+    }
+    free(elm);
+    srv_send(&s, "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+    
+    // stream restart, resource binding
+    s.depth = 0;
+    if(!(elm = srv_next(&s))) {
+        return;
+    }
+    free(elm);
+    srv_send(&s, STREAM_HEADER FEATURES_BIND);
+    
+    // answer all iqs until the roster query arrives
+    bool roster = false;
+    while(!roster && (elm = srv_next(&s))) {
+        if(!strncmp(elm, "<iq", 3)) {
+            char *id = srv_attr(elm, "id");
+            if(strstr(elm, "jabber:iq:roster")) {
+                send_roster(&s, cfg, id ? id : "");
+                roster = true;
+            } else if(strstr(elm, "urn:ietf:params:xml:ns:xmpp-bind")) {
+                srv_printf(&s, "<iq type='result' id='%s'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><jid>" SERVER_JID "</jid></bind></iq>", id ? id : "");
+                srv_flush(&s);
+            } else {
+                srv_printf(&s, "<iq type='result' id='%s'/>", id ? id : "");
+                srv_flush(&s);
+            }
+            free(id);
+        }
+        free(elm);
+    }
+    
+    if(cfg->scenario != FAKESERVER_ROSTER) {
+        flood(&s, cfg);
+    }
+    srv_send(&s, "<message type='chat' from='control@localhost/bench' to='" SERVER_JID "'><body>done</body></message>");
+    
+    // wait until the client disconnects
+    while((elm = srv_next(&s))) {
+        free(elm);
+    }
+    
+    free(s.buf);
+    free(s.out);
+}
+
+pid_t fakeserver_start(FakeServerConfig *cfg, unsigned short *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addrlen = sizeof(addr);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 1) || getsockname(fd, (struct sockaddr*)&addr, &addrlen)) {
+        perror("fakeserver");
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    
+    pid_t pid = fork();
+    if(pid == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        int client = accept(fd, NULL, NULL);
+        close(fd);
+        if(client >= 0) {
+            fakeserver_run(client, cfg);
+            close(client);
+        }
+        _exit(0);
+    }
+    
+    close(fd);
+    return pid;
+}
@@ -0,0 +1,87 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IM4_fakeserver_h
+#define IM4_fakeserver_h
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+/*
+ * Minimal stand-in XMPP server for benchmarks
+ *
+ * The server accepts a single client connection on 127.0.0.1 without TLS,
+ * accepts any SASL PLAIN authentication, binds the resource and answers
+ * the roster query. After the roster, the server floods the client
+ * according to the scenario and sends the message "done" from
+ * control@localhost.
+ *
+ * Every flood stanza is sent from contact<n>@localhost/t<ns>, where <ns> is
+ * the CLOCK_MONOTONIC timestamp of the send operation. The first roster item
+ * has the name t<ns>.
+ */
+
+enum FakeServerScenario {
+    FAKESERVER_MESSAGES = 0,
+    FAKESERVER_ROSTER,
+    FAKESERVER_PRESENCE,
+    FAKESERVER_CHATSTATE
+};
+
+typedef struct FakeServerConfig {
+    enum FakeServerScenario scenario;
+    
+    /*
+     * number of flood stanzas
+     */
+    size_t count;
+    
+    /*
+     * stanzas per second, 0: as fast as possible
+     */
+    size_t rate;
+    
+    /*
+     * roster size and number of different senders
+     */
+    size_t contacts;
+    
+    /*
+     * message body size in bytes
+     */
+    size_t bodysize;
+} FakeServerConfig;
+
+/*
+ * starts the server in a child process
+ * returns the pid of the child process or -1 on error
+ * the port of the listening socket is stored in port
+ */
+pid_t fakeserver_start(FakeServerConfig *cfg, unsigned short *port);
+
+#endif /* IM4_fakeserver_h */
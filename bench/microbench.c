@@ -0,0 +1,1345 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * microbench: microbenchmarks for the string and lookup helpers of the core
+ *
+ * Every benchmark is calibrated to run for about the target time and is
+ * repeated several times. The default output is one JSON object per line:
+ *
+ * {"name":"...","ops":<n>,"ns_per_op":<median>,"min_ns_per_op":<min>,"max_ns_per_op":<max>}
+ *
+ * xmpp.c is included to get access to the static helper functions.
+ */
+
+#include "xmpp.c"
+
+#include "bench.h"
+#include "regexreplace.h"
+#include "htmlescape.h"
+#include "utf8.h"
+#include "msgtemplate.h"
+#include "history.h"
+#include "historyreader.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+
+/*
+ * prevents the compiler from optimizing away results
+ */
+static volatile uintptr_t sink;
+
+static xmpp_ctx_t *ctx;
+static Xmpp *xmpp;
+
+static char* repeat_str(const char *str, size_t len) {
+    size_t slen = strlen(str);
+    char *s = malloc(len + 1);
+    for(size_t i=0;i<len;i++) {
+        s[i] = str[i % slen];
+    }
+    s[len] = 0;
+    return s;
+}
+
+// ------------------------- strbuf_append -------------------------
+
+static void bench_strbuf_small(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        StrBuf buf = { malloc(512), 512, 0 };
+        for(int j=0;j<4096;j++) {
+            strbuf_append(&buf, "0123456789abcdef", 16);
+        }
+        sink += (uintptr_t)buf.str[buf.length-1];
+        free(buf.str);
+    }
+}
+
+static char *strbuf_chunk;
+
+static void bench_strbuf_large(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        StrBuf buf = { malloc(512), 512, 0 };
+        for(int j=0;j<16;j++) {
+            strbuf_append(&buf, strbuf_chunk, 65536);
+        }
+        sink += (uintptr_t)buf.str[buf.length-1];
+        free(buf.str);
+    }
+}
+
+// ------------------------- html_stanza2text -------------------------
+
+static xmpp_stanza_t *html_simple;
+static xmpp_stanza_t *html_long;
+static xmpp_stanza_t *html_deep;
+static xmpp_stanza_t *html_many;
+
+static xmpp_stanza_t* parse_html_body(const char *xml) {
+    xmpp_stanza_t *html = xmpp_stanza_new_from_string(ctx, xml);
+    if(!html) {
+        fprintf(stderr, "cannot parse: %.80s\n", xml);
+        exit(1);
+    }
+    return html;
+}
+
+static void html_setup(void) {
+    html_simple = parse_html_body("<body xmlns='http://www.w3.org/1999/xhtml'><p>Hello <b>world</b>, how are <i>you</i>?</p></body>");
+    
+    char *text = repeat_str("Lorem ipsum dolor sit amet, consectetur adipiscing elit. ", 16384);
+    char *xml = NULL;
+    asprintf(&xml, "<body xmlns='http://www.w3.org/1999/xhtml'><p>%s</p></body>", text);
+    html_long = parse_html_body(xml);
+    free(xml);
+    free(text);
+    
+    // 256 nested span elements
+    StrBuf buf = { malloc(512), 512, 0 };
+    const char *start = "<body xmlns='http://www.w3.org/1999/xhtml'>";
+    strbuf_append(&buf, start, strlen(start));
+    for(int i=0;i<256;i++) {
+        strbuf_append(&buf, "<span style='color:red'>x", 25);
+    }
+    for(int i=0;i<256;i++) {
+        strbuf_append(&buf, "</span>", 7);
+    }
+    strbuf_append(&buf, "</body>", 8);
+    html_deep = parse_html_body(buf.str);
+    
+    // 1000 sibling elements
+    buf.length = 0;
+    strbuf_append(&buf, start, strlen(start));
+    for(int i=0;i<1000;i++) {
+        strbuf_append(&buf, "<a href='https://example.com/'>link</a> ", 40);
+    }
+    strbuf_append(&buf, "</body>", 8);
+    html_many = parse_html_body(buf.str);
+    free(buf.str);
+}
+
+static void html_cleanup(void) {
+    xmpp_stanza_release(html_simple);
+    xmpp_stanza_release(html_long);
+    xmpp_stanza_release(html_deep);
+    xmpp_stanza_release(html_many);
+}
+
+static void bench_html(xmpp_stanza_t *html, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *text = html_stanza2text(ctx, html);
+        sink += (uintptr_t)text[0];
+        free(text);
+    }
+}
+
+static void bench_html_simple(size_t n) {
+    bench_html(html_simple, n);
+}
+
+static void bench_html_long(size_t n) {
+    bench_html(html_long, n);
+}
+
+static void bench_html_deep(size_t n) {
+    bench_html(html_deep, n);
+}
+
+static void bench_html_many(size_t n) {
+    bench_html(html_many, n);
+}
+
+// ------------------------- XmppGetSession -------------------------
+
+#define NUM_CONVERSATIONS 10000
+
+static void sessions_setup(void) {
+    char jid[128];
+    for(int i=0;i<NUM_CONVERSATIONS;i++) {
+        snprintf(jid, 128, "contact%d@example.com/resource%d", i, i % 4);
+        XmppGetSession(xmpp, jid);
+        snprintf(jid, 128, "contact%d@example.com/mobile", i);
+        XmppGetSession(xmpp, jid);
+    }
+}
+
+static void bench_session_first(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        sink += (uintptr_t)XmppGetSession(xmpp, "contact0@example.com/resource0");
+    }
+}
+
+static void bench_session_last(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        sink += (uintptr_t)XmppGetSession(xmpp, "contact9999@example.com/mobile");
+    }
+}
+
+static void bench_session_nores(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        sink += (uintptr_t)XmppGetSession(xmpp, "contact5000@example.com");
+    }
+}
+
+static void bench_session_spread(size_t n) {
+    char jid[128];
+    for(size_t i=0;i<n;i++) {
+        snprintf(jid, 128, "contact%d@example.com/mobile", (int)((i * 7919) % NUM_CONVERSATIONS));
+        sink += (uintptr_t)XmppGetSession(xmpp, jid);
+    }
+}
+
+// ------------------------- xmpp_state2str -------------------------
+
+static void bench_state2str(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        sink += (uintptr_t)xmpp_state2str((enum XmppChatstate)(i % 5));
+    }
+}
+
+// ------------------------- str_unescape_and_replace -------------------------
+
+static char *unescape_long;
+
+static void unescape_setup(void) {
+    unescape_long = repeat_str("text \\t $1 \\$1 \\n more text ", 16384);
+}
+
+static void unescape_cleanup(void) {
+    free(unescape_long);
+}
+
+static void bench_unescape_short(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = str_unescape_and_replace("<b>$1</b>", "$1", "capture");
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_unescape_long(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = str_unescape_and_replace(unescape_long, "$1", "capture group");
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+// ------------------------- apply_rule / apply_all_rules -------------------------
+
+static TextReplacementRule rule_literal;
+static TextReplacementRule rule_capture;
+static TextReplacementRule rule_adversarial;
+
+static char *msg_short;
+static char *msg_long;
+static char *msg_matches;
+static char *msg_adversarial;
+
+static void compile_rule(TextReplacementRule *rule, const char *pattern, const char *replacement) {
+    rule->pattern = strdup(pattern);
+    rule->replacement = strdup(replacement);
+    rule->compiled = regcomp(&rule->regex, pattern, REG_EXTENDED) == 0;
+    compile_replacement(rule);
+    if(!rule->compiled) {
+        fprintf(stderr, "cannot compile pattern: %s\n", pattern);
+        exit(1);
+    }
+}
+
+static void free_rule(TextReplacementRule *rule) {
+    free(rule->pattern);
+    free(rule->replacement);
+    free(rule->segments);
+    free(rule->template_text);
+    regfree(&rule->regex);
+}
+
+/*
+ * rules with empty matches, the output is the same as with sed s///g,
+ * except that a multibyte character is skipped as a whole
+ */
+static const struct {
+    const char *pattern;
+    const char *replacement;
+    const char *input;
+    const char *output;
+} empty_match_vectors[] = {
+    { "x*", "-", "abc", "-a-b-c-" },
+    { "x*", "-", "xxa", "-a-" },
+    { "x*", "-", "a\xc3\xa4" "b", "-a-\xc3\xa4-b-" },
+    { "x*", "-", "", "-" },
+    { "^", ">", "ab", ">ab" },
+    { "$", "<", "ab", "ab<" },
+    { "^a", "b", "aaa", "baa" }
+};
+
+static void rules_setup(void) {
+    for(int i=0;i<sizeof(empty_match_vectors)/sizeof(empty_match_vectors[0]);i++) {
+        TextReplacementRule rule;
+        memset(&rule, 0, sizeof(TextReplacementRule));
+        compile_rule(&rule, empty_match_vectors[i].pattern, empty_match_vectors[i].replacement);
+        char *out = apply_rule(strdup(empty_match_vectors[i].input), &rule);
+        if(strcmp(out, empty_match_vectors[i].output)) {
+            fprintf(stderr, "apply_rule: unexpected output for \"%s\" (%s): \"%s\"\n",
+                    empty_match_vectors[i].input, empty_match_vectors[i].pattern, out);
+            exit(1);
+        }
+        free(out);
+        free_rule(&rule);
+    }
+    
+    compile_rule(&rule_literal, "--", "\xe2\x80\x93");
+    compile_rule(&rule_capture, "\\*([a-z]+)\\*", "<b>$1</b>");
+    compile_rule(&rule_adversarial, "(a|aa)+b", "x");
+    
+    msg_short = strdup("Hello, how are you?");
+    msg_long = repeat_str("The quick brown fox jumps over the lazy dog. ", 65536);
+    msg_matches = repeat_str("*bold* -- ", 65536);
+    msg_adversarial = repeat_str("a", 4096);
+    
+    char path[] = "/tmp/microbench.rules.XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    FILE *out = fdopen(fd, "w");
+    fputs("?v1\n", out);
+    fputs("--\t\xe2\x80\x93\n", out);
+    fputs("\\.\\.\\.\t\xe2\x80\xa6\n", out);
+    fputs("\"([^\"]*)\"\t\xe2\x80\x9c$1\xe2\x80\x9d\n", out);
+    fputs("\\*([a-z]+)\\*\t<b>$1</b>\n", out);
+    fputs("_([a-z]+)_\t<i>$1</i>\n", out);
+    fputs(":-?\\)\t\xe2\x98\xba\n", out);
+    fputs("\\(c\\)\t\xc2\xa9\n", out);
+    fputs("->\t\xe2\x86\x92\n", out);
+    fputs("<-\t\xe2\x86\x90\n", out);
+    fputs("\\+-\t\xc2\xb1\n", out);
+    fclose(out);
+    load_rules_config(path);
+    unlink(path);
+}
+
+static void rules_cleanup(void) {
+    free_rule(&rule_literal);
+    free_rule(&rule_capture);
+    free_rule(&rule_adversarial);
+    free(msg_short);
+    free(msg_long);
+    free(msg_matches);
+    free(msg_adversarial);
+}
+
+static void bench_rule(TextReplacementRule *rule, const char *msg, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        // apply_rule takes ownership of the input string
+        char *s = apply_rule(strdup(msg), rule);
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_rule_nomatch_short(size_t n) {
+    bench_rule(&rule_capture, msg_short, n);
+}
+
+static void bench_rule_nomatch_long(size_t n) {
+    bench_rule(&rule_capture, msg_long, n);
+}
+
+static void bench_rule_literal_matches(size_t n) {
+    bench_rule(&rule_literal, msg_matches, n);
+}
+
+static void bench_rule_capture_matches(size_t n) {
+    bench_rule(&rule_capture, msg_matches, n);
+}
+
+static void bench_rule_adversarial(size_t n) {
+    bench_rule(&rule_adversarial, msg_adversarial, n);
+}
+
+static void bench_all_rules(const char *msg, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = strdup(msg);
+        apply_all_rules(&s);
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_all_rules_short(size_t n) {
+    bench_all_rules(msg_short, n);
+}
+
+static void bench_all_rules_long(size_t n) {
+    bench_all_rules(msg_long, n);
+}
+
+static void bench_all_rules_matches(size_t n) {
+    bench_all_rules(msg_matches, n);
+}
+
+// ------------------------- rule set -------------------------
+
+static TextReplacementRule *set_rules;
+static size_t set_nrules;
+static TextReplacementRuleSet *set;
+
+static char *set_msg_short;
+static char *set_msg_long;
+static char *set_msg_matches;
+
+// 4 slow rules, for the time budget
+static TextReplacementRule budget_rules[4];
+static TextReplacementRuleSet *budget_set;
+static char *budget_msg;
+
+static void rule_set_setup(void) {
+    set_msg_short = strdup("Hello, how are you?");
+    set_msg_long = repeat_str("The quick brown fox jumps over the lazy dog. ", 65536);
+    set_msg_matches = repeat_str("&sym42; *bold* -- &sym299; ", 65536);
+    
+    char path[] = "/tmp/microbench.ruleset.XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    FILE *out = fdopen(fd, "w");
+    fputs("?v1\n", out);
+    // 300 literal symbol rules (U+2600 - U+272B)
+    for(int i=0;i<300;i++) {
+        int cp = 0x2600 + i;
+        fprintf(out, "&sym%d;\t%c%c%c\n", i, 0xe0 | (cp >> 12), 0x80 | ((cp >> 6) & 0x3f), 0x80 | (cp & 0x3f));
+    }
+    fputs("--\t\xe2\x80\x93\n", out);
+    fputs("\\.\\.\\.\t\xe2\x80\xa6\n", out);
+    fputs("\"([^\"]*)\"\t\xe2\x80\x9c$1\xe2\x80\x9d\n", out);
+    fputs("\\*([a-z]+)\\*\t<b>$1</b>\n", out);
+    fputs("_([a-z]+)_\t<i>$1</i>\n", out);
+    fputs(":-?\\)\t\xe2\x98\xba\n", out);
+    fputs("\\(c\\)\t\xc2\xa9\n", out);
+    fputs("->\t\xe2\x86\x92\n", out);
+    fputs("<-\t\xe2\x86\x90\n", out);
+    fputs("\\+-\t\xc2\xb1\n", out);
+    fclose(out);
+    load_rules(path, &set_rules, &set_nrules);
+    unlink(path);
+    
+    set = compile_rule_set(set_rules, set_nrules);
+    
+    compile_rule(&budget_rules[0], "(a|aa)+b", "x");
+    compile_rule(&budget_rules[1], "(a|aa)+c", "x");
+    compile_rule(&budget_rules[2], "(a|aa)+d", "x");
+    compile_rule(&budget_rules[3], "(a|aa)+e", "x");
+    budget_set = compile_rule_set(budget_rules, 4);
+    budget_msg = repeat_str("a", 4096);
+}
+
+static void rule_set_cleanup(void) {
+    TextReplacementStats stats;
+    rule_set_stats(set, &stats);
+    size_t total = stats.evaluated + stats.skipped;
+    if(total > 0) {
+        fprintf(stderr, "apply_rule_set: %zu messages, %zu regex rules evaluated, %zu skipped (%.1f%%)\n",
+                stats.messages,
+                stats.evaluated,
+                stats.skipped,
+                100.0 * stats.skipped / total);
+    }
+    if(stats.messages > 0) {
+        print_rule_set_profile(stderr, set, 5);
+    }
+    
+    free_rule_set(set);
+    free_rule_set(budget_set);
+    for(int i=0;i<4;i++) {
+        free_rule(&budget_rules[i]);
+    }
+    free(budget_msg);
+    free_rules(set_rules, set_nrules);
+    free(set_msg_short);
+    free(set_msg_long);
+    free(set_msg_matches);
+}
+
+static void bench_sequential(const char *msg, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = strdup(msg);
+        apply_rules_sequential(set_rules, set_nrules, &s);
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_rule_set(const char *msg, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = strdup(msg);
+        apply_rule_set(set, &s);
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_budget(uint64_t budget_ns, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        char *s = strdup(budget_msg);
+        apply_rule_set_budget(budget_set, &s, budget_ns, TEXT_REPLACEMENT_BUDGET_SKIP);
+        sink += (uintptr_t)s[0];
+        free(s);
+    }
+}
+
+static void bench_sequential_short(size_t n) {
+    bench_sequential(set_msg_short, n);
+}
+
+static void bench_sequential_long(size_t n) {
+    bench_sequential(set_msg_long, n);
+}
+
+static void bench_sequential_matches(size_t n) {
+    bench_sequential(set_msg_matches, n);
+}
+
+static void bench_rule_set_short(size_t n) {
+    bench_rule_set(set_msg_short, n);
+}
+
+static void bench_rule_set_long(size_t n) {
+    bench_rule_set(set_msg_long, n);
+}
+
+static void bench_rule_set_matches(size_t n) {
+    bench_rule_set(set_msg_matches, n);
+}
+
+static void bench_budget_none(size_t n) {
+    bench_budget(0, n);
+}
+
+static void bench_budget_1ms(size_t n) {
+    bench_budget(1000000, n);
+}
+
+// ------------------------- html_escape / html_linkify -------------------------
+
+static char *escape_text;
+static char *escape_urls;
+
+/*
+ * output of the previous NSString implementation (escape_input and
+ * convert_urls_to_links in ConversationWindowController.m)
+ */
+static const struct {
+    const char *input;
+    bool escape;
+    const char *output;
+} linkify_vectors[] = {
+    { "<>&\"'", true, "&lt;&gt;&amp;&quot;&#39;" },
+    { "a<b & c", false, "a<b & c" },
+    { "https://example.org", true, "<a href=\"https://example.org\">https://example.org</a>" },
+    { "see https://example.org/x and http://im4.example", true,
+      "see <a href=\"https://example.org/x\">https://example.org/x</a> and <a href=\"http://im4.example\">http://im4.example</a>" },
+    { "go to https://example.org/path.", true, "go to <a href=\"https://example.org/path.\">https://example.org/path.</a>" },
+    { "(https://example.org), ok", true, "(<a href=\"https://example.org),\">https://example.org),</a> ok" },
+    { "http://a.bc https://ab.c", true, "http://a.bc https://ab.c" },
+    { "https://ab.cd/p\xc2\xa0x", true, "<a href=\"https://ab.cd/p\">https://ab.cd/p</a>\xc2\xa0x" },
+    { "gr\xc3\xbc\xc3\x9f https://b\xc3\xbc\x63her.de/\xc3\xa4 ok", true,
+      "gr\xc3\xbc\xc3\x9f <a href=\"https://b\xc3\xbc\x63her.de/\xc3\xa4\">https://b\xc3\xbc\x63her.de/\xc3\xa4</a> ok" },
+    { "https://\xe4\xbe\x8b\xe3\x81\x88.\xe3\x83\x86\xe3\x82\xb9", true,
+      "<a href=\"https://\xe4\xbe\x8b\xe3\x81\x88.\xe3\x83\x86\xe3\x82\xb9\">https://\xe4\xbe\x8b\xe3\x81\x88.\xe3\x83\x86\xe3\x82\xb9</a>" },
+    // characters outside of the BMP are not part of the host
+    { "https://\xf0\x9f\x98\x80\xf0\x9f\x98\x80.com", true, "https://\xf0\x9f\x98\x80\xf0\x9f\x98\x80.com" },
+    { "https://a\xf0\x9f\x98\x80.com", true, "https://a\xf0\x9f\x98\x80.com" },
+    { "https://ab.cd\xf0\x9f\x98\x80 x", true, "<a href=\"https://ab.cd\xf0\x9f\x98\x80\">https://ab.cd\xf0\x9f\x98\x80</a> x" },
+    { "<i>https://ab.cd</i>", false, "<i><a href=\"https://ab.cd</i>\">https://ab.cd</i></a>" },
+    // the previous implementation wrote the href unescaped:
+    // &lt;b&gt;<a href="https://ab.cd/?a&b">https://ab.cd/?a&amp;b</a>
+    { "<b>https://ab.cd/?a&b", true, "&lt;b&gt;<a href=\"https://ab.cd/?a&amp;b\">https://ab.cd/?a&amp;b</a>" },
+};
+
+static void escape_setup(void) {
+    escape_text = repeat_str("plain text with some <b>markup</b> & \"quotes\" in it, ", 65536);
+    escape_urls = repeat_str("see https://example.org/a?b=1&c=2 and http://im4.example/x ", 65536);
+    
+    // the vectorized and the scalar implementation must produce the same output
+    const char *inputs[] = { escape_text, escape_urls, "http://ab.cd", "<>&\"'", "" };
+    for(int i=0;i<5;i++) {
+        size_t len = strlen(inputs[i]);
+        for(int escape=0;escape<2;escape++) {
+            html_escape_use_simd(true);
+            char *s1 = html_linkify(inputs[i], len, escape, NULL);
+            html_escape_use_simd(false);
+            char *s2 = html_linkify(inputs[i], len, escape, NULL);
+            if(strcmp(s1, s2)) {
+                fprintf(stderr, "html_linkify: simd output differs from scalar output\n");
+                exit(1);
+            }
+            free(s1);
+            free(s2);
+        }
+    }
+    
+    for(int i=0;i<sizeof(linkify_vectors)/sizeof(linkify_vectors[0]);i++) {
+        for(int simd=0;simd<2;simd++) {
+            html_escape_use_simd(simd);
+            const char *in = linkify_vectors[i].input;
+            char *out = html_linkify(in, strlen(in), linkify_vectors[i].escape, NULL);
+            if(strcmp(out, linkify_vectors[i].output)) {
+                fprintf(stderr, "html_linkify: unexpected output for \"%s\": \"%s\"\n", in, out);
+                exit(1);
+            }
+            free(out);
+        }
+    }
+    html_escape_use_simd(true);
+}
+
+static void escape_cleanup(void) {
+    free(escape_text);
+    free(escape_urls);
+    html_escape_use_simd(true);
+}
+
+static void bench_escape(const char *str, bool simd, size_t n) {
+    html_escape_use_simd(simd);
+    size_t len = strlen(str);
+    for(size_t i=0;i<n;i++) {
+        char *out = malloc(html_escape_size(str, len));
+        sink += html_escape(out, str, len);
+        free(out);
+    }
+}
+
+static void bench_linkify(const char *str, bool simd, size_t n) {
+    html_escape_use_simd(simd);
+    size_t len = strlen(str);
+    for(size_t i=0;i<n;i++) {
+        size_t outlen;
+        char *out = html_linkify(str, len, true, &outlen);
+        sink += outlen;
+        free(out);
+    }
+}
+
+static void bench_escape_short(size_t n) {
+    bench_escape("hello <b>world</b>", true, n);
+}
+
+static void bench_escape_long(size_t n) {
+    bench_escape(escape_text, true, n);
+}
+
+static void bench_escape_long_scalar(size_t n) {
+    bench_escape(escape_text, false, n);
+}
+
+static void bench_linkify_long(size_t n) {
+    bench_linkify(escape_text, true, n);
+}
+
+static void bench_linkify_long_scalar(size_t n) {
+    bench_linkify(escape_text, false, n);
+}
+
+static void bench_linkify_urls(size_t n) {
+    bench_linkify(escape_urls, true, n);
+}
+
+static void bench_linkify_urls_scalar(size_t n) {
+    bench_linkify(escape_urls, false, n);
+}
+
+// ------------------------- utf8_validate / utf8_repair -------------------------
+
+#define UTF8_BENCH_SIZE (1024 * 1024)
+
+static char *utf8_ascii;
+static char *utf8_mixed;
+static char *utf8_invalid;
+
+static void utf8_setup(void) {
+    utf8_ascii = repeat_str("plain ascii text, ", UTF8_BENCH_SIZE);
+    // repeat_str must not cut a sequence
+    const char *mixed = "h\xc3\xa9llo w\xc3\xb6rld \xe2\x82\xac \xf0\x9f\x94\x92 ";
+    size_t mixed_len = strlen(mixed);
+    utf8_mixed = repeat_str(mixed, UTF8_BENCH_SIZE / mixed_len * mixed_len);
+    utf8_invalid = repeat_str("text \xc3\x28 \xed\xa0\x80 \xf0\x9f\x94 ", 65536);
+    
+    // the vectorized and the scalar implementation must have the same result
+    char *inputs[] = { utf8_ascii, utf8_mixed, utf8_invalid };
+    for(int i=0;i<3;i++) {
+        size_t len = strlen(inputs[i]);
+        utf8_use_simd(true);
+        bool r1 = utf8_validate(inputs[i], len);
+        utf8_use_simd(false);
+        bool r2 = utf8_validate(inputs[i], len);
+        if(r1 != r2 || r1 != (i < 2)) {
+            fprintf(stderr, "utf8_validate: wrong result\n");
+            exit(1);
+        }
+    }
+}
+
+static void utf8_cleanup(void) {
+    free(utf8_ascii);
+    free(utf8_mixed);
+    free(utf8_invalid);
+    utf8_use_simd(true);
+}
+
+static void bench_utf8(const char *str, bool simd, size_t n) {
+    utf8_use_simd(simd);
+    size_t len = strlen(str);
+    for(size_t i=0;i<n;i++) {
+        sink += utf8_validate(str, len);
+    }
+}
+
+static void bench_utf8_ascii(size_t n) {
+    bench_utf8(utf8_ascii, true, n);
+}
+
+static void bench_utf8_ascii_scalar(size_t n) {
+    bench_utf8(utf8_ascii, false, n);
+}
+
+static void bench_utf8_mixed(size_t n) {
+    bench_utf8(utf8_mixed, true, n);
+}
+
+static void bench_utf8_mixed_scalar(size_t n) {
+    bench_utf8(utf8_mixed, false, n);
+}
+
+static void bench_utf8_repair(size_t n) {
+    size_t len = strlen(utf8_invalid);
+    for(size_t i=0;i<n;i++) {
+        size_t outlen;
+        char *s = utf8_repair(utf8_invalid, len, &outlen);
+        sink += outlen;
+        free(s);
+    }
+}
+
+// ------------------------- msg_template -------------------------
+
+#define CONVERSATION_SIZE 10000
+
+static char **conversation;
+static MsgTemplate *tpl_prefix;
+static MsgTemplate *tpl_html;
+
+static const char *tpl_prefix_format = "< %s(%t) %a: ";
+static const char *tpl_html_format = "<div class=\"in\"><b>%a</b> <i>%x</i> %s <span>%t</span><p>%m</p></div>";
+
+static void msg_template_setup(void) {
+    conversation = malloc(CONVERSATION_SIZE * sizeof(char*));
+    for(int i=0;i<CONVERSATION_SIZE;i++) {
+        // 16 - 1024 bytes
+        conversation[i] = repeat_str("message text &amp; more ", 16 + (i * 7919) % 1009);
+    }
+    tpl_prefix = msg_template_compile(NULL, tpl_prefix_format, "red", "\xf0\x9f\x94\x92", "");
+    tpl_html = msg_template_compile(tpl_html_format, NULL, "red", "\xf0\x9f\x94\x92", "");
+}
+
+static void msg_template_cleanup(void) {
+    for(int i=0;i<CONVERSATION_SIZE;i++) {
+        free(conversation[i]);
+    }
+    free(conversation);
+    msg_template_free(tpl_prefix);
+    msg_template_free(tpl_html);
+}
+
+/*
+ * the previous implementation: the format is scanned for every message
+ */
+static void format_scan(StrBuf *buf, const char *format, const char *time, const char *message) {
+    bool placeholder = false;
+    for(const char *f=format;*f;f++) {
+        char c = *f;
+        if(placeholder) {
+            switch(c) {
+                case 't': strbuf_append(buf, time, strlen(time)); break;
+                case 'x': strbuf_append(buf, "alice@example.org", 17); break;
+                case 'a': strbuf_append(buf, "Alice", 5); break;
+                case 's': strbuf_append(buf, "\xf0\x9f\x94\x92", 4); break;
+                case 'm': strbuf_append(buf, message, strlen(message)); break;
+                default: strbuf_append(buf, &c, 1); break;
+            }
+            placeholder = false;
+        } else if(c == '%') {
+            placeholder = true;
+        } else {
+            strbuf_append(buf, &c, 1);
+        }
+    }
+}
+
+static void bench_template_render(MsgTemplate *tpl, size_t n) {
+    char time_str[16];
+    msg_template_time(time_str);
+    for(size_t i=0;i<n;i++) {
+        MsgTemplateValues values = { time_str, "alice@example.org", "Alice", true, conversation[i % CONVERSATION_SIZE] };
+        size_t len;
+        char *entry = msg_template_render(tpl, &values, &len);
+        sink += len;
+        free(entry);
+    }
+}
+
+static void bench_template_scan(const char *format, size_t n) {
+    char time_str[16];
+    msg_template_time(time_str);
+    for(size_t i=0;i<n;i++) {
+        StrBuf buf = { malloc(256), 256, 0 };
+        format_scan(&buf, format, time_str, conversation[i % CONVERSATION_SIZE]);
+        sink += buf.length;
+        free(buf.str);
+    }
+}
+
+static void bench_template_compile(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        MsgTemplate *tpl = msg_template_compile(tpl_html_format, NULL, "red", "\xf0\x9f\x94\x92", "");
+        sink += tpl->nsegments;
+        msg_template_free(tpl);
+    }
+}
+
+static void bench_template_prefix(size_t n) {
+    bench_template_render(tpl_prefix, n);
+}
+
+static void bench_template_html(size_t n) {
+    bench_template_render(tpl_html, n);
+}
+
+static void bench_template_html_scan(size_t n) {
+    bench_template_scan(tpl_html_format, n);
+}
+
+// ------------------------- history -------------------------
+
+static char history_dir[] = "/tmp/im4-history-XXXXXX";
+static HistoryStore *history;
+static char *history_msg;
+
+static void history_setup(void) {
+    if(!mkdtemp(history_dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    history = history_open(history_dir);
+    history_msg = repeat_str("message text &amp; more ", 200);
+}
+
+static void history_cleanup(void) {
+    history_close(history);
+    free(history_msg);
+    
+    DIR *dir = opendir(history_dir);
+    if(dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            if(ent->d_name[0] != '.') {
+                char path[256];
+                snprintf(path, sizeof(path), "%s/%s", history_dir, ent->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(history_dir);
+}
+
+/*
+ * n messages, committed together
+ */
+static void bench_history_batch(size_t n) {
+    int64_t now = history_now();
+    for(size_t i=0;i<n;i++) {
+        history_append(history, i % 16 ? "alice@example.org" : "bob@example.org", now, 0, history_msg, 200);
+    }
+    history_flush(history);
+}
+
+/*
+ * waits for the commit of every message (one sync per message)
+ */
+static void bench_history_single(size_t n) {
+    int64_t now = history_now();
+    for(size_t i=0;i<n;i++) {
+        history_append(history, "alice@example.org", now, 0, history_msg, 200);
+        history_flush(history);
+    }
+}
+
+// ------------------------- history_reader -------------------------
+
+#define HISTORY_READER_SIZE 1000000
+
+static char reader_dir[] = "/tmp/im4-history-reader-XXXXXX";
+static HistoryReader *reader;
+static size_t reader_count;
+
+static void history_reader_setup(void) {
+    if(!mkdtemp(reader_dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    HistoryStore *h = history_open(reader_dir);
+    char msg[128];
+    for(int i=0;i<HISTORY_READER_SIZE;i++) {
+        int len = snprintf(msg, sizeof(msg), "message %d: text &amp; <a href=\"https://example.org\">link</a>", i);
+        history_append(h, "alice@example.org", 1000 * (int64_t)i, i % 2 ? HISTORY_OUT : 0, msg, len);
+    }
+    history_close(h);
+    
+    reader = history_reader_open(reader_dir, "alice@example.org");
+    reader_count = history_reader_count(reader);
+    if(reader_count != HISTORY_READER_SIZE) {
+        fprintf(stderr, "history_reader: %zu messages, expected %d\n", reader_count, HISTORY_READER_SIZE);
+        exit(1);
+    }
+}
+
+static void history_reader_cleanup(void) {
+    history_reader_close(reader);
+    
+    DIR *dir = opendir(reader_dir);
+    if(dir) {
+        struct dirent *ent;
+        while((ent = readdir(dir)) != NULL) {
+            if(ent->d_name[0] != '.') {
+                char path[256];
+                snprintf(path, sizeof(path), "%s/%s", reader_dir, ent->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(reader_dir);
+}
+
+/*
+ * removes the history files from the page cache
+ */
+static void history_reader_evict(void) {
+#ifdef POSIX_FADV_DONTNEED
+    const char *files[] = { HISTORY_LOG_FILE, HISTORY_JIDS_FILE, "0" HISTORY_INDEX_SUFFIX };
+    for(int i=0;i<3;i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s", reader_dir, files[i]);
+        int fd = open(path, O_RDONLY);
+        if(fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+#endif
+}
+
+/*
+ * open a conversation window: open the reader and read the last page
+ */
+static void history_reader_open_last(bool cold, size_t n) {
+    HistoryMessage page[50];
+    for(size_t i=0;i<n;i++) {
+        if(cold) {
+            history_reader_evict();
+        }
+        HistoryReader *r = history_reader_open(reader_dir, "alice@example.org");
+        size_t count = history_reader_count(r);
+        sink += history_reader_page(r, count - 50, 50, page);
+        sink += page[0].length;
+        history_reader_close(r);
+    }
+}
+
+static void bench_reader_open(size_t n) {
+    history_reader_open_last(false, n);
+}
+
+static void bench_reader_open_cold(size_t n) {
+    history_reader_open_last(true, n);
+}
+
+static void bench_reader_page(size_t n) {
+    HistoryMessage page[50];
+    for(size_t i=0;i<n;i++) {
+        sink += history_reader_page(reader, (i * 7919) % (reader_count - 50), 50, page);
+        sink += page[0].length;
+    }
+}
+
+static void bench_reader_find(size_t n) {
+    for(size_t i=0;i<n;i++) {
+        sink += history_reader_find(reader, 1000 * (int64_t)((i * 7919) % reader_count));
+    }
+}
+
+// ------------------------- pipeline_process -------------------------
+
+static char *pipeline_plain_long;
+static TextReplacementScope pipeline_scope;
+static char *pipeline_html_long;
+
+static void pipeline_setup(void) {
+    pipeline_plain_long = repeat_str("see https://example.org/a?b=1&c=2 <now>\r\n", 16384);
+    pipeline_html_long = repeat_str("<b>bold</b> text &amp; more ", 16384);
+    pipeline_set_alias("alice@example.org", "Alice");
+}
+
+static void pipeline_cleanup(void) {
+    free(pipeline_plain_long);
+    free(pipeline_html_long);
+    pipeline_set_alias("alice@example.org", NULL);
+}
+
+static void bench_pipeline(const char *msg, bool html, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        InboundMessage *m = pipeline_process("alice@example.org/res", &pipeline_scope, msg, html, false, 0, 0);
+        sink += (uintptr_t)m->html[0];
+        pipeline_message_free(m);
+    }
+}
+
+static void bench_pipeline_short(size_t n) {
+    bench_pipeline("hello, how are you?", false, n);
+}
+
+static void bench_pipeline_plain_long(size_t n) {
+    bench_pipeline(pipeline_plain_long, false, n);
+}
+
+static void bench_pipeline_html_long(size_t n) {
+    bench_pipeline(pipeline_html_long, true, n);
+}
+
+// ------------------------- roster -------------------------
+
+static xmpp_stanza_t *roster_small;
+static xmpp_stanza_t *roster_large;
+
+static xmpp_stanza_t* create_roster(int ncontacts) {
+    StrBuf buf = { malloc(512), 512, 0 };
+    const char *start = "<iq type='result' id='roster'><query xmlns='jabber:iq:roster'>";
+    strbuf_append(&buf, start, strlen(start));
+    char item[256];
+    for(int i=0;i<ncontacts;i++) {
+        int len = snprintf(item, 256, "<item jid='contact%d@example.com' name='Contact %d' subscription='both'><group>Group %d</group></item>", i, i, i % 16);
+        strbuf_append(&buf, item, len);
+    }
+    const char *end = "</query></iq>";
+    strbuf_append(&buf, end, strlen(end) + 1);
+    
+    xmpp_stanza_t *iq = xmpp_stanza_new_from_string(ctx, buf.str);
+    free(buf.str);
+    if(!iq) {
+        fprintf(stderr, "cannot parse roster\n");
+        exit(1);
+    }
+    return iq;
+}
+
+static void roster_setup(void) {
+    roster_small = create_roster(50);
+    roster_large = create_roster(10000);
+}
+
+static void roster_cleanup(void) {
+    xmpp_stanza_release(roster_small);
+    xmpp_stanza_release(roster_large);
+}
+
+static void bench_roster(xmpp_stanza_t *roster, size_t n) {
+    for(size_t i=0;i<n;i++) {
+        // query_roster_cb frees the query object
+        XmppQuery *xquery = malloc(sizeof(XmppQuery));
+        xquery->xmpp = xmpp;
+        xquery->id = strdup("roster");
+        query_roster_cb(NULL, roster, xquery);
+    }
+}
+
+static void bench_roster_small(size_t n) {
+    bench_roster(roster_small, n);
+}
+
+static void bench_roster_large(size_t n) {
+    bench_roster(roster_large, n);
+}
+
+// ------------------------- runner -------------------------
+
+typedef struct MicroBench {
+    const char *name;
+    void (*run)(size_t n);
+} MicroBench;
+
+typedef struct MicroBenchGroup {
+    void (*setup)(void);
+    void (*cleanup)(void);
+    MicroBench benchmarks[8];
+} MicroBenchGroup;
+
+static MicroBenchGroup groups[] = {
+    { NULL, NULL, {
+        { "strbuf_append/16b-x4096", bench_strbuf_small },
+        { "strbuf_append/64k-x16", bench_strbuf_large },
+        { NULL, NULL } } },
+    { html_setup, html_cleanup, {
+        { "html_stanza2text/simple", bench_html_simple },
+        { "html_stanza2text/long-16k", bench_html_long },
+        { "html_stanza2text/deep-256", bench_html_deep },
+        { "html_stanza2text/siblings-1000", bench_html_many },
+        { NULL, NULL } } },
+    { sessions_setup, NULL, {
+        { "XmppGetSession/10k-first", bench_session_first },
+        { "XmppGetSession/10k-last", bench_session_last },
+        { "XmppGetSession/10k-noresource", bench_session_nores },
+        { "XmppGetSession/10k-spread", bench_session_spread },
+        { NULL, NULL } } },
+    { NULL, NULL, {
+        { "xmpp_state2str/cycle", bench_state2str },
+        { NULL, NULL } } },
+    { unescape_setup, unescape_cleanup, {
+        { "str_unescape_and_replace/short", bench_unescape_short },
+        { "str_unescape_and_replace/long-16k", bench_unescape_long },
+        { NULL, NULL } } },
+    { rules_setup, rules_cleanup, {
+        { "apply_rule/nomatch-short", bench_rule_nomatch_short },
+        { "apply_rule/nomatch-64k", bench_rule_nomatch_long },
+        { "apply_rule/literal-matches-64k", bench_rule_literal_matches },
+        { "apply_rule/capture-matches-64k", bench_rule_capture_matches },
+        { "apply_rule/adversarial-4k", bench_rule_adversarial },
+        { "apply_all_rules/short", bench_all_rules_short },
+        { "apply_all_rules/64k", bench_all_rules_long },
+        { "apply_all_rules/matches-64k", bench_all_rules_matches } } },
+    { rule_set_setup, rule_set_cleanup, {
+        { "apply_rules_sequential/310-short", bench_sequential_short },
+        { "apply_rules_sequential/310-64k", bench_sequential_long },
+        { "apply_rules_sequential/310-matches-64k", bench_sequential_matches },
+        { "apply_rule_set/310-short", bench_rule_set_short },
+        { "apply_rule_set/310-64k", bench_rule_set_long },
+        { "apply_rule_set/310-matches-64k", bench_rule_set_matches },
+        { "apply_rule_set/4-adversarial-4k", bench_budget_none },
+        { "apply_rule_set/4-adversarial-4k-budget-1ms", bench_budget_1ms } } },
+    { escape_setup, escape_cleanup, {
+        { "html_escape/short", bench_escape_short },
+        { "html_escape/64k", bench_escape_long },
+        { "html_escape/64k-scalar", bench_escape_long_scalar },
+        { "html_linkify/64k", bench_linkify_long },
+        { "html_linkify/64k-scalar", bench_linkify_long_scalar },
+        { "html_linkify/urls-64k", bench_linkify_urls },
+        { "html_linkify/urls-64k-scalar", bench_linkify_urls_scalar },
+        { NULL, NULL } } },
+    { utf8_setup, utf8_cleanup, {
+        { "utf8_validate/ascii-1m", bench_utf8_ascii },
+        { "utf8_validate/ascii-1m-scalar", bench_utf8_ascii_scalar },
+        { "utf8_validate/mixed-1m", bench_utf8_mixed },
+        { "utf8_validate/mixed-1m-scalar", bench_utf8_mixed_scalar },
+        { "utf8_repair/invalid-64k", bench_utf8_repair },
+        { NULL, NULL } } },
+    { msg_template_setup, msg_template_cleanup, {
+        { "msg_template_compile/html", bench_template_compile },
+        { "msg_template_render/prefix-10k-conversation", bench_template_prefix },
+        { "msg_template_render/html-10k-conversation", bench_template_html },
+        { "msg_template_render/html-10k-conversation-scan", bench_template_html_scan },
+        { NULL, NULL } } },
+    { history_setup, history_cleanup, {
+        { "history_append/batch", bench_history_batch },
+        { "history_append/flush-each", bench_history_single },
+        { NULL, NULL } } },
+    { history_reader_setup, history_reader_cleanup, {
+        { "history_reader_open/1m-last-50", bench_reader_open },
+        { "history_reader_open/1m-last-50-cold", bench_reader_open_cold },
+        { "history_reader_page/1m-50", bench_reader_page },
+        { "history_reader_find/1m", bench_reader_find },
+        { NULL, NULL } } },
+    { pipeline_setup, pipeline_cleanup, {
+        { "pipeline_process/short", bench_pipeline_short },
+        { "pipeline_process/plain-urls-16k", bench_pipeline_plain_long },
+        { "pipeline_process/html-16k", bench_pipeline_html_long },
+        { NULL, NULL } } },
+    { roster_setup, roster_cleanup, {
+        { "query_roster_cb/50", bench_roster_small },
+        { "query_roster_cb/10k", bench_roster_large },
+        { NULL, NULL } } }
+};
+
+#define NUM_GROUPS (sizeof(groups) / sizeof(MicroBenchGroup))
+#define MAX_BENCHMARKS (sizeof(groups[0].benchmarks) / sizeof(MicroBench))
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void run_benchmark(FILE *out, MicroBench *bench, uint64_t target, int repeat, int text) {
+    // calibrate the number of operations
+    size_t n = 1;
+    uint64_t elapsed = 0;
+    for(;;) {
+        uint64_t start = bench_time();
+        bench->run(n);
+        elapsed = bench_time() - start;
+        if(elapsed >= target / 10 || n >= ((size_t)1 << 40)) {
+            break;
+        }
+        n *= 2;
+    }
+    if(elapsed > 0 && elapsed < target) {
+        n = (size_t)((double)n * target / elapsed);
+    }
+    if(n == 0) {
+        n = 1;
+    }
+    
+    double *results = calloc(repeat, sizeof(double));
+    for(int i=0;i<repeat;i++) {
+        uint64_t start = bench_time();
+        bench->run(n);
+        results[i] = (double)(bench_time() - start) / n;
+    }
+    qsort(results, repeat, sizeof(double), cmp_double);
+    
+    double median = results[repeat / 2];
+    if(text) {
+        fprintf(out, "%-36s %12zu %14.1f %14.1f %14.1f\n", bench->name, n, median, results[0], results[repeat-1]);
+    } else {
+        fprintf(out, "{\"name\":\"%s\",\"ops\":%zu,\"ns_per_op\":%.1f,\"min_ns_per_op\":%.1f,\"max_ns_per_op\":%.1f}\n", bench->name, n, median, results[0], results[repeat-1]);
+    }
+    fflush(out);
+    free(results);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f filter] [-t ms] [-r repeat] [-l] [-h]\n\n", prog);
+    fprintf(stderr, "  -f filter  run only benchmarks containing filter in their name\n");
+    fprintf(stderr, "  -t ms      target time per run (default: 200)\n");
+    fprintf(stderr, "  -r repeat  number of runs (default: 5)\n");
+    fprintf(stderr, "  -T         human-readable output instead of JSON lines\n");
+    fprintf(stderr, "  -l         list benchmarks\n");
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    uint64_t target = 200;
+    int repeat = 5;
+    int text = 0;
+    int list = 0;
+    
+    int c;
+    while((c = getopt(argc, argv, "f:t:r:Tlh")) != -1) {
+        switch(c) {
+            case 'f': filter = optarg; break;
+            case 't': target = strtoull(optarg, NULL, 10); break;
+            case 'r': repeat = atoi(optarg); break;
+            case 'T': text = 1; break;
+            case 'l': list = 1; break;
+            default: {
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+            }
+        }
+    }
+    if(repeat < 1) {
+        repeat = 1;
+    }
+    target *= 1000000;
+    
+    if(list) {
+        for(int g=0;g<NUM_GROUPS;g++) {
+            for(int i=0;i<MAX_BENCHMARKS && groups[g].benchmarks[i].name;i++) {
+                printf("%s\n", groups[g].benchmarks[i].name);
+            }
+        }
+        return 0;
+    }
+    
+    // query_roster_cb prints every contact to stdout
+    int report = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if(report < 0 || devnull < 0) {
+        perror("open");
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    FILE *out = fdopen(report, "w");
+    
+    xmpp_initialize();
+    XmppSetLogLevel(XMPP_LEVEL_ERROR);
+    
+    // no jid: XmppCreate doesn't load the otr files
+    XmppSettings settings = {0};
+    xmpp = XmppCreate(settings);
+    ctx = xmpp->ctx;
+    
+    if(text) {
+        fprintf(out, "%-36s %12s %14s %14s %14s\n", "benchmark", "ops", "ns/op", "min ns/op", "max ns/op");
+    }
+    
+    for(int g=0;g<NUM_GROUPS;g++) {
+        MicroBenchGroup *group = &groups[g];
+        
+        int run = 0;
+        for(int i=0;i<MAX_BENCHMARKS && group->benchmarks[i].name;i++) {
+            if(!filter || strstr(group->benchmarks[i].name, filter)) {
+                run = 1;
+            }
+        }
+        if(!run) {
+            continue;
+        }
+        
+        if(group->setup) {
+            group->setup();
+        }
+        for(int i=0;i<MAX_BENCHMARKS && group->benchmarks[i].name;i++) {
+            MicroBench *bench = &group->benchmarks[i];
+            if(!filter || strstr(bench->name, filter)) {
+                run_benchmark(out, bench, target, repeat, text);
+            }
+        }
+        if(group->cleanup) {
+            group->cleanup();
+        }
+    }
+    
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,634 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * otrbench: benchmark of the otr module
+ *
+ * Two Xmpp endpoints, local and remote, run otr.c in this process without
+ * a server. Xmpp_Send, which is called by otr_inject_message and the otr
+ * send functions, delivers the messages of one endpoint to the other.
+ * xmpp.c is not used: XmppCall queues the callbacks to the main loop of
+ * this program, which is the xmpp thread of both endpoints.
+ *
+ * Peer i is "peer<i>@localhost" for the local endpoint and
+ * "local<i>@localhost" for the remote endpoint, so both endpoints have one
+ * otr session per peer. Both accounts use the same private key.
+ *
+ * Measurements of the local endpoint:
+ *   - AKE latency, one handshake after another
+ *   - AKE throughput, all handshakes at once
+ *   - malloc heap per ConnContext
+ *   - decrypt and encrypt throughput per message size
+ */
+
+#include "bench.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <gcrypt.h>
+#include <libotr/proto.h>
+#include <libotr/message.h>
+#include <libotr/privkey.h>
+#include <libotr/instag.h>
+
+#include "xmpp.h"
+#include "otr.h"
+#include "otrdh.h"
+#include "otrpool.h"
+#include "app.h"
+#include "watchdog.h"
+#include "monotime.h"
+
+#define LOCAL_JID  "local@localhost"
+#define REMOTE_JID "remote@localhost"
+
+#define DEFAULT_SIZES "64,1024,16384"
+
+typedef struct BenchCall BenchCall;
+struct BenchCall {
+    Xmpp *xmpp;
+    xmpp_callback_func callback;
+    void *userdata;
+    BenchCall *next;
+};
+
+typedef struct PeerMsg {
+    char *from;
+    char *message;
+} PeerMsg;
+
+typedef struct Captured {
+    size_t peer;
+    char *message;
+} Captured;
+
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  loop_cond = PTHREAD_COND_INITIALIZER;
+static BenchCall *calls_begin;
+static BenchCall *calls_end;
+
+static Xmpp *local;
+static Xmpp *remote;
+
+/*
+ * local_peers[i]: name of peer i for the local endpoint
+ * remote_peers[i]: name of peer i for the remote endpoint
+ */
+static char **local_peers;
+static char **remote_peers;
+static size_t npeers;
+
+static int verbose;
+
+/*
+ * deliver messages of the local endpoint to the remote endpoint
+ */
+static int loopback = 1;
+
+/*
+ * store the messages of the remote endpoint in captured instead of
+ * delivering them
+ */
+static int capture;
+static Captured *captured;
+static size_t ncaptured;
+static size_t captured_alloc;
+static uint64_t captured_msgs;
+
+/*
+ * messages sent by the local endpoint, a fragmented message is counted once
+ */
+static uint64_t sent;
+
+/*
+ * Xmpp_Send calls of the local endpoint
+ */
+static uint64_t stanzas;
+
+// ------------------------- xmpp.c replacement -------------------------
+
+void XmppCall(Xmpp *xmpp, xmpp_callback_func cb, void *userdata) {
+    BenchCall *call = malloc(sizeof(BenchCall));
+    call->xmpp = xmpp;
+    call->callback = cb;
+    call->userdata = userdata;
+    call->next = NULL;
+    
+    pthread_mutex_lock(&loop_lock);
+    if(calls_end) {
+        calls_end->next = call;
+    } else {
+        calls_begin = call;
+    }
+    calls_end = call;
+    pthread_cond_signal(&loop_cond);
+    pthread_mutex_unlock(&loop_lock);
+}
+
+void XmppLog(const char *str) {
+    if(verbose) {
+        fputs(str, stderr);
+    }
+}
+
+static void deliver_cb(Xmpp *xmpp, void *userdata) {
+    PeerMsg *msg = userdata;
+    otr_receive_message(xmpp, msg->from, msg->message);
+    free(msg->from);
+    free(msg->message);
+    free(msg);
+}
+
+/*
+ * passes a message to the other endpoint in the next loop iteration
+ */
+static void deliver(Xmpp *to, const char *from, const char *message) {
+    PeerMsg *msg = malloc(sizeof(PeerMsg));
+    msg->from = strdup(from);
+    msg->message = strdup(message);
+    XmppCall(to, deliver_cb, msg);
+}
+
+/*
+ * returns true, if message is not the last fragment of a message
+ */
+static int is_partial_fragment(const char *message) {
+    unsigned int sender, receiver;
+    unsigned short k, n;
+    if(sscanf(message, "?OTR|%x|%x,%hu,%hu,", &sender, &receiver, &k, &n) == 4) {
+        return k < n;
+    }
+    return 0;
+}
+
+static size_t peer_index(const char *jid, const char *prefix) {
+    return strtoull(jid + strlen(prefix), NULL, 10) % (npeers * 2);
+}
+
+void Xmpp_Send(Xmpp *xmpp, const char *to, const char *message) {
+    if(xmpp == local) {
+        stanzas++;
+        if(!is_partial_fragment(message)) {
+            sent++;
+        }
+        if(loopback) {
+            size_t i = peer_index(to, "peer");
+            deliver(remote, remote_peers[i], message);
+        }
+    } else if(capture) {
+        if(ncaptured == captured_alloc) {
+            captured_alloc = captured_alloc ? captured_alloc * 2 : 1024;
+            captured = realloc(captured, captured_alloc * sizeof(Captured));
+        }
+        captured[ncaptured].peer = peer_index(to, "local");
+        captured[ncaptured].message = strdup(message);
+        ncaptured++;
+        if(!is_partial_fragment(message)) {
+            captured_msgs++;
+        }
+    } else {
+        size_t i = peer_index(to, "local");
+        deliver(local, local_peers[i], message);
+    }
+}
+
+void Xmpp_Send_State(Xmpp *xmpp, const char *to, enum XmppChatstate s) {
+    
+}
+
+/*
+ * runs the main loop until done returns true
+ * returns 1 on timeout
+ */
+static int loop_run(int(*done)(void), int timeout) {
+    uint64_t end = bench_time() + (uint64_t)timeout * 1000000000;
+    while(!done()) {
+        pthread_mutex_lock(&loop_lock);
+        while(!calls_begin) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if(ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&loop_cond, &loop_lock, &ts);
+            if(bench_time() > end) {
+                pthread_mutex_unlock(&loop_lock);
+                return 1;
+            }
+        }
+        BenchCall *call = calls_begin;
+        calls_begin = NULL;
+        calls_end = NULL;
+        pthread_mutex_unlock(&loop_lock);
+        
+        while(call) {
+            BenchCall *next = call->next;
+            call->callback(call->xmpp, call->userdata);
+            free(call);
+            call = next;
+        }
+    }
+    return 0;
+}
+
+// ------------------------- phase conditions -------------------------
+
+static size_t ake_begin;
+static size_t ake_end;
+
+static int ake_done(void) {
+    for(size_t i=ake_begin;i<ake_end;i++) {
+        if(otr_context_msgstate(local, local_peers[i]) != OTRL_MSGSTATE_ENCRYPTED
+                || otr_context_msgstate(remote, remote_peers[i]) != OTRL_MSGSTATE_ENCRYPTED)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint64_t expected;
+
+static int messages_done(void) {
+    return bench_app.messages >= expected;
+}
+
+static int sent_done(void) {
+    return sent >= expected;
+}
+
+static int captured_done(void) {
+    return captured_msgs >= expected;
+}
+
+// ------------------------- setup -------------------------
+
+/*
+ * creates one dsa key for both accounts
+ */
+static int create_keys(const char *configdir) {
+    char *tmpfile = NULL;
+    asprintf(&tmpfile, "%s/bench.key", configdir);
+    OtrlUserState us = otrl_userstate_create();
+    gcry_error_t err = otrl_privkey_generate(us, tmpfile, "bench", "xmpp");
+    unlink(tmpfile);
+    free(tmpfile);
+    OtrlPrivKey *key = otrl_privkey_find(us, "bench", "xmpp");
+    if(err || !key) {
+        fprintf(stderr, "otrl_privkey_generate failed\n");
+        return 1;
+    }
+    
+    size_t keylen = gcry_sexp_sprint(key->privkey, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+    char *keystr = malloc(keylen);
+    gcry_sexp_sprint(key->privkey, GCRYSEXP_FMT_ADVANCED, keystr, keylen);
+    
+    char *path = app_configfile("otr.private_key");
+    FILE *out = fopen(path, "w");
+    free(path);
+    if(!out) {
+        perror("fopen");
+        return 1;
+    }
+    fprintf(out, "(privkeys\n");
+    fprintf(out, " (account\n  (name \"%s\")\n  (protocol xmpp)\n%s )\n", LOCAL_JID, keystr);
+    fprintf(out, " (account\n  (name \"%s\")\n  (protocol xmpp)\n%s )\n", REMOTE_JID, keystr);
+    fprintf(out, ")\n");
+    fclose(out);
+    
+    free(keystr);
+    otrl_userstate_free(us);
+    return 0;
+}
+
+/*
+ * generates the instance tags before the userstates are loaded,
+ * so that all worker shards use the same instance tag
+ */
+static void create_instags(void) {
+    char *path = app_configfile("otr.instance_tags");
+    OtrlUserState us = otrl_userstate_create();
+    otrl_instag_generate(us, path, LOCAL_JID, "xmpp");
+    otrl_instag_generate(us, path, REMOTE_JID, "xmpp");
+    otrl_userstate_free(us);
+    free(path);
+}
+
+/*
+ * creates an endpoint like XmppCreate
+ */
+static Xmpp* create_endpoint(const char *jid, int nworkers, size_t fragsize) {
+    Xmpp *xmpp = calloc(1, sizeof(Xmpp));
+    xmpp->settings.jid = strdup(jid);
+    xmpp->created = monotime_ns();
+    pthread_mutex_init(&xmpp->otr_lock, NULL);
+    pthread_cond_init(&xmpp->otr_cond, NULL);
+    pthread_mutex_init(&xmpp->otr_persist.lock, NULL);
+    pthread_cond_init(&xmpp->otr_persist.cond, NULL);
+    pthread_mutex_init(&xmpp->otr_contexts.lock, NULL);
+    xmpp->otr_output.fragment_size = fragsize;
+    xmpp->userstate = otrl_userstate_create();
+    xmpp->otr_opdata.xmpp = xmpp;
+    xmpp->otr_opdata.userstate = xmpp->userstate;
+    otr_load_state(xmpp);
+    otr_set_workers(xmpp, nworkers);
+    otr_wait_state(xmpp, "otrbench");
+    xmpp->running = 1;
+    return xmpp;
+}
+
+static size_t count_contexts(OtrlUserState us) {
+    size_t n = 0;
+    for(ConnContext *ctx=us->context_root;ctx;ctx=ctx->next) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * number of ConnContexts of an endpoint, the workers must be idle
+ */
+static size_t endpoint_contexts(Xmpp *xmpp) {
+    if(!xmpp->otr_pool) {
+        return count_contexts(xmpp->userstate);
+    }
+    size_t n = 0;
+    for(int i=0;i<xmpp->otr_pool->nworkers;i++) {
+        n += count_contexts(xmpp->otr_pool->workers[i].opdata.userstate);
+    }
+    return n;
+}
+
+static char* create_body(size_t len) {
+    char *body = malloc(len + 1);
+    for(size_t i=0;i<len;i++) {
+        body[i] = 'a' + i % 26;
+    }
+    body[len] = 0;
+    return body;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-d dhpool] [-f fragsize] [-p peers] [-n count] [-s sizes] [-t timeout] [-v]\n\n", prog);
+    fprintf(stderr, "  -w workers   otr worker threads of the local endpoint, 0: xmpp thread only (default: 0)\n");
+    fprintf(stderr, "  -d dhpool    DH keypair pool size, 0: disabled (default: 0)\n");
+    fprintf(stderr, "  -f fragsize  max otr message size (default: %d)\n", OTR_FRAGMENT_SIZE_DEFAULT);
+    fprintf(stderr, "  -p peers     number of otr sessions per AKE phase (default: 16)\n");
+    fprintf(stderr, "  -n count     number of messages per size (default: 2000)\n");
+    fprintf(stderr, "  -s sizes     comma separated message sizes (default: %s)\n", DEFAULT_SIZES);
+    fprintf(stderr, "  -t timeout   timeout in seconds (default: 60)\n");
+    fprintf(stderr, "  -v           enable otr logging\n");
+}
+
+static double rate(uint64_t count, uint64_t ns) {
+    return ns > 0 ? (double)count / ((double)ns / 1e9) : 0;
+}
+
+/*
+ * measures the decrypt and encrypt throughput of the local endpoint
+ * for messages with bodysize bytes
+ * returns 1 on timeout
+ */
+static int bench_size(FILE *out, size_t bodysize, size_t count, int timeout) {
+    char *body = create_body(bodysize);
+    
+    // the remote endpoint encrypts the messages, this is not measured
+    capture = 1;
+    ncaptured = 0;
+    captured_msgs = 0;
+    expected = count;
+    for(size_t i=0;i<count;i++) {
+        otr_send_message(remote, remote_peers[i % npeers], body);
+    }
+    if(loop_run(captured_done, timeout)) {
+        fprintf(stderr, "timeout: size %zu: %llu/%zu messages encrypted by the remote endpoint\n", bodysize, (unsigned long long)captured_msgs, count);
+        return 1;
+    }
+    capture = 0;
+    
+    // decrypt
+    bench_app.messages = 0;
+    uint64_t decrypt_start = bench_time();
+    for(size_t i=0;i<ncaptured;i++) {
+        otr_receive_message(local, local_peers[captured[i].peer], captured[i].message);
+        free(captured[i].message);
+    }
+    int err = loop_run(messages_done, timeout);
+    uint64_t decrypt_time = bench_time() - decrypt_start;
+    uint64_t decrypted = bench_app.messages;
+    
+    // encrypt, the remote endpoint doesn't receive these messages
+    loopback = 0;
+    sent = 0;
+    stanzas = 0;
+    uint64_t encrypt_start = bench_time();
+    for(size_t i=0;i<count;i++) {
+        otr_send_message(local, local_peers[i % npeers], body);
+    }
+    err |= loop_run(sent_done, timeout);
+    uint64_t encrypt_time = bench_time() - encrypt_start;
+    loopback = 1;
+    
+    if(err) {
+        fprintf(stderr, "timeout: size %zu\n", bodysize);
+    }
+    
+    double mb = (double)bodysize / (1024 * 1024);
+    fprintf(out, "size %-7zu decrypt %8.0f msgs/s %7.1f MB/s  encrypt %8.0f msgs/s %7.1f MB/s  %llu stanzas\n",
+            bodysize,
+            rate(decrypted, decrypt_time),
+            rate(decrypted, decrypt_time) * mb,
+            rate(sent, encrypt_time),
+            rate(sent, encrypt_time) * mb,
+            (unsigned long long)stanzas);
+    
+    free(body);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    int nworkers = 0;
+    size_t dhpool = 0;
+    size_t fragsize = 0;
+    size_t count = 2000;
+    const char *sizes = DEFAULT_SIZES;
+    int timeout = 60;
+    npeers = 16;
+    
+    int c;
+    while((c = getopt(argc, argv, "w:d:f:p:n:s:t:vh")) != -1) {
+        switch(c) {
+            case 'w': nworkers = atoi(optarg); break;
+            case 'd': dhpool = strtoull(optarg, NULL, 10); break;
+            case 'f': fragsize = strtoull(optarg, NULL, 10); break;
+            case 'p': npeers = strtoull(optarg, NULL, 10); break;
+            case 'n': count = strtoull(optarg, NULL, 10); break;
+            case 's': sizes = optarg; break;
+            case 't': timeout = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: {
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+            }
+        }
+    }
+    if(npeers == 0) {
+        npeers = 1;
+    }
+    
+    // otr.c prints internal messages to stdout
+    int report = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if(report < 0 || devnull < 0) {
+        perror("open");
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    FILE *out = fdopen(report, "w");
+    
+    char configdir[] = "/tmp/otrbench.XXXXXX";
+    if(!mkdtemp(configdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    bench_app.configdir = configdir;
+    
+    OTRL_INIT;
+    
+    // peers 0..npeers-1: sequential AKE, npeers..2*npeers-1: parallel AKE
+    local_peers = calloc(npeers * 2, sizeof(char*));
+    remote_peers = calloc(npeers * 2, sizeof(char*));
+    for(size_t i=0;i<npeers*2;i++) {
+        asprintf(&local_peers[i], "peer%zu@localhost", i);
+        asprintf(&remote_peers[i], "local%zu@localhost", i);
+    }
+    
+    if(create_keys(configdir)) {
+        return 1;
+    }
+    create_instags();
+    
+    local = create_endpoint(LOCAL_JID, nworkers, fragsize);
+    remote = create_endpoint(REMOTE_JID, 0, fragsize);
+    
+    // the pool is used by both endpoints, wait until it is filled
+    if(dhpool > 0) {
+        if(otrdh_pool_init(dhpool)) {
+            fprintf(stderr, "DH keypair pool not available (unpatched libotr)\n");
+            return 1;
+        }
+        OtrDHPoolStats stats;
+        do {
+            usleep(10000);
+            otrdh_pool_stats(&stats);
+        } while(stats.available < stats.size);
+    }
+    
+    BenchUsage usage_start;
+    bench_usage(&usage_start);
+    
+    // AKE latency: one handshake after another, from start_otr until
+    // both endpoints are secure
+    BenchSamples ake_latency = {0};
+    for(size_t i=0;i<npeers;i++) {
+        uint64_t start = bench_time();
+        ake_begin = i;
+        ake_end = i + 1;
+        start_otr(local, local_peers[i]);
+        if(loop_run(ake_done, timeout)) {
+            fprintf(stderr, "timeout: %zu/%zu sessions established\n", i, npeers);
+            return 1;
+        }
+        bench_samples_add(&ake_latency, bench_time() - start);
+    }
+    OtrDHPoolStats ake_pool;
+    otrdh_pool_stats(&ake_pool);
+    
+    // AKE throughput: all handshakes at once
+    size_t contexts_start = endpoint_contexts(local) + endpoint_contexts(remote);
+    size_t heap_start = bench_heap_used();
+    uint64_t parallel_start = bench_time();
+    ake_begin = npeers;
+    ake_end = npeers * 2;
+    for(size_t i=npeers;i<npeers*2;i++) {
+        start_otr(local, local_peers[i]);
+    }
+    if(loop_run(ake_done, timeout)) {
+        fprintf(stderr, "timeout: parallel AKE\n");
+        return 1;
+    }
+    uint64_t parallel_time = bench_time() - parallel_start;
+    size_t heap_end = bench_heap_used();
+    size_t contexts = endpoint_contexts(local) + endpoint_contexts(remote) - contexts_start;
+    
+    fprintf(out, "workers:    %d\n", nworkers);
+    fprintf(out, "dhpool:     %zu\n", dhpool);
+    fprintf(out, "fragsize:   %zu\n", fragsize ? fragsize : OTR_FRAGMENT_SIZE_DEFAULT);
+    fprintf(out, "peers:      %zu\n", npeers);
+    fprintf(out, "count:      %zu\n", count);
+    fprintf(out, "ake:        p50 %.2f ms  p99 %.2f ms\n",
+            (double)bench_samples_percentile(&ake_latency, 50) / 1e6,
+            (double)bench_samples_percentile(&ake_latency, 99) / 1e6);
+    fprintf(out, "ake/s:      %.1f (%zu parallel handshakes)\n", rate(npeers, parallel_time), npeers);
+    if(dhpool > 0) {
+        fprintf(out, "ake dh:     %llu from pool  %llu generated\n", (unsigned long long)ake_pool.hits, (unsigned long long)ake_pool.misses);
+    }
+    if(heap_end > heap_start && contexts > 0) {
+        fprintf(out, "memory:     %zu bytes per ConnContext (%zu contexts)\n", (heap_end - heap_start) / contexts, contexts);
+    }
+    fflush(out);
+    
+    int err = 0;
+    const char *s = sizes;
+    while(*s && !err) {
+        char *end;
+        size_t bodysize = strtoull(s, &end, 10);
+        if(end == s) {
+            fprintf(stderr, "invalid size list: %s\n", sizes);
+            return 1;
+        }
+        err = bench_size(out, bodysize, count, timeout);
+        s = *end == ',' ? end + 1 : end;
+    }
+    
+    BenchUsage usage_end;
+    bench_usage(&usage_end);
+    
+    otr_flush_fingerprints(local);
+    
+    fprintf(out, "cpu:        user %.3f s  sys %.3f s\n", usage_end.user - usage_start.user, usage_end.sys - usage_start.sys);
+    fprintf(out, "maxrss:     %ld kB\n", usage_end.maxrss);
+    fclose(out);
+    
+    return err;
+}
@@ -0,0 +1,228 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * xmppbench: headless benchmark of the xmpp/otr core
+ *
+ * Runs the Xmpp event loop against a local fake server (fakeserver.c) and
+ * reports the throughput and latency of the stanza handlers, the cpu time
+ * and the memory usage. The UI is replaced by app_stub.c.
+ */
+
+#include "bench.h"
+#include "fakeserver.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <strophe.h>
+#include <libotr/proto.h>
+
+#include "xmpp.h"
+#include "app.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s scenario] [-n count] [-r rate] [-c contacts] [-b bodysize] [-t timeout] [-v]\n\n", prog);
+    fprintf(stderr, "Scenarios: messages (default), roster, presence, chatstate\n");
+    fprintf(stderr, "  -n count     number of stanzas (default: 10000)\n");
+    fprintf(stderr, "  -r rate      stanzas per second, 0: unlimited (default: 0)\n");
+    fprintf(stderr, "  -c contacts  roster size and number of senders (default: 100)\n");
+    fprintf(stderr, "  -b bodysize  message body size (default: 64)\n");
+    fprintf(stderr, "  -t timeout   timeout in seconds (default: 60)\n");
+    fprintf(stderr, "  -v           enable xmpp logging\n");
+}
+
+static int parse_scenario(const char *str, enum FakeServerScenario *scenario) {
+    if(!strcmp(str, "messages")) {
+        *scenario = FAKESERVER_MESSAGES;
+    } else if(!strcmp(str, "roster")) {
+        *scenario = FAKESERVER_ROSTER;
+    } else if(!strcmp(str, "presence")) {
+        *scenario = FAKESERVER_PRESENCE;
+    } else if(!strcmp(str, "chatstate")) {
+        *scenario = FAKESERVER_CHATSTATE;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    FakeServerConfig cfg = {
+        .scenario = FAKESERVER_MESSAGES,
+        .count = 10000,
+        .rate = 0,
+        .contacts = 100,
+        .bodysize = 64
+    };
+    const char *scenario_name = "messages";
+    int timeout = 60;
+    int verbose = 0;
+    
+    int c;
+    while((c = getopt(argc, argv, "s:n:r:c:b:t:vh")) != -1) {
+        switch(c) {
+            case 's': {
+                if(parse_scenario(optarg, &cfg.scenario)) {
+                    fprintf(stderr, "unknown scenario: %s\n", optarg);
+                    return 1;
+                }
+                scenario_name = optarg;
+                break;
+            }
+            case 'n': cfg.count = strtoull(optarg, NULL, 10); break;
+            case 'r': cfg.rate = strtoull(optarg, NULL, 10); break;
+            case 'c': cfg.contacts = strtoull(optarg, NULL, 10); break;
+            case 'b': cfg.bodysize = strtoull(optarg, NULL, 10); break;
+            case 't': timeout = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: {
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+            }
+        }
+    }
+    if(cfg.contacts == 0) {
+        cfg.contacts = 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    // the roster handler prints every contact to stdout
+    int report = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if(report < 0 || devnull < 0) {
+        perror("open");
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    FILE *out = fdopen(report, "w");
+    
+    char configdir[] = "/tmp/xmppbench.XXXXXX";
+    if(!mkdtemp(configdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    bench_app.configdir = configdir;
+    
+    unsigned short port = 0;
+    pid_t server = fakeserver_start(&cfg, &port);
+    if(server < 0) {
+        return 1;
+    }
+    
+    xmpp_initialize();
+    OTRL_INIT;
+    XmppSetLogLevel(verbose ? XMPP_LEVEL_DEBUG : XMPP_LEVEL_ERROR);
+    
+    XmppSettings settings = {0};
+    settings.jid = strdup("bench@localhost");
+    settings.password = strdup("bench");
+    settings.resource = strdup("bench");
+    settings.host = strdup("127.0.0.1");
+    settings.port = port;
+    settings.flags = XMPP_CONN_FLAG_DISABLE_TLS;
+    
+    Xmpp *xmpp = XmppCreate(settings);
+    XmppSetStartupPresence(xmpp, 1, NULL, NULL);
+    
+    BenchUsage usage_start;
+    bench_usage(&usage_start);
+    uint64_t start = bench_time();
+    
+    if(XmppRun(xmpp)) {
+        fprintf(stderr, "XmppRun failed\n");
+        kill(server, SIGTERM);
+        return 1;
+    }
+    
+    int err = bench_app_wait(timeout);
+    uint64_t end = bench_time();
+    BenchUsage usage_end;
+    bench_usage(&usage_end);
+    
+    XmppStop(xmpp);
+    
+    int status;
+    uint64_t kill_time = bench_time() + 2000000000;
+    while(waitpid(server, &status, WNOHANG) == 0) {
+        if(bench_time() > kill_time) {
+            kill(server, SIGTERM);
+            waitpid(server, &status, 0);
+            break;
+        }
+        usleep(10000);
+    }
+    
+    if(err) {
+        fprintf(stderr, "timeout\n");
+    }
+    
+    pthread_mutex_lock(&bench_app.lock);
+    uint64_t events = bench_app.messages + bench_app.presences + bench_app.chatstates + bench_app.rosters;
+    double elapsed = (double)(end - start) / 1e9;
+    double handler_time = bench_app.last > bench_app.first ? (double)(bench_app.last - bench_app.first) / 1e9 : 0;
+    
+    fprintf(out, "scenario:   %s\n", scenario_name);
+    fprintf(out, "count:      %zu\n", cfg.count);
+    fprintf(out, "rate:       %zu/s\n", cfg.rate);
+    fprintf(out, "contacts:   %zu\n", cfg.contacts);
+    fprintf(out, "bodysize:   %zu\n", cfg.bodysize);
+    fprintf(out, "messages:   %llu\n", (unsigned long long)bench_app.messages);
+    fprintf(out, "presences:  %llu\n", (unsigned long long)bench_app.presences);
+    fprintf(out, "chatstates: %llu\n", (unsigned long long)bench_app.chatstates);
+    fprintf(out, "rosters:    %llu (%llu contacts)\n", (unsigned long long)bench_app.rosters, (unsigned long long)bench_app.contacts);
+    fprintf(out, "elapsed:    %.3f s\n", elapsed);
+    if(handler_time > 0) {
+        fprintf(out, "throughput: %.0f stanzas/s\n", (double)events / handler_time);
+    }
+    if(bench_app.latency.length > 0) {
+        fprintf(out, "latency:    p50 %.1f us  p99 %.1f us  max %.1f us\n",
+                (double)bench_samples_percentile(&bench_app.latency, 50) / 1000,
+                (double)bench_samples_percentile(&bench_app.latency, 99) / 1000,
+                (double)bench_samples_percentile(&bench_app.latency, 100) / 1000);
+    }
+    fprintf(out, "cpu:        user %.3f s  sys %.3f s\n", usage_end.user - usage_start.user, usage_end.sys - usage_start.sys);
+    fprintf(out, "maxrss:     %ld kB\n", usage_end.maxrss);
+    pthread_mutex_unlock(&bench_app.lock);
+    fclose(out);
+    
+    char *files[] = { "otr.private_key", "otr.fingerprints", "otr.instance_tags", NULL };
+    for(int i=0;files[i];i++) {
+        char *path = app_configfile(files[i]);
+        unlink(path);
+        free(path);
+    }
+    rmdir(configdir);
+    
+    return err;
+}
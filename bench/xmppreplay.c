@@ -0,0 +1,401 @@
+/*
+ * DO NOT ALTER OR REMOVE COPYRIGHT NOTICES OR THIS HEADER.
+ *
+ * Copyright 2024 Olaf Wintermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * xmppreplay: replays a captured inbound XML stream into the stanza handlers
+ *
+ * The capture file is created by the app with XmppSetCaptureFile (config
+ * key "capturefile"). Every top-level message, presence and roster result
+ * is parsed with libstrophe and passed directly to message_cb, presence_cb
+ * or query_roster_cb. There is no socket and no event loop, the app.h
+ * functions are implemented by app_stub.c.
+ *
+ * xmpp.c is included to get access to the static handler functions.
+ */
+
+#include "xmpp.c"
+
+#include "bench.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __GLIBC__
+/*
+ * count allocations by replacing the glibc malloc entry points
+ * this also covers libstrophe and libotr allocations
+ */
+#define REPLAY_COUNT_ALLOCS
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nelem, size_t elsize);
+extern void* __libc_realloc(void *ptr, size_t size);
+
+static uint64_t replay_allocs;
+
+void* malloc(size_t size) {
+    replay_allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nelem, size_t elsize) {
+    replay_allocs++;
+    return __libc_calloc(nelem, elsize);
+}
+
+void* realloc(void *ptr, size_t size) {
+    replay_allocs++;
+    return __libc_realloc(ptr, size);
+}
+#else
+static uint64_t replay_allocs;
+#endif
+
+enum ReplayHandler {
+    REPLAY_MESSAGE = 0,
+    REPLAY_PRESENCE,
+    REPLAY_ROSTER,
+    REPLAY_NUM_HANDLERS
+};
+
+static const char *handler_names[] = { "message_cb", "presence_cb", "query_roster_cb" };
+
+typedef struct ReplayStanza {
+    char *xml;
+    enum ReplayHandler handler;
+} ReplayStanza;
+
+typedef struct ReplayStats {
+    uint64_t stanzas;
+    uint64_t bytes;
+    uint64_t parse_ns;
+    uint64_t handler_ns;
+    uint64_t parse_allocs;
+    uint64_t handler_allocs;
+} ReplayStats;
+
+static char* read_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat s;
+    if(fstat(fd, &s)) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    
+    char *buf = malloc(s.st_size + 1);
+    size_t pos = 0;
+    while(pos < (size_t)s.st_size) {
+        ssize_t r = read(fd, buf + pos, s.st_size - pos);
+        if(r <= 0) {
+            break;
+        }
+        pos += r;
+    }
+    close(fd);
+    buf[pos] = 0;
+    *len = pos;
+    return buf;
+}
+
+/*
+ * returns the end of the tag starting at p or NULL
+ */
+static const char* tag_end(const char *p, const char *end) {
+    char quote = 0;
+    for(;p<end;p++) {
+        if(quote) {
+            if(*p == quote) {
+                quote = 0;
+            }
+        } else if(*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if(*p == '>') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int stanza_handler(const char *xml, size_t len, enum ReplayHandler *handler) {
+    if(len > 8 && !memcmp(xml, "<message", 8)) {
+        *handler = REPLAY_MESSAGE;
+        return 1;
+    }
+    if(len > 9 && !memcmp(xml, "<presence", 9)) {
+        *handler = REPLAY_PRESENCE;
+        return 1;
+    }
+    if(len > 3 && !memcmp(xml, "<iq", 3)) {
+        // only roster query results are handled by query_roster_cb
+        const char *tagend = tag_end(xml, xml + len);
+        if(tagend && memmem(xml, tagend - xml, "result", 6) && memmem(xml, len, "jabber:iq:roster", 16)) {
+            *handler = REPLAY_ROSTER;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * splits the captured stream into top-level elements and returns
+ * all stanzas that have a handler
+ */
+static ReplayStanza* split_stream(const char *buf, size_t len, size_t *nstanzas) {
+    size_t alloc = 1024;
+    size_t n = 0;
+    ReplayStanza *stanzas = calloc(alloc, sizeof(ReplayStanza));
+    
+    const char *end = buf + len;
+    const char *start = NULL;
+    int depth = 0;
+    const char *p = buf;
+    while(p < end) {
+        p = memchr(p, '<', end - p);
+        if(!p) {
+            break;
+        }
+        const char *t = tag_end(p, end);
+        if(!t) {
+            break; // incomplete capture
+        }
+        
+        const char *elm = NULL;
+        if(p[1] == '?' || p[1] == '!') {
+            // xml declaration or comment
+        } else if(!strncmp(p, "<stream:stream", 14)) {
+            depth = 1; // stream start or restart
+        } else if(p[1] == '/') {
+            depth--;
+            if(depth == 1) {
+                elm = start;
+            } else if(depth < 1) {
+                depth = 0; // </stream:stream>
+            }
+        } else if(t[-1] == '/') {
+            if(depth == 1) {
+                elm = p;
+            }
+        } else {
+            depth++;
+            if(depth == 2) {
+                start = p;
+            }
+        }
+        p = t + 1;
+        
+        enum ReplayHandler handler;
+        if(elm && stanza_handler(elm, p - elm, &handler)) {
+            if(n >= alloc) {
+                alloc *= 2;
+                stanzas = realloc(stanzas, alloc * sizeof(ReplayStanza));
+            }
+            stanzas[n].xml = strndup(elm, p - elm);
+            stanzas[n].handler = handler;
+            n++;
+        }
+    }
+    
+    *nstanzas = n;
+    return stanzas;
+}
+
+static void replay(Xmpp *xmpp, ReplayStanza *stanzas, size_t nstanzas, ReplayStats *stats) {
+    for(size_t i=0;i<nstanzas;i++) {
+        ReplayStanza *s = &stanzas[i];
+        ReplayStats *st = &stats[s->handler];
+        
+        // query_roster_cb frees the query object
+        XmppQuery *xquery = NULL;
+        if(s->handler == REPLAY_ROSTER) {
+            xquery = malloc(sizeof(XmppQuery));
+            xquery->xmpp = xmpp;
+            xquery->id = strdup("replay");
+        }
+        
+        uint64_t allocs0 = replay_allocs;
+        uint64_t t0 = bench_time();
+        xmpp_stanza_t *stanza = xmpp_stanza_new_from_string(xmpp->ctx, s->xml);
+        uint64_t t1 = bench_time();
+        uint64_t allocs1 = replay_allocs;
+        if(!stanza) {
+            fprintf(stderr, "parse error: %.80s\n", s->xml);
+            if(xquery) {
+                free(xquery->id);
+                free(xquery);
+            }
+            continue;
+        }
+        
+        switch(s->handler) {
+            case REPLAY_MESSAGE: message_cb(xmpp->connection, stanza, xmpp); break;
+            case REPLAY_PRESENCE: presence_cb(xmpp->connection, stanza, xmpp); break;
+            case REPLAY_ROSTER: query_roster_cb(xmpp->connection, stanza, xquery); break;
+            default: break;
+        }
+        uint64_t t2 = bench_time();
+        uint64_t allocs2 = replay_allocs;
+        
+        xmpp_stanza_release(stanza);
+        
+        st->stanzas++;
+        st->bytes += strlen(s->xml);
+        st->parse_ns += t1 - t0;
+        st->handler_ns += t2 - t1;
+        st->parse_allocs += allocs1 - allocs0;
+        st->handler_allocs += allocs2 - allocs1;
+    }
+}
+
+static void print_stats(FILE *out, const char *name, ReplayStats *st) {
+    if(st->stanzas == 0) {
+        return;
+    }
+    double n = (double)st->stanzas;
+    fprintf(out, "%-16s %10llu %10.0f %12.0f %12.0f", name,
+            (unsigned long long)st->stanzas,
+            (double)st->bytes / n,
+            (double)st->parse_ns / n,
+            (double)st->handler_ns / n);
+#ifdef REPLAY_COUNT_ALLOCS
+    fprintf(out, " %12.1f %14.1f\n", (double)st->parse_allocs / n, (double)st->handler_allocs / n);
+#else
+    fprintf(out, " %12s %14s\n", "-", "-");
+#endif
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i iterations] [-w warmup] [-v] capturefile\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 10;
+    int warmup = 1;
+    int verbose = 0;
+    
+    int c;
+    while((c = getopt(argc, argv, "i:w:vh")) != -1) {
+        switch(c) {
+            case 'i': iterations = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default: {
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+            }
+        }
+    }
+    if(optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    size_t len = 0;
+    char *buf = read_file(argv[optind], &len);
+    if(!buf) {
+        return 1;
+    }
+    size_t nstanzas = 0;
+    ReplayStanza *stanzas = split_stream(buf, len, &nstanzas);
+    free(buf);
+    if(nstanzas == 0) {
+        fprintf(stderr, "no stanzas found\n");
+        return 1;
+    }
+    
+    // the handlers print to stdout
+    int report = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if(report < 0 || devnull < 0) {
+        perror("open");
+        return 1;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    FILE *out = fdopen(report, "w");
+    
+    char configdir[] = "/tmp/xmppreplay.XXXXXX";
+    if(!mkdtemp(configdir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    bench_app.configdir = configdir;
+    
+    xmpp_initialize();
+    OTRL_INIT;
+    XmppSetLogLevel(verbose ? XMPP_LEVEL_DEBUG : XMPP_LEVEL_ERROR);
+    
+    XmppSettings settings = {0};
+    settings.jid = strdup("replay@localhost");
+    settings.resource = strdup("replay");
+    Xmpp *xmpp = XmppCreate(settings);
+    xmpp->connection = xmpp_conn_new(xmpp->ctx); // never connected
+    im_account = xmpp;
+    
+    ReplayStats stats[REPLAY_NUM_HANDLERS];
+    for(int i=0;i<warmup;i++) {
+        memset(stats, 0, sizeof(stats));
+        replay(xmpp, stanzas, nstanzas, stats);
+    }
+    memset(stats, 0, sizeof(stats));
+    for(int i=0;i<iterations;i++) {
+        replay(xmpp, stanzas, nstanzas, stats);
+    }
+    
+    ReplayStats total = {0};
+    for(int i=0;i<REPLAY_NUM_HANDLERS;i++) {
+        total.stanzas += stats[i].stanzas;
+        total.bytes += stats[i].bytes;
+        total.parse_ns += stats[i].parse_ns;
+        total.handler_ns += stats[i].handler_ns;
+        total.parse_allocs += stats[i].parse_allocs;
+        total.handler_allocs += stats[i].handler_allocs;
+    }
+    
+    fprintf(out, "stanzas: %zu, iterations: %d\n\n", nstanzas, iterations);
+    fprintf(out, "%-16s %10s %10s %12s %12s %12s %14s\n", "handler", "stanzas", "bytes", "parse ns", "handler ns", "parse allocs", "handler allocs");
+    for(int i=0;i<REPLAY_NUM_HANDLERS;i++) {
+        print_stats(out, handler_names[i], &stats[i]);
+    }
+    print_stats(out, "total", &total);
+    fclose(out);
+    
+    char *files[] = { "otr.private_key", "otr.fingerprints", "otr.instance_tags", NULL };
+    for(int i=0;files[i];i++) {
+        char *path = app_configfile(files[i]);
+        unlink(path);
+        free(path);
+    }
+    rmdir(configdir);
+    
+    return 0;
+}
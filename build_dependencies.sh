@@ -305,6 +305,59 @@ __EOF__
 chmod +x install/bin/libgcrypt-config
 
 cd $DIR_LIBOTR
+
+# DH keypair source hook, used by the IM4 DH keypair pool (IM4/otrdh.c)
+# otrl_dh_gen_keypair first asks the keypair source and falls back to
+# otrl_dh_gen_keypair_fresh
+sed -i '' 's/^gcry_error_t otrl_dh_gen_keypair(/gcry_error_t otrl_dh_gen_keypair_fresh(/' src/dh.c
+if ! grep -q "^gcry_error_t otrl_dh_gen_keypair_fresh(" src/dh.c; then
+	echo "libotr: cannot add the dh keypair source hook"
+	exit 2
+fi
+
+cat >> src/dh.c << __EOF__
+
+static OtrlDHKeypairSource dh_keypair_source;
+
+void otrl_dh_set_keypair_source(OtrlDHKeypairSource source)
+{
+    dh_keypair_source = source;
+}
+
+gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp)
+{
+    OtrlDHKeypairSource source = dh_keypair_source;
+    if (source && source(groupid, kp) == 0) {
+	return gcry_error(GPG_ERR_NO_ERROR);
+    }
+    return otrl_dh_gen_keypair_fresh(groupid, kp);
+}
+__EOF__
+
+cat >> src/dh.h << __EOF__
+
+#ifndef OTRL_DH_KEYPAIR_SOURCE
+#define OTRL_DH_KEYPAIR_SOURCE 1
+
+/*
+ * Returns 0 and fills kp with a keypair for groupid, or non-zero if
+ * no keypair is available.
+ */
+typedef int (*OtrlDHKeypairSource)(unsigned int groupid, DH_keypair *kp);
+
+/*
+ * Set the function, that otrl_dh_gen_keypair asks first for a keypair.
+ */
+void otrl_dh_set_keypair_source(OtrlDHKeypairSource source);
+
+/*
+ * Generate a DH keypair, without using the keypair source.
+ */
+gcry_error_t otrl_dh_gen_keypair_fresh(unsigned int groupid, DH_keypair *kp);
+
+#endif
+__EOF__
+
 export CFLAGS="$SAVED_CFLAGS -I$INSTALL_DIR/include"
 ./configure --prefix=$INSTALL_DIR
 if [ -$? -ne 0 ]; then